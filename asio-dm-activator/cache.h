@@ -0,0 +1,162 @@
+// Results of driver probing, kept between sessions.
+//
+// Finding out what an ASIO driver is and where to patch it means loading and
+// instantiating it, which is slow and the answer practically never changes. The
+// answer is saved to a small binary file instead, keyed by the identity of the
+// driver dll: path, size, modification time and version. If any of these change,
+// the entry no longer matches, but a dll with the same contents (reinstalled, moved,
+// copied to another driver's folder) still finds it by hash.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <string>
+#include <map>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <system_error>
+#include <cstdint>
+
+
+class ProbeCache {
+public:
+	static constexpr uint32_t Magic = 0x434D4441;	// "ADMC"
+	static constexpr uint32_t FormatVersion = 2;
+
+	struct FileIdentity {
+		std::wstring path;
+		uint64_t size{};
+		uint64_t timestamp{};	// modification time, in whatever units the file system reports
+		uint64_t version{};		// from the version resource, 0 = none
+		bool operator==(const FileIdentity&) const = default;
+	};
+
+	struct Entry {
+		FileIdentity file;
+		std::wstring vendor;	// driver class that accepted the driver, empty = none did
+		std::wstring apiPath;	// vendor API dll the class uses, if any
+		bool native{};			// driver supports direct monitoring by itself
+		uint64_t patchOffset{};	// of the future() vtable slot from the dll base, 0 = not patched
+		uint64_t deviceModel{};	// first device found, for the log only
+		uint64_t hash{};		// of the contents (PeImage::Hash), 0 = unknown
+	};
+
+	// Size and time are taken from the file system, the caller adds the version if it has one
+	static std::optional<FileIdentity> Identify(const std::filesystem::path& path, uint64_t version = 0) {
+		std::error_code ec;
+		FileIdentity id;
+		id.path = path.wstring();
+		id.size = std::filesystem::file_size(path, ec);
+		if (ec) return std::nullopt;
+		auto time = std::filesystem::last_write_time(path, ec);
+		if (ec) return std::nullopt;
+		id.timestamp = (uint64_t)time.time_since_epoch().count();
+		id.version = version;
+		return id;
+	}
+
+	// Entry for the file if it is still the same file
+	std::optional<Entry> Find(const FileIdentity& file) const {
+		auto it = entries.find(file.path);
+		if (it == entries.end() || !(it->second.file == file)) return std::nullopt;
+		return it->second;
+	}
+
+	// Entry of any file with these contents, e.g. the same dll somewhere else
+	std::optional<Entry> FindByHash(uint64_t hash) const {
+		if (!hash) return std::nullopt;
+		for (const auto& [path, entry] : entries)
+			if (entry.hash == hash) return entry;
+		return std::nullopt;
+	}
+
+	// Replaces whatever was known about the file
+	void Store(const Entry& entry) {
+		entries[entry.file.path] = entry;
+		dirty = true;
+	}
+
+	bool IsDirty() const {
+		return dirty;
+	}
+
+	// A missing or damaged file leaves the cache empty
+	bool Load(const std::filesystem::path& path) {
+		entries.clear();
+		std::ifstream in(path, std::ios::binary);
+		if (!in) return false;
+		uint32_t magic{}, format{}, count{};
+		if (!Read(in, magic) || magic != Magic || !Read(in, format) || format != FormatVersion || !Read(in, count))
+			return false;
+		for (uint32_t i = 0; i < count; i++) {
+			Entry e;
+			uint8_t native{};
+			if (!(Read(in, e.file.path) && Read(in, e.file.size) && Read(in, e.file.timestamp) && Read(in, e.file.version)
+				&& Read(in, e.vendor) && Read(in, e.apiPath) && Read(in, native) && Read(in, e.patchOffset) && Read(in, e.deviceModel) && Read(in, e.hash))) {
+				entries.clear();
+				return false;
+			}
+			e.native = native;
+			entries[e.file.path] = e;
+		}
+		dirty = false;
+		return true;
+	}
+
+	// Written to a temporary file first, so a crash never leaves a half-written cache
+	bool Save(const std::filesystem::path& path) {
+		std::error_code ec;
+		std::filesystem::create_directories(path.parent_path(), ec);
+		auto temp = path;
+		temp += L".tmp";
+		{
+			std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+			if (!out) return false;
+			Write(out, Magic);
+			Write(out, FormatVersion);
+			Write(out, (uint32_t)entries.size());
+			for (const auto& [key, e] : entries) {
+				Write(out, e.file.path); Write(out, e.file.size); Write(out, e.file.timestamp); Write(out, e.file.version);
+				Write(out, e.vendor); Write(out, e.apiPath); Write(out, (uint8_t)e.native); Write(out, e.patchOffset); Write(out, e.deviceModel); Write(out, e.hash);
+			}
+			if (!out.flush()) return false;
+		}
+		std::filesystem::rename(temp, path, ec);
+		if (ec) return false;
+		dirty = false;
+		return true;
+	}
+
+private:
+	std::map<std::wstring, Entry> entries;	// by dll path
+	bool dirty{};
+
+	template <typename T>
+	static bool Read(std::istream& in, T& value) {
+		return (bool)in.read((char*)&value, sizeof(T));
+	}
+
+	// Strings are stored as UTF-16 code units, the same on every OS
+	static bool Read(std::istream& in, std::wstring& value) {
+		uint32_t length{};
+		if (!Read(in, length) || length > 32768) return false;
+		value.resize(length);
+		for (auto& c : value) {
+			uint16_t unit{};
+			if (!Read(in, unit)) return false;
+			c = (wchar_t)unit;
+		}
+		return true;
+	}
+
+	template <typename T>
+	static void Write(std::ostream& out, const T& value) {
+		out.write((const char*)&value, sizeof(T));
+	}
+
+	static void Write(std::ostream& out, const std::wstring& value) {
+		Write(out, (uint32_t)value.size());
+		for (auto c : value)
+			Write(out, (uint16_t)c);
+	}
+};
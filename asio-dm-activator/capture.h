@@ -0,0 +1,153 @@
+// Capture of what the host sends, to be replayed later.
+//
+// Field problems depend on the exact sequence and timing of future() calls a host
+// makes. When capturing, every future() call the plugin handles and every control
+// request it sends to a device becomes a fixed-size record in a binary file: when it
+// started, how long it took, on which thread, the decoded parameters and the result.
+// Records are queued lock-free by the calling thread and written in batches by a
+// worker, so a capture costs the host little more than a queued command. A crash
+// loses at most the last batch, the file stays readable up to there.
+// bench/replay.cpp plays a capture back against a simulated device.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include "worker.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+struct CaptureRecord {
+	enum Kind : uint8_t {
+		Future,			// a future() call handled by the plugin
+		ControlGet,		// TUSBAUDIO_AudioControlRequestGet
+		ControlSet,		// TUSBAUDIO_AudioControlRequestSet
+	};
+
+	uint64_t time{};		// ns since the capture started, when the call began
+	uint32_t duration{};	// ns, saturated
+	uint32_t thread{};
+	uint8_t kind{};
+	uint8_t device{};		// index of the device, control requests only
+	uint16_t reserved{};
+	int32_t selector{};		// future() selector, or the virtual channel of a control request
+	int32_t result{};
+	int32_t params[5]{};	// kAsioSetInputMonitor: input, output, gain, state, pan. Control request: the value.
+};
+
+static_assert(sizeof(CaptureRecord) == 48, "Captures are read on other systems");
+
+
+class Capture {
+public:
+	static constexpr uint32_t Magic = 0x544D4441;	// "ADMT"
+	static constexpr uint32_t FormatVersion = 1;
+
+	struct Header {
+		uint32_t magic = Magic;
+		uint32_t version = FormatVersion;
+		uint32_t recordSize = sizeof(CaptureRecord);
+		uint32_t reserved{};
+		uint64_t started{};	// system clock, ns since 1970
+	};
+
+	Capture() = default;
+	Capture(const Capture&) = delete;
+	Capture& operator=(const Capture&) = delete;
+
+	~Capture() {
+		Stop();
+	}
+
+	// Start writing to a new file. Not thread safe, call it before anything is recorded.
+	bool Start(const std::filesystem::path& path) {
+		Stop();
+		std::error_code ec;
+		std::filesystem::create_directories(path.parent_path(), ec);
+		file = std::make_shared<std::ofstream>(path, std::ios::binary | std::ios::trunc);
+		Header header;
+		header.started = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		if (!file->write((const char*)&header, sizeof(header)) || !file->flush()) {
+			file.reset();
+			return false;
+		}
+		epoch = std::chrono::steady_clock::now();
+		writer = std::make_unique<CommandWorker<CaptureRecord, 4096>>([file = file](std::span<CaptureRecord> batch) {
+				file->write((const char*)batch.data(), batch.size_bytes());
+				file->flush();
+				return *file ? 0L : -1L;
+			}, 0L, std::chrono::milliseconds(50), std::chrono::milliseconds(250), nullptr, std::chrono::milliseconds{}, false);	// disk writes don't compete with audio
+		active.store(true, std::memory_order_release);
+		return true;
+	}
+
+	// Records still queued are lost. Not thread safe either, for shutdown.
+	void Stop() {
+		active.store(false, std::memory_order_release);
+		writer.reset();
+		file.reset();
+	}
+
+	// Any thread
+	bool IsActive() const {
+		return active.load(std::memory_order_acquire);
+	}
+
+	// Any thread. Time for CaptureRecord::time.
+	uint64_t Now() const {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// Any thread, never blocks. A call that began at start (Now()) and just returned.
+	void Add(CaptureRecord record, uint64_t start) {
+		if (!IsActive()) return;
+		record.time = start;
+		record.duration = (uint32_t)std::min<uint64_t>(Now() - start, UINT32_MAX);
+		record.thread = ThreadId();
+		writer->Submit(record);
+	}
+
+	// Records that didn't fit in the queue
+	uint64_t Dropped() const {
+		return writer ? writer->GetStatus().rejected : 0;
+	}
+
+	// Records of a capture in the order they were written, nullopt if it's not a
+	// capture or from another version. A record cut short by a crash is left out.
+	static std::optional<std::vector<CaptureRecord>> Load(const std::filesystem::path& path, Header* header = nullptr) {
+		std::ifstream in(path, std::ios::binary);
+		Header h{};
+		if (!in.read((char*)&h, sizeof(h)) || h.magic != Magic || h.version != FormatVersion || h.recordSize != sizeof(CaptureRecord))
+			return std::nullopt;
+		if (header) *header = h;
+		std::vector<CaptureRecord> records;
+		CaptureRecord record;
+		while (in.read((char*)&record, sizeof(record)))
+			records.push_back(record);
+		return records;
+	}
+
+	static uint32_t ThreadId() {
+	#ifdef _WIN32
+		return GetCurrentThreadId();
+	#else
+		return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+	#endif
+	}
+
+private:
+	std::atomic<bool> active{ false };
+	std::chrono::steady_clock::time_point epoch;
+	std::shared_ptr<std::ofstream> file;	// shared with the writer thread
+	std::unique_ptr<CommandWorker<CaptureRecord, 4096>> writer;
+};
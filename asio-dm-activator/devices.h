@@ -0,0 +1,181 @@
+// Mixer topology of known devices.
+//
+// The built-in profiles are a sorted constexpr table, so a lookup is a binary search
+// without allocations. The driver looks its device up once when it is opened. Profiles
+// for new models can be added (or built-in ones corrected) with a text file loaded at
+// startup, one device per line:
+//
+//     # model          entity  inputs  mixes  name
+//     0x0800002708     0x3C    0       3      Audient iD14 mk2
+//
+// Numbers may be decimal or 0x-prefixed hex. inputs = 0 means the count is not known
+// and is probed from the device.
+//
+// A driver with several devices numbers the ASIO inputs of one after the other. Lines
+// starting with "device" list them by serial number, in that order, with the number
+// of ASIO inputs each has (0 = take it from the profile):
+//
+//     device  0A1B2C3D  10
+//
+// Devices not listed follow the listed ones. Nothing here depends on the driver classes.
+
+#pragma once
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <memory>
+#include <cctype>
+#include <cstdint>
+
+
+struct DeviceProfile {
+	uint64_t model{};				// VID & PID as read from the device properties
+	uint8_t mixerEntity{ 0x3C };	// USB audio entity ID of the mixer unit
+	uint8_t inputs{};				// inputs of the Main mix, 0 = not known
+	uint8_t mixes{ 1 };				// Main mix + Cue mixes
+	std::wstring_view name{};
+
+	int CueMixes() const { return mixes - 1; }
+
+	// Distance between the crosspoints of two neighbouring inputs. Every input has
+	// an L and R crosspoint in each mix.
+	int Stride() const { return mixes * 2; }
+
+	constexpr bool operator<(const DeviceProfile& x) const { return model < x.model; }
+};
+
+
+class DeviceDatabase {
+public:
+	// Mix numbers are not verified on real hardware unless noted
+	//     1 = MainMix, 2 = MainMix + Cue, 3 = MainMix + CueA + CueB
+	// Inputs are from the spec sheets, only for models without loopback channels: those
+	// add ASIO inputs depending on the driver version.
+	static constexpr std::array<DeviceProfile, 15> BuiltIn = {{
+		{ 0x0100002708, 0x3C, 10, 3, L"Audient iD22 mk1" },			// from video
+		{ 0x0200002708, 0x3C, 10, 3, L"Audient iD14 mk1" },			// from video, but somewhere 2
+		{ 0x0300002708, 0x3C, 2, 1, L"Audient iD4 mk1" },
+		{ 0x0400002708, 0x3C, 0, 2, L"Audient Sono" },				// from video
+		{ 0x0500002708, 0x3C, 20, 3, L"Audient iD44 mk1" },
+		{ 0x0600002708, 0x3C, 0, 1, L"Audient EVO4" },
+		{ 0x0700002708, 0x3C, 0, 2, L"Audient EVO8" },				// from video
+		{ 0x0800002708, 0x3C, 0, 3, L"Audient iD14 mk2" },			// real hw tested
+		{ 0x0900002708, 0x3C, 0, 1, L"Audient iD4 mk2" },
+		{ 0x0A00002708, 0x3C, 0, 5, L"Audient EVO16" },				// from video
+		{ 0x0B00002708, 0x3C, 0, 5, L"Audient iD44 mk2" },			// from video
+		{ 0x0D00002708, 0x3C, 0, 3, L"Audient iD24 mk2" },			// from video
+		{ 0x0E00002708, 0x3C, 0, 1, L"Audient ORIA" },
+		{ 0x0F00002708, 0x3C, 0, 1, L"Audient iD4 Stream OTG" },
+		{ 0x1000002708, 0x3C, 0, 3, L"Audient iD14 Stream OTG" },
+//		{ 0x__00002708, 0x3C, 0, 5, L"Audient iD48" },				// from video presentation
+	}};
+	static_assert(std::is_sorted(BuiltIn.begin(), BuiltIn.end()), "Keep the built-in profiles sorted by model");
+
+	// Used for devices nobody knows about: Main mix only
+	static constexpr DeviceProfile Default{};
+
+	// Profiles from the file take precedence over the built-in ones
+	const DeviceProfile& Find(uint64_t model) const {
+		if (auto p = Search(extra, model)) return *p;
+		if (auto p = Search(BuiltIn, model)) return *p;
+		return Default;
+	}
+
+	bool IsKnown(uint64_t model) const {
+		return &Find(model) != &Default;
+	}
+
+	// A device listed in the file
+	struct Placement {
+		std::wstring serial;
+		uint8_t inputs{};	// ASIO inputs, 0 = as the profile says
+	};
+
+	// Devices listed in the file, in the order their ASIO inputs are numbered
+	const std::vector<Placement>& Order() const {
+		return order;
+	}
+
+	// Where the device is listed, Order().size() if it isn't
+	size_t Position(std::wstring_view serial) const {
+		size_t i = 0;
+		while (i < order.size() && order[i].serial != serial) i++;
+		return i;
+	}
+
+	// Returns the number of profiles and devices read, lines that can't be parsed are skipped
+	int Load(std::istream& in) {
+		int count = 0;
+		std::string line;
+		while (std::getline(in, line)) {
+			line = line.substr(0, line.find('#'));
+			std::istringstream fields(line);
+			std::string model, entity, inputs, mixes;
+			if (!(fields >> model)) continue;
+			if (model == "device") {
+				if (!(fields >> entity >> inputs)) continue;
+				try {
+					Place({ std::wstring(entity.begin(), entity.end()), (uint8_t)std::stoul(inputs, nullptr, 0) });
+					count++;
+				}
+				catch (const std::exception&) {}
+				continue;
+			}
+			if (!(fields >> entity >> inputs >> mixes)) continue;
+			try {
+				DeviceProfile p;
+				p.model = std::stoull(model, nullptr, 0);
+				p.mixerEntity = (uint8_t)std::stoul(entity, nullptr, 0);
+				p.inputs = (uint8_t)std::stoul(inputs, nullptr, 0);
+				p.mixes = (uint8_t)std::max(1ul, std::stoul(mixes, nullptr, 0));
+				std::string name;
+				std::getline(fields >> std::ws, name);
+				while (!name.empty() && isspace((unsigned char)name.back())) name.pop_back();
+				names.push_back(std::make_unique<std::wstring>(name.begin(), name.end()));
+				p.name = *names.back();
+				Add(p);
+				count++;
+			}
+			catch (const std::exception&) {
+				continue;
+			}
+		}
+		return count;
+	}
+
+	// Returns -1 if the file can't be opened
+	int LoadFile(const std::filesystem::path& path) {
+		std::ifstream in(path);
+		if (!in) return -1;
+		return Load(in);
+	}
+
+private:
+	std::vector<DeviceProfile> extra;	// sorted, loaded from a file
+	std::vector<std::unique_ptr<std::wstring>> names;	// storage for the names of the loaded profiles
+	std::vector<Placement> order;		// in the order of the file
+
+	// A device listed twice keeps its first place
+	void Place(const Placement& placement) {
+		size_t i = Position(placement.serial);
+		if (i < order.size()) order[i].inputs = placement.inputs;
+		else order.push_back(placement);
+	}
+
+	void Add(const DeviceProfile& profile) {
+		auto it = std::lower_bound(extra.begin(), extra.end(), profile);
+		if (it != extra.end() && it->model == profile.model) *it = profile;
+		else extra.insert(it, profile);
+	}
+
+	template <typename Table>
+	static const DeviceProfile* Search(const Table& table, uint64_t model) {
+		auto it = std::lower_bound(table.begin(), table.end(), DeviceProfile{ model });
+		return (it != table.end() && it->model == model) ? &*it : nullptr;
+	}
+};
@@ -12,29 +12,140 @@
 
 #define _WIN32_WINNT 0x0601
 #include "pch.h" 
+#include "worker.h"
+#include "mixer.h"
+#include "session.h"
+#include "devices.h"
+#include "imports.h"
+#include "cache.h"
+#include "log.h"
+#include "thunk.h"
+#include "hooks.h"
+#include "stats.h"
+#include "gain.h"
+#include "snapshot.h"
+#include "capture.h"
+#include "pe.h"
+#include "timing.h"
+#include "transfer.h"
+#include "jitter.h"
+#include "probe.h"
+#include "shared.h"
+#include "monitor.h"
+
+#pragma comment(lib, "version.lib")
 
 #define OK(x) ((x) == ERROR_SUCCESS)
 #define NOT_OK(x) ((x) != ERROR_SUCCESS)
 
-#define dbg(msg) OutputDebugStringW(std::format(L"[ASIO-DM-ACTIVATOR] {} :{}", msg, __LINE__).c_str())
-#define err(msg) {dbg(msg); throw std::runtime_error("err");}
+// Messages are formatted later on the logger thread, so the format must be a literal
+Logger g_log;
+#define logmsg(level, ...) do { if (g_log.Enabled(level)) g_log.Write(level, __LINE__, __VA_ARGS__); } while (0)
+#define trace(...) logmsg(LogLevel::Trace, __VA_ARGS__)
+#define dbg(...) logmsg(LogLevel::Debug, __VA_ARGS__)
+#define err(...) {dbg(__VA_ARGS__); throw std::runtime_error("err");}
+
+// IASIO methods by vtable slot, after the 3 of IUnknown
+enum AsioSlot {
+	kSlotInit = 3, kSlotGetDriverName, kSlotGetDriverVersion, kSlotGetErrorMessage,
+	kSlotStart, kSlotStop, kSlotGetChannels, kSlotGetLatencies, kSlotGetBufferSize,
+	kSlotCanSampleRate, kSlotGetSampleRate, kSlotSetSampleRate, kSlotGetClockSources, kSlotSetClockSource,
+	kSlotGetSamplePosition, kSlotGetChannelInfo, kSlotCreateBuffers, kSlotDisposeBuffers,
+	kSlotControlPanel, kSlotFuture, kSlotOutputReady
+};
+
+const unsigned long kSamplePositionValid = 1 << 1;
 
-const int ASE_SUCCESS = 0x3f4847a0;
-const int ASE_NotPresent = -1000;
-const int kAsioSetInputMonitor = 3;
-const int kAsioCanInputMonitor = 9;
+struct AsioTimeInfo {
+	double speed;
+	unsigned long systemTime[2];		// hi, lo
+	unsigned long samplePosition[2];	// hi, lo
+	double sampleRate;
+	unsigned long flags;
+	char reserved[12];
+};
+
+struct ASIOTime {
+	long reserved[4];
+	AsioTimeInfo timeInfo;
+	// time code follows, not used here
+};
 
-struct ASIOInputMonitor {
-	long input;		// input index (-1 = all)
-	long output;	// output index
-	long gain;		// gain 0..0x7fffffffL (-inf to +12 dB)
-	long state;		// on/off
-	long pan;		// pan, 0..0x7fffffff (left..right)
+struct ASIOCallbacks {
+	void (*bufferSwitch)(long doubleBufferIndex, long directProcess);
+	void (*sampleRateDidChange)(double sRate);
+	long (*asioMessage)(long selector, long value, void* message, double* opt);
+	ASIOTime* (*bufferSwitchTimeInfo)(ASIOTime* params, long doubleBufferIndex, long directProcess);
 };
         
 using AsioFutureFunction = long(*)(void* iasio, long selector, void* params);
+using AsioInitFunction = long(*)(void* iasio, void* sysHandle);
+using AsioStartFunction = long(*)(void* iasio);
+using AsioCreateBuffersFunction = long(*)(void* iasio, void* bufferInfos, long numChannels, long bufferSize, ASIOCallbacks* callbacks);
+using AsioDisposeBuffersFunction = long(*)(void* iasio);
+using AsioGetChannelsFunction = long(*)(void* iasio, long* numInputChannels, long* numOutputChannels);
 using DllGetClassObjectFunction = HRESULT(WINAPI*)(REFCLSID, REFIID, void**);
 
+// Built-in device profiles, extended from a file next to the dll at startup
+DeviceDatabase g_devices;
+
+// Monitoring is switched on and off, restoring the level set in the device mixer. With
+// ASIO_DM_ACTIVATOR_MONITOR=follow the monitor level follows the gain and pan the host sends.
+bool g_followGain = false;
+GainEngine::Settings g_gainSettings;
+
+// Levels the plugin muted, kept across sessions in %LOCALAPPDATA%\asio-dm-activator\mixer-snapshot.bin
+MixerSnapshot g_snapshot;
+
+// Generated stubs and every vtable slot we replaced, of all drivers
+ThunkArena g_thunks;
+HookRegistry g_hooks;
+
+// Counters and latencies, in shared memory once MyInit has published them
+StatsBlock g_localStats;
+StatsBlock* g_stats = &g_localStats;
+
+// future() calls and control requests, for replaying them (ASIO_DM_ACTIVATOR_CAPTURE)
+Capture g_capture;
+
+// Buffer switches of the running stream, monitoring commands are aimed at its boundaries
+BufferClock g_bufferClock;
+
+// Buffer switches timed against the plugin's work, if asked for (ASIO_DM_ACTIVATOR_JITTER)
+JitterMonitor g_jitter;
+
+// The host's ASIO callbacks, wrapped to see every buffer switch. Callbacks have no
+// context, but a host runs one driver at a time.
+namespace hostCallbacks {
+	ASIOCallbacks host{};
+	ASIOCallbacks wrapped{};
+
+	void BufferSwitch(long doubleBufferIndex, long directProcess) {
+		auto start = StatsBlock::Now();
+		g_bufferClock.Tick(start);
+		host.bufferSwitch(doubleBufferIndex, directProcess);
+		if (g_jitter.IsEnabled()) g_jitter.Switch(*g_stats, start, StatsBlock::Now());
+	}
+
+	ASIOTime* BufferSwitchTimeInfo(ASIOTime* params, long doubleBufferIndex, long directProcess) {
+		std::optional<int64_t> sample;
+		if (params && (params->timeInfo.flags & kSamplePositionValid))
+			sample = (int64_t)(((uint64_t)params->timeInfo.samplePosition[0] << 32) | params->timeInfo.samplePosition[1]);
+		auto start = StatsBlock::Now();
+		g_bufferClock.Tick(start, sample);
+		auto result = host.bufferSwitchTimeInfo(params, doubleBufferIndex, directProcess);
+		if (g_jitter.IsEnabled()) g_jitter.Switch(*g_stats, start, StatsBlock::Now());
+		return result;
+	}
+
+	ASIOCallbacks* Wrap(const ASIOCallbacks& callbacks) {
+		host = wrapped = callbacks;
+		if (callbacks.bufferSwitch) wrapped.bufferSwitch = BufferSwitch;
+		if (callbacks.bufferSwitchTimeInfo) wrapped.bufferSwitchTimeInfo = BufferSwitchTimeInfo;
+		return &wrapped;
+	}
+}
+
 
 class AsioDriver {
 public:
@@ -65,10 +176,28 @@ public:
 
 	std::wstring vendor;
 	State state{};
+	bool probed{};	// TryInit and patching were attempted
+	// Patched without an instance (at a cached or statically found place), so whether the
+	// driver monitors by itself is only known once the host asks kAsioCanInputMonitor
+	CopyableAtomic<bool> askNative{false};
+	CopyableAtomic<bool> nativeMonitoring{false};	// then everything goes to the original
+
+	// Executes SetInputMonitor off the host thread. Started after the driver is patched.
+	std::shared_ptr<CommandWorker<MonitorCommand>> monitorWorker;
+	std::chrono::milliseconds monitorDebounce{5};	// a burst of toggles is merged into one batch
+	std::chrono::milliseconds monitorMaxDelay{20};	// but a toggle is never delayed longer than that
+	CopyableAtomic<long> inputCount{0};			// as reported by the driver, needed to expand input = -1
+	std::chrono::milliseconds maintenancePeriod{5000};	// how often Maintenance() runs while there are no commands
+	std::vector<long> hookedSelectors = { kAsioCanInputMonitor, kAsioSetInputMonitor };	// everything else bypasses FutureFunctionReplacement
+	std::vector<int> hookedSlots;	// IASIO vtable slots replaced, see HookSlot
 	
 
-	std::wstring Info() const {
-		return std::format(L"{} = {} ({})",	name, StateDescriptions.at(state), vendor);
+	virtual std::wstring Info() const {
+		if (!monitorWorker)
+			return std::format(L"{} = {} ({})",	name, StateDescriptions.at(state), vendor);
+		auto s = monitorWorker->GetStatus();
+		return std::format(L"{} = {} ({}), commands: {} queued, {} done, {} failed, {} rejected, last result {}",
+			name, StateDescriptions.at(state), vendor, s.submitted, s.completed, s.failed, s.rejected, s.lastResult);
 	}
 
 	// Try to promote generic class to specific class
@@ -76,55 +205,709 @@ public:
 		return std::nullopt;	
 	}
 
-	// Generate an adapter from function call to class function call
-	uintptr_t FutureFunctionReplacementThunk() {
-		const size_t funcSize = 31;
-		uint8_t code[funcSize] = {	
-			0x4d, 0x89, 0xc1,			 // mov r9, r8    ; shift 3 arguments right
-			0x49, 0x89, 0xD0,            // mov r8, rdx   
-			0x48, 0x89, 0xCA,            // mov rdx, rcx
-			0x48, 0xB9, 0,0,0,0,0,0,0,0, // mov rcx, addr ; add driver instance pointer ("this" as the first argument)
-			0x48, 0xB8, 0,0,0,0,0,0,0,0, // mov rax, addr ; the replacement function body address
-			0xFF, 0xE0                   // jmp rax       ; continue to the replacement function
-		};
+	// Name of the specific class, known before TryInit
+	virtual std::wstring VendorName() const {
+		return {};
+	}
+
+	// Add what the specific class found out to the probe cache entry
+	virtual void Describe(ProbeCache::Entry& entry) const {
+	}
 
+	// Generate an adapter from function call to class function call. Selectors that are
+	// not hooked never leave the generated code, they go straight to the original function.
+	// While capturing, all of them go to FutureFunctionReplacement to be recorded.
+	uintptr_t FutureFunctionReplacementThunk() {
 		// Thunk already exists
 		if (futureFunctionReplacementThunk)
 			return futureFunctionReplacementThunk;
+		if (!futureFunctionOriginal)
+			return 0;
 
-		// Insert the driver instance address
-		*reinterpret_cast<uintptr_t*>(&code[11]) = reinterpret_cast<uintptr_t>(this);;
-
-		// Insert the replacement function address
 		auto replFunc = &AsioDriver::FutureFunctionReplacement;
 		uintptr_t replAddr = reinterpret_cast<uintptr_t>(*(void**)&replFunc);
-		*reinterpret_cast<uintptr_t*>(&code[21]) = replAddr;
+		auto code = g_capture.IsActive()
+			? thunk::FutureForward(reinterpret_cast<uintptr_t>(this), replAddr)
+			: thunk::FutureFilter(reinterpret_cast<uintptr_t>(this), replAddr, futureFunctionOriginal, hookedSelectors,
+				reinterpret_cast<uintptr_t>(&g_stats->counters[StatsBlock::PassThrough]));
+		futureFunctionReplacementThunk = (uintptr_t)g_thunks.Add(code);
+		return futureFunctionReplacementThunk;
+	}
 
-		// Allocate executable memory and copy the machine code
-		if (!(futureFunctionReplacementThunk = (uintptr_t)VirtualAlloc(nullptr, funcSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE)))
-			return 0;
-		memcpy((void*)futureFunctionReplacementThunk, code, funcSize);
+	// The driver's IASIO vtable, known once future() is found
+	uintptr_t* Vtable() const {
+		return asioDllPatchPlace ? (uintptr_t*)asioDllPatchPlace - kSlotFuture : nullptr;
+	}
 
-		return futureFunctionReplacementThunk;
+	// Point an IASIO method to a replacement. Its original is kept by g_hooks,
+	// together with this driver as the context.
+	bool HookSlot(int slot, uintptr_t replacement) {
+		uintptr_t* vtable = Vtable();
+		if (!vtable || !replacement || !g_hooks.Patch(vtable, slot, replacement, this)) return false;
+		if (std::find(hookedSlots.begin(), hookedSlots.end(), slot) == hookedSlots.end())
+			hookedSlots.push_back(slot);
+		return true;
+	}
+
+	// Put back every method this driver replaced
+	void Unhook() {
+		for (int slot : hookedSlots)
+			g_hooks.Unpatch(Vtable(), slot);
+		hookedSlots.clear();
+	}
+
+
+	// IASIO::init and IASIO::start, see HookSlot. The host is bringing the driver up, get
+	// everything the first command needs ready in the background.
+	static long InitReplacement(void* iasio, void* sysHandle) {
+		auto original = (AsioInitFunction)g_hooks.Original(iasio, kSlotInit);
+		if (!original) return 0;	// ASIOFalse
+		long result = original(iasio, sysHandle);
+		if (auto driver = (AsioDriver*)g_hooks.Context(iasio); driver && result)
+			driver->Prepare(iasio);
+		return result;
+	}
+
+	static long StartReplacement(void* iasio) {
+		auto original = (AsioStartFunction)g_hooks.Original(iasio, kSlotStart);
+		if (!original) return ASE_NotPresent;
+		long result = original(iasio);
+		if (auto driver = (AsioDriver*)g_hooks.Context(iasio); driver && result == ASE_OK)
+			driver->Prepare(iasio);
+		return result;
 	}
 
+	// Host thread, right after init or start. Must not wait for the devices.
+	void Prepare(void* iasio) {
+		QueryInputCount(iasio);	// so input = -1 doesn't have to ask
+		PrepareDevices();
+	}
 
-	// This function extends the original one from the driver, adding DM support
+	// Have the devices checked and their mixers read, in the background
+	virtual void PrepareDevices() {
+	}
+
+	// IASIO::createBuffers, see HookSlot. The host's callbacks are wrapped to time the stream.
+	static long CreateBuffersReplacement(void* iasio, void* bufferInfos, long numChannels, long bufferSize, ASIOCallbacks* callbacks) {
+		auto original = (AsioCreateBuffersFunction)g_hooks.Original(iasio, kSlotCreateBuffers);
+		if (!original) return ASE_NotPresent;
+		if (!callbacks) return original(iasio, bufferInfos, numChannels, bufferSize, callbacks);
+		long result = original(iasio, bufferInfos, numChannels, bufferSize, hostCallbacks::Wrap(*callbacks));
+		if (result == ASE_OK) {
+			g_bufferClock.Start(bufferSize);
+			g_jitter.Start();
+			dbg(L"Buffers of {} samples created, switches are aimed at buffer boundaries", bufferSize);
+		}
+		return result;
+	}
+
+	// IASIO::disposeBuffers
+	static long DisposeBuffersReplacement(void* iasio) {
+		g_bufferClock.Stop();
+		auto original = (AsioDisposeBuffersFunction)g_hooks.Original(iasio, kSlotDisposeBuffers);
+		return original ? original(iasio) : ASE_NotPresent;
+	}
+
+
+	// This function extends the original one from the driver, adding DM support.
+	// Only called for hookedSelectors, unless host calls are captured.
 	long FutureFunctionReplacement(void* iasio, long selector, void* params) {
-		dbg(std::format(L"called {} future(iASIO={:016x}, selector={}, params={:016x})", vendor, (uintptr_t)iasio, selector, (uintptr_t)params));
+		trace(L"called {} future(iASIO={:016x}, selector={}, params={:016x})", vendor, (uintptr_t)iasio, selector, (uintptr_t)params);
+		bool hooked = std::find(hookedSelectors.begin(), hookedSelectors.end(), selector) != hookedSelectors.end();
+		g_stats->Add(hooked ? StatsBlock::Hooked : StatsBlock::PassThrough);
+		JitterMonitor::Busy busy(g_jitter);
+		if (!g_capture.IsActive()) return HandleFuture(iasio, selector, params);
+		auto start = g_capture.Now();
+		long result = HandleFuture(iasio, selector, params);
+		CaptureRecord record{ .kind = CaptureRecord::Future, .selector = (int32_t)selector, .result = (int32_t)result };
+		if (auto m = (ASIOInputMonitor*)params; selector == kAsioSetInputMonitor && m) {
+			record.params[0] = m->input;
+			record.params[1] = m->output;
+			record.params[2] = m->gain;
+			record.params[3] = m->state;
+			record.params[4] = m->pan;
+		}
+		g_capture.Add(record, start);
+		return result;
+	}
+
+	long HandleFuture(void* iasio, long selector, void* params) {
 		if (!futureFunctionOriginal) return ASE_NotPresent;
-		if (selector == kAsioCanInputMonitor) return ASE_SUCCESS;
-		if (selector == kAsioSetInputMonitor) return SetInputMonitor((ASIOInputMonitor*)params);
-		dbg(L"passed to the original function");
+		if (askNative.load(std::memory_order_relaxed) && selector == kAsioCanInputMonitor) {
+			askNative = false;
+			if (((AsioFutureFunction)futureFunctionOriginal)(iasio, kAsioCanInputMonitor, nullptr) == ASE_SUCCESS) {
+				dbg(L"{} has native DM support, commands are passed through", name);
+				nativeMonitoring = true;
+			}
+		}
+		if (nativeMonitoring.load(std::memory_order_relaxed))
+			return ((AsioFutureFunction)futureFunctionOriginal)(iasio, selector, params);
+		if (auto result = monitor::Future(selector, params, [&](ASIOInputMonitor* m) { return QueueInputMonitor(iasio, m); }))
+			return *result;
+		trace(L"passed to the original function");
 		return ((AsioFutureFunction)futureFunctionOriginal)(iasio, selector, params);
 	}
 
+	// Start the background thread which executes DM commands
+	virtual bool StartWorker() {
+		if (!monitorWorker)
+			monitorWorker = std::make_shared<CommandWorker<MonitorCommand>>(
+				[this](std::span<MonitorCommand> batch) { return ExecuteMonitorBatch(batch); }, 
+				ASE_SUCCESS, monitorDebounce, monitorMaxDelay,
+				[this]() { Maintenance(); }, maintenancePeriod);
+		return monitorWorker != nullptr;
+	}
+
+	// Hand the command over to the worker thread, don't make the host wait for USB transfers
+	long QueueInputMonitor(void* iasio, ASIOInputMonitor* params) {
+		if (!params) return ASE_InvalidParameter;
+		// The input comes from the host, refuse what the driver doesn't have before the worker sizes anything by it
+		long count = QueryInputCount(iasio);
+		if (params->input < -1 || !count || params->input >= count) return ASE_InvalidParameter;
+		MonitorCommand command{ *params, StatsBlock::Now() };
+		if (auto target = g_bufferClock.Aim(command.issued)) {
+			command.sample = target->sample;
+			command.due = target->due;
+			command.deadline = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(target->start)));
+			trace(L"Input {} at sample {}, aimed {} us ahead", params->input, command.sample, (command.due - command.issued) / 1000);
+		}
+		g_stats->Add(StatsBlock::Queued);
+		if (!monitorWorker) return ExecuteMonitorBatch(std::span<MonitorCommand>(&command, 1));
+		if (!monitorWorker->Submit(command)) {
+			dbg(L"Command queue is full, command dropped");
+			return ASE_NoMemory;
+		}
+		return ASE_SUCCESS;
+	}
+
+	// Ask the driver how many inputs it has. Every QueueInputMonitor and Prepare comes here,
+	// the count is cached after the first getChannels that succeeds.
+	long QueryInputCount(void* iasio) {
+		if (long count = inputCount.load()) return count;
+		long inputs = 0, outputs = 0;
+		uintptr_t* vtable = *(uintptr_t**)iasio;
+		if (((AsioGetChannelsFunction)vtable[kSlotGetChannels])(iasio, &inputs, &outputs) != 0 || inputs <= 0) {
+			dbg(L"Unable to get the number of inputs");
+			return 0;
+		}
+		dbg(L"Driver reports {} inputs and {} outputs", inputs, outputs);
+		inputCount.store(inputs);
+		return inputs;
+	}
+
+	// Merge a burst of commands: input = -1 is expanded to every input, and only the latest
+	// request for each input survives. The result is ordered by input index.
+	std::vector<MonitorCommand> CoalesceMonitorBatch(std::span<MonitorCommand> batch) {
+		return monitor::Coalesce<MonitorCommand>(batch, inputCount.load());	// inputs were checked by QueueInputMonitor already
+	}
+
+	// Worker thread. Returns the first error, if any.
+	long ExecuteMonitorBatch(std::span<MonitorCommand> batch) {
+		auto commands = CoalesceMonitorBatch(batch);
+		dbg(L"Executing {} commands merged into {}", batch.size(), commands.size());
+		if (batch.size() > commands.size()) g_stats->Add(StatsBlock::Coalesced, batch.size() - commands.size());
+		long status = ASE_SUCCESS;
+		for (auto& command : commands) {
+			long result = SetInputMonitor(&command);
+			if (result != ASE_SUCCESS && status == ASE_SUCCESS) status = result;
+		}
+		return status;
+	}
+
 	// Actual work is done here
-	virtual long SetInputMonitor(ASIOInputMonitor* params) {
+	virtual long SetInputMonitor(MonitorCommand* params) {
 		dbg(L"Generic SetInputMonitor called. This should not happen.");
 		return ASE_NotPresent;
 	}
 
+	// Background housekeeping on the worker thread, runs when the worker is idle
+	virtual void Maintenance() {
+	}
+
+};
+
+
+// One device behind a Thesycon driver. Each device has its own connection session,
+// shadow mixer and worker thread, so a slow device doesn't hold up the others.
+class ThesyconDevice {
+public:
+	static constexpr long ResumeGain = -1;	// worker commands that are not for an input
+	static constexpr long WarmUp = -2;
+
+	// What GetDeviceProperties reports, enough to tell devices apart
+	struct Properties {
+		uint64_t model{};	// VID & PID
+		std::wstring serial;
+		std::wstring name;	// product "Audient iD14"
+
+		// Identifies the device across reopens and replugs, the index may change
+		std::wstring Key() const {
+			return std::format(L"{:016x}/{}", model, serial);
+		}
+	};
+
+	tusbaudio::Api api;
+	// Replaced together by the session thread on reopen, under handleLock. Requests hold
+	// it shared, so a handle isn't closed while one is using it.
+	CopyableAtomic<long> deviceIndex{};
+	long deviceHandle{};
+	std::shared_ptr<std::shared_mutex> handleLock = std::make_shared<std::shared_mutex>();
+	// Set once by Open(), before any thread uses the device
+	std::wstring deviceName;
+	std::wstring serial;
+	uint64_t deviceModel{};
+	DeviceProfile profile{};	// looked up once the model is known
+	std::shared_ptr<ShadowMixer> shadow = std::make_shared<ShadowMixer>();	// Main mix levels as the device has them
+	std::shared_ptr<TransferPolicy> transfers = std::make_shared<TransferPolicy>();	// deadlines and retries of control requests
+	std::shared_ptr<DeviceSession> session;	// connection state, started together with the worker
+	std::shared_ptr<CommandWorker<MonitorCommand>> worker;	// commands arrive already merged, no debounce here
+	std::shared_ptr<GainEngine> gain;	// levels waiting to be written, rate-limited
+	int snapshotRecord = -1;			// in g_snapshot
+	std::chrono::milliseconds maintenancePeriod{5000};
+	CopyableAtomic<uint64_t> warmedUp{};	// StatsBlock::Now() of the last Prepare
+	// Other processes that have the device, see Share(). Last, so its thread stops before
+	// the worker it submits to goes away.
+	std::shared_ptr<SharedDevice> shared;
+
+	ThesyconDevice(const tusbaudio::Api& api, long index) : api(api), deviceIndex(index) {}
+
+	std::wstring Key() const {
+		return Properties{ deviceModel, serial, deviceName }.Key();
+	}
+
+	// ASIO inputs of the device, from the devices file or the profile. 0 if neither knows,
+	// the mixer may have channels that aren't ASIO inputs, so its size is no substitute.
+	int InputCount() const {
+		return profile.inputs;
+	}
+
+	virtual std::wstring Info() const {
+		auto s = worker ? worker->GetStatus() : decltype(worker->GetStatus()){};
+		return std::format(L"{} #{} ({}), {} inputs, commands: {} done, {} failed",
+			deviceName, deviceIndex.load(), serial, InputCount(), s.completed, s.failed);
+	}
+
+
+	// Before the device is used. Opens it and learns what it is.
+	long Open(long index) {
+		long handle{};
+		auto result = OpenByIndex(index, handle);
+		if NOT_OK(result) return result;
+		auto properties = ReadProperties(handle);
+		if (!properties) {
+			if (api.closeDevice) api.closeDevice(handle);
+			return -1;
+		}
+		deviceIndex = index;
+		deviceHandle = handle;
+		deviceModel = properties->model;
+		serial = properties->serial;
+		deviceName = properties->name;
+		profile = g_devices.Find(deviceModel);
+		if (size_t i = g_devices.Position(serial); i < g_devices.Order().size() && g_devices.Order()[i].inputs)
+			profile.inputs = g_devices.Order()[i].inputs;
+		dbg(L"Device profile: {} entity={:02x} inputs={} mixes={}{}", profile.name.empty() ? std::wstring_view(deviceName) : profile.name,
+			profile.mixerEntity, profile.inputs, profile.mixes, g_devices.IsKnown(deviceModel) ? L"" : L" (unknown model, Main mix only)");
+		return result;
+	}
+
+
+	long OpenByIndex(long index, long& handle) const {
+		if (!api.openDeviceByIndex) return -1;
+		auto result = api.openDeviceByIndex(index, &handle);
+		dbg(L"OpenDevice #{} result={} handle={}", index, result, handle);
+		return result;
+	}
+
+
+	void CloseDevice() {
+		std::unique_lock lock(*handleLock);
+		if (api.closeDevice) api.closeDevice(deviceHandle);
+	}
+
+
+	// Session thread. The old handle is dead, drop it and start over with a fresh one.
+	// After a replug the device may show up under another index, so look for it by key.
+	// The device is only taken over if it is the same one, what this one is never changes.
+	long RecoverDevice() {
+		auto key = Key();
+		long count = 1;
+		if (api.getDeviceCount) count = std::max(count, api.getDeviceCount());
+
+		for (long i = 0; i < count; i++) {
+			long index = (deviceIndex + i) % count;	// most likely it's where it was
+			long handle{};
+			if NOT_OK(OpenByIndex(index, handle)) continue;
+			auto properties = ReadProperties(handle);
+			if (!properties || properties->Key() != key) {
+				if (api.closeDevice) api.closeDevice(handle);	// another device, or it doesn't answer
+				continue;
+			}
+			{
+				std::unique_lock lock(*handleLock);
+				if (api.closeDevice) api.closeDevice(deviceHandle);
+				deviceHandle = handle;
+				deviceIndex = index;
+			}
+			shadow->Invalidate();	// the device may have come back with different levels
+			transfers->Reset();
+			g_stats->Add(StatsBlock::Reopens);
+			return 0;
+		}
+		return -1;
+	}
+
+
+	// Any thread, touches nothing of the device
+	std::optional<Properties> ReadProperties(long handle) const {
+		if (!api.getDeviceProperties) return std::nullopt;
+		char buf[2048]{};
+		auto result = api.getDeviceProperties(handle, (void*)buf);
+		Properties properties{ *(uint64_t*)buf, (WCHAR*)(buf + 12), (WCHAR*)(buf + 524) };
+		dbg(L"Device info result={} model={:016x} serial={} name={}", result, properties.model, properties.serial, properties.name);
+		if NOT_OK(result) return std::nullopt;
+		return properties;
+	}
+
+
+	// Session thread, used as a heartbeat and to find out which device a PnP notification was about
+	long ProbeDevice() {
+		if (Secondary()) return 0;	// the owner keeps an eye on it
+		short buf{};
+		auto result = Transfer(false, 0, &buf, false);	// the session keeps probing anyway
+		if NOT_OK(result) dbg(L"DeviceCheck #{} failed result={}", deviceIndex.load(), result);
+		return result;
+	}
+
+
+	void Start(bool notifications) {
+		if (!shared)
+			Share();
+		if (!session) {
+			session = std::make_shared<DeviceSession>([this]() { return RecoverDevice(); }, [this]() { return ProbeDevice(); });
+			if (notifications) session->UseNotifications();
+		}
+		if (!gain)
+			gain = std::make_shared<GainEngine>(g_gainSettings);
+		if (!worker)
+			worker = std::make_shared<CommandWorker<MonitorCommand>>(
+				[this](std::span<MonitorCommand> batch) {
+					long status = ASE_SUCCESS;
+					for (auto& command : batch) {
+						if (command.input == WarmUp) Prefetch();
+						if (command.input < 0) continue;	// ResumeGain only brings the worker back for ApplyGain
+						long result = SetInputMonitor(&command);
+						if (result != ASE_SUCCESS && status == ASE_SUCCESS) status = result;
+					}
+					if (long result = ApplyGain(); result != ASE_SUCCESS && status == ASE_SUCCESS) status = result;
+					return status;
+				},
+				ASE_SUCCESS, std::chrono::milliseconds{}, std::chrono::milliseconds{},
+				[this]() { Maintenance(); }, maintenancePeriod);
+		if (snapshotRecord < 0)
+			RestoreSnapshot();
+		if (shared)
+			shared->Listen([this](const SharedCommand& c) { Forwarded(c); }, [this](bool owner) { OwnerChanged(owner); });
+	}
+
+
+	// Join the other processes that have the device (shared.h). The first one owns it and
+	// is the only one sending control requests, the others hand it their commands, and
+	// all of them use one shadow mixer. Without shared memory the process works alone.
+	void Share() {
+		auto s = std::make_shared<SharedDevice>();
+		if (!s->Open(SharedDevice::Name(deviceModel, serial))) {
+			dbg(L"Device #{} is not shared with other processes", deviceIndex.load());
+			return;
+		}
+		shadow = s->Shadow();
+		shared = s;
+		if (shared->IsOwner()) shadow->Invalidate();	// left by a process that is gone, nobody kept it up to date
+		dbg(L"Device #{} is shared, owned by process {}{}", deviceIndex.load(), shared->Owner(), shared->IsOwner() ? L" (this one)" : L"");
+	}
+
+
+	// Another process owns the device
+	bool Secondary() const {
+		return shared && !shared->IsOwner();
+	}
+
+
+	// Shared session thread, owner. A command of another process, executed as if this host sent it.
+	void Forwarded(const SharedCommand& c) {
+		MonitorCommand command{};
+		command.input = c.input;
+		command.gain = c.gain;
+		command.state = c.state;
+		command.pan = c.pan;
+		command.issued = c.issued;
+		if (!worker->Submit(command)) dbg(L"Command queue is full, command of another process dropped");
+	}
+
+
+	// Shared session thread. The owner quit or hung, or this process hung and lost the device.
+	void OwnerChanged(bool owner) {
+		dbg(L"Device #{} {} another process", deviceIndex.load(), owner ? L"taken over from" : L"taken over by");
+		if (!owner) return;
+		shadow->Invalidate();
+		MonitorCommand warmUp{};
+		warmUp.input = WarmUp;
+		worker->Submit(warmUp);
+		// Levels this process set while it was secondary are still waiting in the gain engine
+		MonitorCommand resume{};
+		resume.input = ResumeGain;
+		worker->Submit(resume);
+	}
+
+
+	// Levels from previous sessions. Inputs the plugin left muted, because the host crashed
+	// or quit while monitoring was off, get their level back in one pass of the gain engine.
+	void RestoreSnapshot() {
+		if ((snapshotRecord = g_snapshot.Attach(deviceModel, serial)) < 0) return;
+		int known = 0, restored = 0;
+		for (int channel = 0; channel < ShadowMixer::MaxChannels; channel++) {
+			auto level = g_snapshot.Get(snapshotRecord, channel);
+			if (!level) continue;
+			shadow->SetSaved(channel, level->vol);
+			known++;
+			if (level->muted && gain && !Secondary()) {
+				gain->SetTarget(channel, level->vol);
+				restored++;
+			}
+		}
+		dbg(L"Snapshot #{}: {} levels known, {} muted inputs restored", deviceIndex.load(), known, restored);
+		if (restored && worker) {
+			MonitorCommand resume{};
+			resume.input = ResumeGain;
+			worker->Submit(resume);
+		}
+	}
+
+
+	// The device has vol on the channel now, the plugin set it or read it
+	void Remember(int channel, VolPair vol, bool byPlugin) {
+		shadow->Update(channel, vol);
+		g_snapshot.Set(snapshotRecord, channel, vol, byPlugin);
+	}
+
+
+	byte GetVirtualChannelIndex(byte channel) {
+		return (byte)monitor::Crosspoint(profile, channel);
+	}
+
+
+	// The channel is in the shadow copy and both of its crosspoints have a byte index
+	bool IsAddressable(int channel) const {
+		return shadow->Contains(channel) && monitor::IsAddressable(profile, channel);
+	}
+
+
+	// One 2-byte mixer control request, timed for the statistics
+	long ControlRequest(bool set, byte virtualChannel, short* data, long timeoutMillisecs) {
+		if (!(set ? api.audioControlRequestSet : api.audioControlRequestGet)) return -1;
+		JitterMonitor::Busy busy(g_jitter);
+		auto start = StatsBlock::Now();
+		auto captureStart = g_capture.Now();
+		long result;
+		{
+			std::shared_lock lock(*handleLock);
+			result = monitor::ControlRequest(api, deviceHandle, profile, set, virtualChannel, data, timeoutMillisecs);
+		}
+		g_stats->RecordTransfer(set, start, result, timeoutMillisecs);
+		if (g_capture.IsActive()) {
+			CaptureRecord record{ .kind = set ? CaptureRecord::ControlSet : CaptureRecord::ControlGet, .device = (uint8_t)deviceIndex,
+				.selector = virtualChannel, .result = (int32_t)result };
+			record.params[0] = *data;
+			g_capture.Add(record, captureStart);
+		}
+		return result;
+	}
+
+
+	// A control request with a deadline learned from the earlier ones, sent again if it
+	// fails, unless the device was lost meanwhile
+	long Transfer(bool set, byte virtualChannel, short* data, bool retry = true) {
+		return transfers->Run(
+			[&](long timeoutMillisecs) { return ControlRequest(set, virtualChannel, data, timeoutMillisecs); },
+			[&]() { return !retry || (session && !session->IsOpen()); },
+			[]() { g_stats->Add(StatsBlock::Retries); });
+	}
+
+
+	// A request failed after its retries. Once they keep failing the device is given up,
+	// and commands fail right away until the session has reopened it.
+	void TransferFailed(long result) {
+		if (!transfers->Failed() || !session) return;
+		dbg(L"Device #{}: {} requests failed in a row, giving up on it", deviceIndex.load(), transfers->Failures());
+		g_stats->Add(StatsBlock::DevicesLost);
+		session->ReportFailure(result);
+	}
+
+
+	// Both halves must make it. What the device has after a failure is not known, it may
+	// have taken L only, so the shadow copy forgets the channel and reads it again.
+	long SetVol(byte channel, VolPair vol) {
+		auto result = monitor::SetVol([&](bool set, uint8_t at, short* value) { return Transfer(set, at, value); }, profile, channel, vol);
+		if NOT_OK(result) shadow->Invalidate(channel);
+		dbg(L"SetVol #{} ch{}={}/{} result={}", deviceIndex.load(), channel, vol.L, vol.R, result);
+		return result;
+	}
+
+
+	long GetVol(byte channel, VolPair& vol, bool retry = true) {
+		auto result = monitor::GetVol([&](bool set, uint8_t at, short* value) { return Transfer(set, at, value, retry); }, profile, channel, vol);
+		dbg(L"GetVol #{} ch{}={}/{} result={}", deviceIndex.load(), channel, vol.L, vol.R, result);
+		return result;
+	}
+
+
+	// Device worker thread. params->input is the channel of this device. With the gain
+	// engine running this only sets the target, ApplyGain writes it.
+	long SetInputMonitor(MonitorCommand* params) {
+		if (!IsAddressable(params->input)) return ASE_InvalidParameter;
+		int channel = params->input;
+
+		// Another process owns the device and writes it
+		if (Secondary()) {
+			if (shared->Submit({ (int32_t)channel, (int32_t)params->gain, (int32_t)params->state, (int32_t)params->pan, params->issued }))
+				return ASE_SUCCESS;
+			dbg(L"Device #{}: the owner's queue is full, command dropped", deviceIndex.load());
+			g_stats->Add(StatsBlock::CommandFailures);
+			return ASE_NoMemory;
+		}
+
+		// Don't wait for transfer timeouts while the device is gone, the session is reopening it
+		if (session && !session->IsOpen()) {
+			dbg(L"Device #{} is not available (result={}), command dropped", deviceIndex.load(), session->GetStatus().lastError);
+			g_stats->Add(StatsBlock::CommandFailures);
+			return ASE_NotPresent;
+		}
+
+		// Normally the shadow copy or the snapshot knows the level already, read it only if neither does
+		if (!shadow->IsValid(channel) && !g_snapshot.Get(snapshotRecord, channel)) {
+			VolPair v{};
+			if OK(GetVol(channel, v)) Remember(channel, v, false);
+		}
+
+		VolPair target = monitor::Target(*params, *shadow, channel, g_followGain);
+		if (gain) {
+			gain->SetTarget(channel, target, params->issued, params->due);
+			return ASE_SUCCESS;
+		}
+
+		auto start = StatsBlock::Now();
+		if (auto result = SetVol(channel, target); NOT_OK(result)) {
+			TransferFailed(result);
+			g_stats->Add(StatsBlock::CommandFailures);
+			return ASE_HWMalfunction;
+		}
+		g_bufferClock.Measured(StatsBlock::Now() - start);
+		Remember(channel, target, true);
+		Landed(params->issued, params->due);
+		return ASE_SUCCESS;
+	}
+
+
+	// A command reached the device. Tells how far from its buffer boundary, if it had one.
+	void Landed(uint64_t issued, uint64_t due) {
+		auto now = StatsBlock::Now();
+		g_stats->Add(StatsBlock::Executed);
+		if (issued) g_stats->Record(StatsBlock::SetInputMonitor, now - issued);
+		if (!due) return;
+		if (now <= due) g_stats->Add(StatsBlock::SwitchesOnTime);
+		else {
+			g_stats->Add(StatsBlock::SwitchesLate);
+			g_stats->Record(StatsBlock::SwitchLate, now - due);
+		}
+		trace(L"Switch on device #{} landed {} samples {} its buffer boundary", deviceIndex.load(),
+			g_bufferClock.ToSamples(now <= due ? due - now : now - due), now <= due ? L"before" : L"after");
+	}
+
+
+	// Read the Main mix and bring the shadow copy up to date. The first pass also finds out
+	// how many channels the mixer has: reading stops at the first channel the device refuses,
+	// and a refusal there is expected, not worth a retry.
+	void RefreshShadow() {
+		int limit = std::min(ShadowMixer::MaxChannels, 256 / std::max<int>(GetVirtualChannelIndex(1), 2));
+		if (profile.inputs) limit = std::min<int>(limit, profile.inputs);
+		if (shadow->Size()) limit = shadow->Size();
+
+		int count = 0, changes = 0;
+		for (; count < limit; count++) {
+			VolPair v{};
+			if (auto result = GetVol(count, v, count < shadow->Size() || !count); NOT_OK(result)) {
+				if (!count) TransferFailed(result);	// not even the first channel, the device may be gone
+				break;
+			}
+			if (shadow->IsValid(count) && shadow->Current(count) == v) continue;
+			Remember(count, v, false);
+			changes++;
+		}
+		if (!shadow->Size() && count) shadow->SetSize(count);
+		if (changes) dbg(L"Shadow mixer #{}: {} of {} channels changed", deviceIndex.load(), changes, count);
+	}
+
+
+	// Device worker thread. Writes one level the gain engine has, waiting for the rate limit
+	// if needed. The rest is left for the next round of the worker, so commands that came in
+	// meanwhile replace stale targets before they are ever written.
+	long ApplyGain() {
+		if (!gain || Secondary() || (session && !session->IsOpen())) return ASE_SUCCESS;	// Maintenance picks it up after a reopen
+		if (auto wait = gain->Wait(GainEngine::Clock::now()); wait > GainEngine::Clock::duration{})
+			std::this_thread::sleep_for(wait);
+
+		long status = ASE_SUCCESS;
+		if (auto step = gain->Next(*shadow, GainEngine::Clock::now())) {
+			auto start = StatsBlock::Now();
+			if (auto result = SetVol(step->channel, step->vol); NOT_OK(result)) {
+				TransferFailed(result);
+				g_stats->Add(StatsBlock::CommandFailures);
+				status = ASE_HWMalfunction;
+			}
+			else {
+				g_bufferClock.Measured(StatsBlock::Now() - start);
+				Remember(step->channel, step->vol, true);
+				if (step->last) Landed(step->issued, step->due);
+			}
+		}
+		if (gain->Pending() && worker) {
+			MonitorCommand resume{};
+			resume.input = ResumeGain;
+			worker->Submit(resume);
+		}
+		return status;
+	}
+
+
+	// Any thread. The host is bringing the driver up and the first command will follow soon,
+	// so have the worker check the device and read the Main mix now rather than then.
+	void Prepare() {
+		auto now = StatsBlock::Now();
+		if (!worker || now - warmedUp.load() < 1000000000ull) return;	// init and start come together
+		warmedUp = now;
+		MonitorCommand warmUp{};
+		warmUp.input = WarmUp;
+		worker->Submit(warmUp);
+	}
+
+
+	// Device worker thread. A device that is gone fails the first read and the session
+	// reopens it, so that doesn't wait for the first command either.
+	void Prefetch() {
+		if (Secondary() || (session && !session->IsOpen())) return;
+		auto start = StatsBlock::Now();
+		RefreshShadow();
+		dbg(L"Device #{} ready, {} channels read in {} us", deviceIndex.load(), shadow->Size(), (StatsBlock::Now() - start) / 1000);
+	}
+
+
+	// Device worker thread, while idle
+	void Maintenance() {
+		if (Secondary() || (session && !session->IsOpen())) return;
+		RefreshShadow();
+		g_snapshot.Flush();
+		if (gain && gain->Pending()) ApplyGain();
+	}
 };
 
 
@@ -133,63 +916,57 @@ class AsioDriver_Thesycon: public AsioDriver {
 
 	std::wstring apiPath;	// audientusbaudioapi_x64.dll
 	HMODULE apiDllHandle{};
-	long deviceIndex{};
-	long deviceHandle{};
-	std::wstring deviceName;
-	uint64_t deviceModel{};
-	struct VolPair { 
-		short L{0}; 
-		short R{0}; 
-		bool operator==(const VolPair& x) const { return L == x.L && R == x.R; }
-		bool operator!=(const VolPair& x) const { return !(*this == x); }
-	};
-	std::map<int, VolPair> lastVol;
-	VolPair minusInf = {-32768, -32768};
-
-	using TUSBAUDIO_EnumerateDevices = long(*)();
-	using TUSBAUDIO_GetDeviceCount = long(*)();
-	using TUSBAUDIO_OpenDeviceByIndex = long(*)(long deviceIndex, long* deviceHandle);
-	using TUSBAUDIO_AudioControlRequestGet = long(*)(long deviceHandle, long entityID, long request,
-		long controlSelector, char channelOrMixerControl, void* paramBlock, long paramBlockLength,
-		long* bytesTransferred, long timeoutMillisecs);
-	using TUSBAUDIO_AudioControlRequestSet = TUSBAUDIO_AudioControlRequestGet;
-	using TUSBAUDIO_GetDeviceProperties = long(*)(long deviceHandle, void* properties); 
+	tusbaudio::Api api;
+	std::vector<std::shared_ptr<ThesyconDevice>> devices;	// ordered by key, ASIO inputs are numbered across them in this order
+	HANDLE pnpEvents[2]{};	// device arrived, device removed
+	HANDLE pnpWaits[2]{};
 
 	// Trying to init the driver as Thesycon if possible
 	// Returns false if the driver doesn't look like Thesycon
 	std::optional<std::unique_ptr<AsioDriver>> TryInit() override {
-		dbg(std::format(L"Trying to init {} as Thesycon", name));
+		dbg(L"Trying to init {} as Thesycon", name);
 		try {
 			// Check asio driver naming convention: %VendorName%UsbAudioAsio_x64.dll
 			std::wstring asioSuffix = L"usbaudioasio_x64.dll";
 			if (!asioPath.ends_with(asioSuffix))
-				err(L"Wrong asio driver name " + apiPath);
+				err(L"Wrong asio driver name {}", apiPath);
 
 			// Check api library presence 
 			std::wstring apiSuffix = L"usbaudioapi_x64.dll";
 			std::wstring _apiPath = asioPath;
 			_apiPath.replace(_apiPath.find(asioSuffix), asioSuffix.size(), apiSuffix);
 			if (GetFileAttributesW(_apiPath.c_str()) == INVALID_FILE_ATTRIBUTES)
-				err(L"Api dll does not exist " + _apiPath);
+				err(L"Api dll does not exist {}", _apiPath);
 			apiPath = _apiPath;
 			if (!(apiDllHandle = LoadLibraryW(apiPath.c_str())))
-				err(L"Loading api dll failed " + apiPath);
+				err(L"Loading api dll failed {}", apiPath);
 			
-			// Open device
-			FARPROC func = 0; 
-			if (!(func = GetProcAddress(apiDllHandle, "TUSBAUDIO_EnumerateDevices"))) err(L"func not found");
-			dbg(std::format(L"EnumerateDevices={}", ((TUSBAUDIO_EnumerateDevices)func)()));
-
-			if (!(func = GetProcAddress(apiDllHandle, "TUSBAUDIO_GetDeviceCount"))) err(L"func not found");
-			dbg(std::format(L"GetDeviceCount={}", ((TUSBAUDIO_GetDeviceCount)func)()));
-
-			if NOT_OK(ReopenDevice(0)) err(L"Failed to open device");
+			if (!api.Resolve(apiDllHandle))
+				err(L"Api dll lacks some functions {}", apiPath);
+
+			// Open devices
+			dbg(L"EnumerateDevices={}", api.enumerateDevices());
+			long count = api.getDeviceCount();
+			dbg(L"GetDeviceCount={}", count);
+
+			devices.clear();
+			for (long i = 0; i < count; i++) {
+				auto device = std::make_shared<ThesyconDevice>(api, i);
+				if NOT_OK(device->Open(i)) { dbg(L"Failed to open device"); continue; }
+				devices.push_back(device);
+			}
+			if (devices.empty())
+				err(L"No devices");
 
-			if NOT_OK(GetDeviceProperties()) err(L"Failed to get device model");
+			// Enumeration order may change between sessions, the input numbering shouldn't.
+			// Devices listed in the devices file come first, in its order.
+			std::sort(devices.begin(), devices.end(), [](const auto& a, const auto& b) {
+				return std::pair(g_devices.Position(a->serial), a->Key()) < std::pair(g_devices.Position(b->serial), b->Key());
+			});
 
 			// Alright, it walks like a duck and quacks like a duck
 			dbg(L"Init ok, this is Thesycon indeed.");
-			vendor = L"Thesycon";
+			vendor = VendorName();
 
 			// Promote generic class to Thesycon class
 			auto specific = std::make_unique<AsioDriver_Thesycon>();
@@ -198,6 +975,7 @@ class AsioDriver_Thesycon: public AsioDriver {
 		}
 		catch (const std::exception& e) {
 			dbg(L"Attempt unsuccessfull.");
+			devices.clear();
 			if (apiDllHandle) {
 				FreeLibrary(apiDllHandle);
 				apiDllHandle = 0;
@@ -207,100 +985,112 @@ class AsioDriver_Thesycon: public AsioDriver {
 	}
 
 
-	long ReopenDevice(long index) {
-		auto func = GetProcAddress(apiDllHandle, "TUSBAUDIO_OpenDeviceByIndex");
-		if (!func) return -1;
-		deviceIndex = index;
-		auto result = ((TUSBAUDIO_OpenDeviceByIndex)func)(deviceIndex, &deviceHandle);
-		dbg(std::format(L"ReopenDevice result={} handle={}", result, deviceHandle));
-		return result;
+	std::wstring VendorName() const override {
+		return L"Thesycon";
 	}
 
 
-	long GetDeviceProperties() {
-		auto func = GetProcAddress(apiDllHandle, "TUSBAUDIO_GetDeviceProperties");
-		if (!func) return -1;
-		char buf[2048]{};
-		auto result = ((TUSBAUDIO_GetDeviceProperties)func)(deviceHandle, (void*)buf);
-		deviceModel = *(uint64_t*)buf; // VID & PID
-		deviceName = (WCHAR*)(buf + 524); // product "Audient iD14"
-		dbg(std::format(L"Device info result={} model={:016x} name={}", result, deviceModel, deviceName));
-		return result;
+	void Describe(ProbeCache::Entry& entry) const override {
+		entry.apiPath = apiPath;
+		entry.deviceModel = devices.empty() ? 0 : devices.front()->deviceModel;
 	}
 
 
-	bool DeviceAlive() {
-		auto func = GetProcAddress(apiDllHandle, "TUSBAUDIO_AudioControlRequestGet");
-		if (!func) return false;
-		short buf{};
-		auto result = ((TUSBAUDIO_AudioControlRequestGet)func)(deviceHandle, 0x3C, 0x1, 0x1, 0, (void*)&buf, 2, NULL, 2000);
-		dbg(std::format(L"DeviceCheck = {}", (result==0)));
-		return (result == 0);
+	std::wstring Info() const override {
+		auto info = AsioDriver::Info();
+		for (const auto& device : devices)
+			info += L"\n    " + device->Info();
+		return info;
 	}
 
-	byte GetVirtualChannelIndex(byte channel) {
 
-		std::unordered_map<uint64_t, int> mixSupport = {
-			{ 0x0100002708, 3 },   //=Audient iD22 mk1 (from video) 
-			{ 0x0200002708, 3 },   //?Audient iD14 mk1 (from video, but somewhere 2)
-			{ 0x0300002708, 1 },   // Audient iD4 mk1
-			{ 0x0400002708, 2 },   //=Audient Sono (from video)                             todo! 
-			{ 0x0500002708, 3 },   // Audient iD44 mk1                            Check mix numbers with real HW.
-			{ 0x0600002708, 1 },   // Audient EVO4                                 Not sure if they are correct.
-			{ 0x0700002708, 2 },   //?Audient EVO8 (from video)
-			{ 0x0900002708, 1 },   // Audient iD4 mk2                                    1 = MainMix
-			{ 0x0800002708, 3 },   //+Audient iD14 mk2 (real hw tested)                  2 = MainMix + Cue
-			{ 0x0A00002708, 5 },   //=Audient EVO16 (from video)                         3 = MainMix + CueA + CueB
-			{ 0x0B00002708, 5 },   //=Audient iD44 mk2 (from video)
-			{ 0x0D00002708, 3 },   //=Audient iD24 mk2 (from video)
-			{ 0x0E00002708, 1 },   // Audient ORIA
-			{ 0x0F00002708, 1 },   // Audient iD4 Stream OTG 
-			{ 0x1000002708, 3 },   // Audient iD14 Stream OTG
-//			{ 0x__00002708, 5 },   //=Audient iD48 (from video presentation)
+	// Let the driver signal arrival and removal, so nobody has to poll the devices.
+	// A notification doesn't say which device it was about, every session checks its own.
+	bool RegisterPnpNotification() {
+		if (!api.registerPnpNotification) return false;
+		for (auto& e : pnpEvents)
+			if (!(e = CreateEventW(NULL, FALSE, FALSE, NULL))) return false;
+		if NOT_OK(api.registerPnpNotification(pnpEvents[0], pnpEvents[1], NULL, 0, 0)) return false;
+
+		WAITORTIMERCALLBACK callbacks[2] = {
+			[](void* self, BOOLEAN) {
+				dbg(L"PnP: device arrived");
+				for (auto& device : ((AsioDriver_Thesycon*)self)->devices) device->session->OnDeviceArrived();
+			},
+			[](void* self, BOOLEAN) {
+				dbg(L"PnP: device removed");
+				for (auto& device : ((AsioDriver_Thesycon*)self)->devices) device->session->OnDeviceRemoved();
+			}
 		};
-		int mixCount = mixSupport.contains(deviceModel) ? mixSupport[deviceModel] : 1;
-		return channel * (mixCount * 2); // L+R
+		for (int i = 0; i < 2; i++)
+			if (!RegisterWaitForSingleObject(&pnpWaits[i], pnpEvents[i], callbacks[i], this, INFINITE, WT_EXECUTEDEFAULT))
+				return false;
+		return true;
 	}
 
 
-	long SetVol(byte channel, VolPair vol) {
-		byte channel_l = GetVirtualChannelIndex(channel);
-		byte channel_r = GetVirtualChannelIndex(channel) + 1;
-		auto func = GetProcAddress(apiDllHandle, "TUSBAUDIO_AudioControlRequestSet");
-		if (!func) return -1;
-		auto result = ((TUSBAUDIO_AudioControlRequestSet)func)(deviceHandle, 0x3C, 0x1, 0x1, channel_l, (void*)&vol.L, 2, NULL, 10000);
-		              ((TUSBAUDIO_AudioControlRequestSet)func)(deviceHandle, 0x3C, 0x1, 0x1, channel_r, (void*)&vol.R, 2, NULL, 10000);
-		dbg(std::format(L"SetVol ch{}={}/{} result={}", channel, vol.L, vol.R, result));
-		return result;
+	bool StartWorker() override {
+		if (!pnpEvents[0]) {
+			bool notifications = RegisterPnpNotification();
+			dbg(notifications ? L"Device state is tracked by PnP notifications" : L"No PnP notifications, device state is tracked by a heartbeat");
+			for (auto& device : devices)
+				device->Start(notifications);
+		}
+		return AsioDriver::StartWorker();
 	}
 
 
-	long GetVol(byte channel, VolPair& vol) {
-		byte channel_l = GetVirtualChannelIndex(channel);
-		byte channel_r = GetVirtualChannelIndex(channel) + 1;
-		auto func = GetProcAddress(apiDllHandle, "TUSBAUDIO_AudioControlRequestGet");
-		if (!func) return -1;
-		auto result = ((TUSBAUDIO_AudioControlRequestGet)func)(deviceHandle, 0x3C, 0x1, 0x1, channel_l, (void*)&vol.L, 2, NULL, 10000);
-		              ((TUSBAUDIO_AudioControlRequestGet)func)(deviceHandle, 0x3C, 0x1, 0x1, channel_r, (void*)&vol.R, 2, NULL, 10000);
-		dbg(std::format(L"GetVol ch{}={}/{} result={}", channel, vol.L, vol.R, result));
-		return result;
+	void PrepareDevices() override {
+		for (auto& device : devices)
+			device->Prepare();
 	}
 
 
-	// Actual work is done here
-	long SetInputMonitor(ASIOInputMonitor* params) override {
-		dbg(std::format(L"Thesycon SetInputMonitor in={} out={} gain={} pan={} state={}", params->input, params->output, params->gain, params->pan, params->state));
+	// ASIO inputs are numbered across all devices. A single device whose count is not
+	// known gets what the driver reports beyond the others. Returns nullptr if the input
+	// is past the last device, or if that isn't enough to tell where it goes: guessing
+	// would switch monitoring on another device's input.
+	ThesyconDevice* MapInput(long input, long& channel) {
+		if (devices.size() == 1) {
+			channel = input;
+			return devices.front().get();
+		}
+		long known = 0, unknown = 0;
+		for (const auto& device : devices) {
+			known += device->InputCount();
+			unknown += !device->InputCount();
+		}
+		long rest = inputCount.load() - known;
+		if (unknown > 1 || (unknown && rest <= 0)) return nullptr;
+		for (const auto& device : devices) {
+			long count = device->InputCount() ? device->InputCount() : rest;
+			if (input < count) {
+				channel = input;
+				return device.get();
+			}
+			input -= count;
+		}
+		return nullptr;
+	}
 
-		if (!DeviceAlive()) ReopenDevice(deviceIndex);
-		VolPair v{};
-		GetVol(params->input, v);
-		if (v != minusInf) lastVol[params->input] = v;
 
-		if (params->state && (params->gain > 100)) 
-			SetVol(params->input, lastVol[params->input]);
-		else 
-			SetVol(params->input, minusInf);
+	// Coalescing worker thread. Hands the command over to the worker of its device.
+	long SetInputMonitor(MonitorCommand* params) override {
+		dbg(L"Thesycon SetInputMonitor in={} out={} gain={} pan={} state={}", params->input, params->output, params->gain, params->pan, params->state);
+		long channel = 0;
+		auto device = MapInput(params->input, channel);
+		if (!device) {
+			dbg(L"Can't tell which device input {} belongs to, list the devices with their inputs in asio-dm-activator-devices.txt", params->input);
+			return ASE_NotPresent;
+		}
 
+		MonitorCommand command = *params;
+		command.input = channel;
+		if (!device->worker) return device->SetInputMonitor(&command);
+		if (!device->worker->Submit(command)) {
+			dbg(L"Device command queue is full, command dropped");
+			return ASE_NoMemory;
+		}
 		return ASE_SUCCESS;
 	}
 };
@@ -310,14 +1100,14 @@ class AsioDriver_Thesycon: public AsioDriver {
 class AsioDriver_Asio4All : public AsioDriver {
 
 	std::optional<std::unique_ptr<AsioDriver>> TryInit() override {
-		dbg(L"Trying to init '" + name + L"' as Asio4All");
+		dbg(L"Trying to init '{}' as Asio4All", name);
 		#ifndef _DEBUG
 			dbg(L"Available in debug builds only");
 			return std::nullopt;
 		#endif
 		if (asioPath.ends_with(L"asio4all64.dll")) {
 			dbg(L"Init ok, this is Asio4All.");
-			vendor = L"Asio4All";
+			vendor = VendorName();
 
 			// Promote generic class to Asio4All class
 			auto specific = std::make_unique<AsioDriver_Asio4All>();
@@ -330,9 +1120,13 @@ class AsioDriver_Asio4All : public AsioDriver {
 		}
 	}
 
+	std::wstring VendorName() const override {
+		return L"Asio4All";
+	}
+
 	// Actual work is done here
-	long SetInputMonitor(ASIOInputMonitor* params) override {
-		dbg(std::format(L"Asio4All SetInputMonitor in={} out={} gain={} pan={} state={}", params->input, params->output, params->gain, params->pan, params->state));
+	long SetInputMonitor(MonitorCommand* params) override {
+		dbg(L"Asio4All SetInputMonitor in={} out={} gain={} pan={} state={}", params->input, params->output, params->gain, params->pan, params->state);
 		return ASE_NotPresent;
 	}
 
@@ -365,15 +1159,87 @@ public:
 		[]() { return std::make_unique<AsioDriver_SomethingElse>(); }
 	};
 
+	// Probe a driver only when the host instantiates it, so drivers the user never
+	// selects don't cost anything at startup. Falls back to probing everything at once
+	// if the host's CoCreateInstance can't be intercepted. Only the modules loaded by
+	// then are hooked, a host that instantiates drivers from a module it loads later
+	// needs lazy off (ASIO_DM_ACTIVATOR_PROBE=eager).
+	bool lazy = true;
+
+	// Drivers are probed side by side, and one that takes longer than this is given up
+	int probeThreads = 4;
+	std::chrono::milliseconds probeTimeout{ 10000 };
+
 	// Wakey-wakey, eggs and bakey
-	AsioDriverManager() {
+	explicit AsioDriverManager(bool lazy = true) : lazy(lazy) {
 		ListDrivers();
-		InitDrivers();
-		PatchDrivers();
+		for (auto& driver : drivers)
+			asioClasses.push_back(driver->iid);
+		LoadCache();
+		if (lazy && HookInstantiation()) {
+			dbg(L"Drivers will be patched on first use");
+			return;
+		}
+		ProbeDrivers();
+	}
+
+	// Any thread. Probe and patch the driver with this CLSID, unless that was done already.
+	void Prepare(REFCLSID clsid) {
+		// Most calls are for other COM classes, those don't wait for a probe
+		if (std::find(asioClasses.begin(), asioClasses.end(), clsid) == asioClasses.end()) return;
+		std::lock_guard<std::recursive_mutex> lock(mutex);
+		std::vector<size_t> wanted;
+		for (size_t i = 0; i < drivers.size(); i++) {
+			if (drivers[i]->probed || drivers[i]->iid != clsid) continue;
+			dbg(L"Host instantiates {}", drivers[i]->name);
+			wanted.push_back(i);
+		}
+		ProbeInParallel(wanted);
+		for (size_t i : wanted)
+			dbg(L"{}", drivers[i]->Info());
+		SaveCache();
 	}
 
 private:
 
+	std::recursive_mutex mutex;	// Prepare() can be called from any host thread
+	std::vector<CLSID> asioClasses;	// of all registered drivers, not changed once the hooks are in place
+	std::mutex cacheMutex;		// probes run on threads of their own
+	ProbeCache cache;
+	std::filesystem::path cachePath;	// %LOCALAPPDATA%\asio-dm-activator\probe-cache.bin
+
+	static inline AsioDriverManager* instance{};
+	static inline uintptr_t coCreateInstanceOriginal{};
+	static inline uintptr_t coGetClassObjectOriginal{};
+	static inline thread_local bool probing{};	// a driver being probed may instantiate COM objects itself
+
+	// ASIO hosts create drivers with one of these, patch the driver right before that
+	static HRESULT WINAPI CoCreateInstanceHook(REFCLSID clsid, LPUNKNOWN outer, DWORD context, REFIID iid, LPVOID* object) {
+		if (instance && !probing) instance->Prepare(clsid);
+		return ((decltype(&CoCreateInstance))coCreateInstanceOriginal)(clsid, outer, context, iid, object);
+	}
+
+	static HRESULT WINAPI CoGetClassObjectHook(REFCLSID clsid, DWORD context, COSERVERINFO* server, REFIID iid, LPVOID* object) {
+		if (instance && !probing) instance->Prepare(clsid);
+		return ((decltype(&CoGetClassObject))coGetClassObjectOriginal)(clsid, context, server, iid, object);
+	}
+
+	// Redirect the host's COM instantiation calls to the hooks above
+	bool HookInstantiation() {
+		HMODULE ole = GetModuleHandleW(L"ole32.dll");
+		if (!ole && !(ole = LoadLibraryW(L"ole32.dll"))) return false;
+		coCreateInstanceOriginal = (uintptr_t)GetProcAddress(ole, "CoCreateInstance");
+		coGetClassObjectOriginal = (uintptr_t)GetProcAddress(ole, "CoGetClassObject");
+		if (!coCreateInstanceOriginal || !coGetClassObjectOriginal) return false;
+
+		instance = this;
+		int count = PatchImportsEverywhere(coCreateInstanceOriginal, (uintptr_t)&CoCreateInstanceHook)
+			+ PatchImportsEverywhere(coGetClassObjectOriginal, (uintptr_t)&CoGetClassObjectHook);
+		dbg(L"Hooked {} COM instantiation imports", count);
+		if (!count) instance = nullptr;
+		return count > 0;
+	}
+
 	void ListDrivers() {
 		dbg(L"Getting installed drivers");
 		drivers.clear();
@@ -409,94 +1275,266 @@ private:
 			if (!PathFileExistsW(driver->asioPath.c_str())) continue;
 			RegCloseKey(subkey);
 			
-			dbg(L"Found " + driver->name);
+			dbg(L"Found {}", driver->name);
 			drivers.push_back((std::move(driver)));
 		}
 		RegCloseKey(asioRoot);
 	}
 
 
-	// Init and promote generic classes to specific classes
-	void InitDrivers() {
-		dbg(L"Initializing drivers");
+	// Probe results from earlier sessions, %LOCALAPPDATA%\asio-dm-activator\probe-cache.bin.
+	// Loaded when the manager is constructed, before any driver is probed.
+	void LoadCache() {
+		WCHAR appData[MAX_PATH]{};
+		if (!GetEnvironmentVariableW(L"LOCALAPPDATA", appData, MAX_PATH)) return;
+		cachePath = std::filesystem::path(appData) / L"asio-dm-activator" / L"probe-cache.bin";
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		dbg(L"Probe cache {}", cache.Load(cachePath) ? L"loaded" : L"is empty");
+	}
+
+
+	void SaveCache() {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		if (!cachePath.empty() && cache.IsDirty() && !cache.Save(cachePath))
+			dbg(L"Unable to save the probe cache");
+	}
+
+
+	static uint64_t FileVersion(const std::wstring& path) {
+		DWORD handle = 0;
+		DWORD size = GetFileVersionInfoSizeW(path.c_str(), &handle);
+		if (!size) return 0;
+		std::vector<uint8_t> buf(size);
+		VS_FIXEDFILEINFO* info = nullptr;
+		UINT infoSize = 0;
+		if (!GetFileVersionInfoW(path.c_str(), 0, size, buf.data()) || !VerQueryValueW(buf.data(), L"\\", (LPVOID*)&info, &infoSize) || !info)
+			return 0;
+		return ((uint64_t)info->dwFileVersionMS << 32) | info->dwFileVersionLS;
+	}
+
 
-		for (auto& driver : drivers) {
-			for (const auto& createDriver : knownDrivers) {
-				auto specificDriver = createDriver();
-				*specificDriver = *driver;
-				if (auto result = specificDriver->TryInit(); result) {
-					driver = std::move(*result); // Replace generic asio driver with a specific one					
-					break;
-				}
+	void ProbeDrivers() {
+		dbg(L"Probing drivers");
+		std::vector<size_t> all(drivers.size());
+		for (size_t i = 0; i < all.size(); i++) all[i] = i;
+		ProbeInParallel(all);
+		SaveCache();
+	}
+
+
+	// Probe the drivers at these indices, each on a thread of its own (see probe.h). A probe
+	// works on a copy of the driver, which replaces it once the probe is done. A driver
+	// whose probe misses its deadline stays unpatched. Its copy is unhooked whenever the
+	// probe does finish and never freed, the host may have called its hooks by then.
+	void ProbeInParallel(const std::vector<size_t>& indices) {
+		if (indices.empty()) return;
+		std::vector<std::shared_ptr<std::unique_ptr<AsioDriver>>> candidates;
+		std::vector<ProbePool::Task> tasks;
+		for (size_t i : indices) {
+			auto candidate = std::make_shared<std::unique_ptr<AsioDriver>>(std::make_unique<AsioDriver>(*drivers[i]));
+			candidates.push_back(candidate);
+			tasks.push_back({
+				[this, candidate]() {
+					probing = true;
+					bool com = SUCCEEDED(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED));	// drivers expect it, as on the host's thread
+					ProbeDriver(*candidate);
+					if (com) CoUninitialize();
+				},
+				[candidate]() {
+					dbg(L"{} was probed after all, too late, unpatching it", (*candidate)->name);
+					(*candidate)->Unhook();
+					candidate->release();
+				} });
+		}
+		auto start = StatsBlock::Now();
+		auto finished = ProbePool::Run(std::move(tasks), probeThreads, probeTimeout);
+		for (size_t k = 0; k < indices.size(); k++) {
+			auto& driver = drivers[indices[k]];
+			if (finished[k]) {
+				driver = std::move(*candidates[k]);
+				continue;
 			}
+			dbg(L"{} was not probed in {} ms, giving up on it", driver->name, probeTimeout.count());
+			driver->probed = true;
+			driver->state = AsioDriver::State::PatchFail;
 		}
+		dbg(L"Probed {} drivers in {} ms", indices.size(), (StatsBlock::Now() - start) / 1000000);
 	}
 
 
-	// Load Asio drivers and patch them in-memory
-	void PatchDrivers() {
-		dbg(L"Patching drivers");
+	// Init and patch the driver, reusing what the previous sessions found out about it.
+	// Only definite answers are cached, a driver that failed (e.g. because its device
+	// was unplugged) is probed again next time. A driver that is not in the cache is
+	// looked at in the file first, it is only instantiated if that doesn't tell where
+	// future() is.
+	void ProbeDriver(std::unique_ptr<AsioDriver>& driver) {
+		auto file = ProbeCache::Identify(driver->asioPath, FileVersion(driver->asioPath));
+		std::unique_lock<std::mutex> cacheLock(cacheMutex);
+		auto cached = file ? cache.Find(*file) : std::nullopt;
+		cacheLock.unlock();
+		std::optional<PeImage> image;
+		uint64_t hash = cached ? cached->hash : 0;
+		if (!cached && (image = PeImage::Load(driver->asioPath))) {
+			hash = image->Hash();
+			cacheLock.lock();
+			cached = cache.FindByHash(hash);
+			cacheLock.unlock();
+			if (cached) dbg(L"{} is the same dll as {}", driver->asioPath, cached->file.path);
+		}
+		if (cached) {
+			dbg(L"Cached: {} is {}{}, model {:016x}", driver->name, cached->vendor, cached->native ? L" with native DM" : L"", cached->deviceModel);
+			if (cached->native) {
+				driver->probed = true;
+				driver->vendor = cached->vendor;
+				driver->state = AsioDriver::State::Native;
+				return;
+			}
+		}
 
-        for (auto& driver : drivers) {
-			HMODULE hModule = 0;
-            try {
-				dbg(L"Patching " + driver->name);
-				if (typeid(*driver) == typeid(AsioDriver)) 
-					err(L"Unknown or unsupported driver.");
+		InitDriver(driver, cached ? cached->vendor : L"");
+		uint64_t offset = cached ? cached->patchOffset : 0;
+		if (!offset && image && typeid(*driver) != typeid(AsioDriver))
+			if (auto vtable = image->FindInterfaceVtable("IASIO", kSlotOutputReady + 1)) {
+				offset = *vtable + kSlotFuture * sizeof(uintptr_t);
+				dbg(L"IASIO vtable of {} found in the file at {:x}", driver->name, *vtable);
+			}
+		if (!offset || !PatchDriverAt(driver, offset))
+			PatchDriver(driver);
+
+		if (file && (driver->state == AsioDriver::State::PatchOk || driver->state == AsioDriver::State::Native)) {
+			ProbeCache::Entry entry;
+			entry.file = *file;
+			entry.vendor = driver->vendor;
+			entry.native = driver->state == AsioDriver::State::Native;
+			entry.hash = hash;
+			if (driver->asioDllHandle) entry.patchOffset = driver->asioDllPatchPlace - (uintptr_t)driver->asioDllHandle;
+			driver->Describe(entry);
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			cache.Store(entry);
+		}
+	}
 
-                // Load ASIO driver
-                hModule = LoadLibraryW(driver->asioPath.c_str());
-				if (!hModule) 
-					err(L"Can not load dll " + driver->asioPath);
+
+	// Only the class named by vendor is tried, if given
+	void InitDriver(std::unique_ptr<AsioDriver>& driver, const std::wstring& vendor = L"") {
+		driver->probed = true;
+		for (const auto& createDriver : knownDrivers) {
+			auto specificDriver = createDriver();
+			if (!vendor.empty() && specificDriver->VendorName() != vendor) continue;
+			*specificDriver = *driver;
+			if (auto result = specificDriver->TryInit(); result) {
+				driver = std::move(*result); // Replace generic asio driver with a specific one					
+				break;
+			}
+		}
+	}
+
+
+	// Patch the vtable slot found in a previous session or in the file, without instantiating the driver
+	bool PatchDriverAt(std::unique_ptr<AsioDriver>& driver, uint64_t offset) {
+		if (typeid(*driver) == typeid(AsioDriver) || !offset) return false;
+		HMODULE hModule = LoadLibraryW(driver->asioPath.c_str());
+		if (!hModule) return false;
+		try {
+			dbg(L"Patching {} at {:x}", driver->name, offset);
+			auto base = (uintptr_t)hModule;
+			auto nt = (IMAGE_NT_HEADERS*)(base + ((IMAGE_DOS_HEADER*)base)->e_lfanew);
+			uintptr_t end = base + nt->OptionalHeader.SizeOfImage;
+			if (offset + sizeof(uintptr_t) > nt->OptionalHeader.SizeOfImage)
+				err(L"Cached vtable slot is outside of the dll");
+			uintptr_t original = *(uintptr_t*)(base + offset);
+			if (original < base || original >= end)
+				err(L"Cached vtable slot points to {:016x}, outside of the dll", original);
+			driver->asioDllPatchPlace = base + offset;
+			driver->futureFunctionOriginal = original;
+			driver->askNative = true;
+			InstallPatch(*driver);
+			driver->asioDllHandle = hModule;
+			driver->state = AsioDriver::State::PatchOk;
+			return true;
+		}
+		catch (const std::exception& e) {
+			dbg(L"That place is no good, probing.");
+			driver->Unhook();
+			FreeLibrary(hModule);
+			return false;
+		}
+	}
+
+
+	// Replace future() with our own implementation
+	void InstallPatch(AsioDriver& driver) {
+		if (!driver.FutureFunctionReplacementThunk()) 
+			err(L"The replacement function is not ready (yet)");
+		if (!driver.StartWorker())
+			err(L"Unable to start the command worker");
+
+		if (!driver.HookSlot(kSlotFuture, driver.FutureFunctionReplacementThunk()))
+			err(L"Unable to write the vtable slot @{:016x}", driver.asioDllPatchPlace);
+		if (!driver.HookSlot(kSlotInit, (uintptr_t)&AsioDriver::InitReplacement)
+			|| !driver.HookSlot(kSlotStart, (uintptr_t)&AsioDriver::StartReplacement))
+			dbg(L"Driver start can't be seen, devices are not prepared for the first command");
+		if (!driver.HookSlot(kSlotCreateBuffers, (uintptr_t)&AsioDriver::CreateBuffersReplacement)
+			|| !driver.HookSlot(kSlotDisposeBuffers, (uintptr_t)&AsioDriver::DisposeBuffersReplacement))
+			dbg(L"Buffer switches can't be seen, commands are not aimed at buffer boundaries");
+		dbg(L"Patched @{:016x} old:{:016x}, new:{:016x}", driver.asioDllPatchPlace, driver.futureFunctionOriginal, driver.FutureFunctionReplacementThunk());
+	}
+
+
+	// Load Asio driver, find future() and patch it in-memory
+	void PatchDriver(std::unique_ptr<AsioDriver>& driver) {
+		HMODULE hModule = 0;
+        try {
+			dbg(L"Patching {}", driver->name);
+			if (typeid(*driver) == typeid(AsioDriver)) 
+				err(L"Unknown or unsupported driver.");
+
+            // Load ASIO driver
+            hModule = LoadLibraryW(driver->asioPath.c_str());
+			if (!hModule) 
+				err(L"Can not load dll {}", driver->asioPath);
     
-                auto pDllGetClassObject = reinterpret_cast<DllGetClassObjectFunction>(GetProcAddress(hModule, "DllGetClassObject"));
-				if (!pDllGetClassObject)
-					err(L"Function DllGetClassObject not found in " + driver->asioPath);
+            auto pDllGetClassObject = reinterpret_cast<DllGetClassObjectFunction>(GetProcAddress(hModule, "DllGetClassObject"));
+			if (!pDllGetClassObject)
+				err(L"Function DllGetClassObject not found in {}", driver->asioPath);
         
-				// Get class factory
-                IClassFactory* pClassFactory = nullptr;  
-				if NOT_OK(pDllGetClassObject(driver->iid, IID_IClassFactory, (void**)&pClassFactory))
-					err(L"Unable to obtain class factory from " + driver->asioPath);
+			// Get class factory
+            IClassFactory* pClassFactory = nullptr;  
+			if NOT_OK(pDllGetClassObject(driver->iid, IID_IClassFactory, (void**)&pClassFactory))
+				err(L"Unable to obtain class factory from {}", driver->asioPath);
         
-				// Get IASIO interface from factory
-                IUnknown* pAsio = nullptr;  
-				if NOT_OK(pClassFactory->CreateInstance(nullptr, driver->iid, (void**)&pAsio)) 
-					err(L"Unable to obtain iASIO " + driver->clsid + L" from " + driver->asioPath);
+			// Get IASIO interface from factory
+            IUnknown* pAsio = nullptr;  
+			if NOT_OK(pClassFactory->CreateInstance(nullptr, driver->iid, (void**)&pAsio)) 
+				err(L"Unable to obtain iASIO {} from {}", driver->clsid, driver->asioPath);
         
-				// Find future() is the 23'rd method (0-based)
-                uintptr_t* vtable = *(uintptr_t**)(pAsio);  
-                if (!vtable || !vtable[22])  
-					err(std::format(L"iASIO vtable @ {:016x} looks corrupted", (uintptr_t)vtable));
-                driver->asioDllPatchPlace = (uintptr_t) &vtable[22];
-                driver->futureFunctionOriginal = vtable[22];
-                
-                // Is native dm control supported? then no need to patch
-				if (((AsioFutureFunction)driver->futureFunctionOriginal)(pAsio, kAsioCanInputMonitor, nullptr) == ASE_SUCCESS) {
-					driver->state = AsioDriver::State::Native;
-					err(L"Native DM support detected.");
-				}      
-				
-                pClassFactory->Release();
-                pAsio->Release();      
-
-                // Replace future() with our own implementation
-				if (!driver->FutureFunctionReplacementThunk()) 
-					err(L"The replacement function is not ready (yet)");
-
-				DWORD oldProtect;
-				VirtualProtect((void*)driver->asioDllPatchPlace, sizeof(uintptr_t), PAGE_EXECUTE_READWRITE, &oldProtect);
-				*(uintptr_t*)driver->asioDllPatchPlace = driver->FutureFunctionReplacementThunk();
-				dbg(std::format(L"Patched @{:016x} old:{:016x}, new:{:016x}", driver->asioDllPatchPlace, driver->futureFunctionOriginal, driver->FutureFunctionReplacementThunk()));
-
-				driver->asioDllHandle = hModule;
-                driver->state = AsioDriver::State::PatchOk;
-            } catch (const std::exception& e) {
+			// Find future() is the 23'rd method (0-based)
+            uintptr_t* vtable = *(uintptr_t**)(pAsio);  
+            if (!vtable || !vtable[kSlotFuture])  
+				err(L"iASIO vtable @ {:016x} looks corrupted", (uintptr_t)vtable);
+            driver->asioDllPatchPlace = (uintptr_t) &vtable[kSlotFuture];
+            driver->futureFunctionOriginal = vtable[kSlotFuture];
+            
+            // Is native dm control supported? then no need to patch
+			if (((AsioFutureFunction)driver->futureFunctionOriginal)(pAsio, kAsioCanInputMonitor, nullptr) == ASE_SUCCESS) {
+				driver->state = AsioDriver::State::Native;
+				err(L"Native DM support detected.");
+			}      
+			
+            pClassFactory->Release();
+            pAsio->Release();      
+
+			InstallPatch(*driver);
+
+			driver->asioDllHandle = hModule;
+            driver->state = AsioDriver::State::PatchOk;
+        } catch (const std::exception& e) {
+			if (driver->state != AsioDriver::State::Native)
 				driver->state = AsioDriver::State::PatchFail;
-				dbg(L"Not patched.");
-				if (hModule) FreeLibrary(hModule);
-                continue;
-            }
-		}
+			dbg(L"Not patched.");
+			driver->Unhook();
+			if (hModule) FreeLibrary(hModule);
+        }
 	}
 };
 
@@ -518,17 +1556,67 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 }
 
 
+// Log level and an optional log file come from the environment:
+//     ASIO_DM_ACTIVATOR_LOG = trace | debug | info | error | off
+//     ASIO_DM_ACTIVATOR_LOGFILE = c:\path\to\file.log
+// and so do a capture for bench/replay.cpp and the jitter monitor (see jitter.h):
+//     ASIO_DM_ACTIVATOR_CAPTURE = c:\path\to\file.admt
+//     ASIO_DM_ACTIVATOR_JITTER = on
+void StartLogging() {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		WCHAR buf[MAX_PATH]{};
+		if (GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_LOG", buf, MAX_PATH))
+			if (auto level = Logger::ParseLevel(buf)) g_log.SetLevel(*level);
+		g_log.AddSink([](const LogLine& line) {
+			OutputDebugStringW(std::format(L"[ASIO-DM-ACTIVATOR] {} :{}", line.text, line.line).c_str());
+		});
+		if (GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_LOGFILE", buf, MAX_PATH))
+			g_log.AddSink(Logger::FileSink(buf));
+		g_log.Start();
+		if (GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_CAPTURE", buf, MAX_PATH)) {
+			if (g_capture.Start(buf)) dbg(L"Capturing host calls to {}", buf);
+			else dbg(L"Unable to capture host calls to {}", buf);
+		}
+		if (GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_JITTER", buf, MAX_PATH) && std::wstring_view(buf) == L"on") {
+			g_jitter.Enable(true);
+			dbg(L"Timing buffer switches against the plugin's work");
+		}
+	});
+}
+
+
 int MyInit() {
+	StartLogging();
 	dbg(L"Hello");
+	if (auto shared = StatsBlock::Publish(GetCurrentProcessId())) {
+		g_stats = shared;
+		dbg(L"Statistics: run asio-dm-stats {}", GetCurrentProcessId());
+	}
 	try {	
 		// Prevent being unloaded by host
 		wchar_t selfName[MAX_PATH];
 		GetModuleFileNameW(g_hSelf, selfName, MAX_PATH);
 		LoadLibrary(selfName); 
+		// Extra device profiles, if the user has any
+		auto profilesPath = std::filesystem::path(selfName).replace_filename(L"asio-dm-activator-devices.txt");
+		if (int count = g_devices.LoadFile(profilesPath); count >= 0)
+			dbg(L"Loaded {} device profiles from {}", count, profilesPath.wstring());
+		// ASIO_DM_ACTIVATOR_MONITOR = switch | follow
+		WCHAR mode[16]{};
+		if (GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_MONITOR", mode, 16))
+			g_followGain = std::wstring_view(mode) == L"follow";
+		dbg(L"Monitor level {}", g_followGain ? L"follows host gain and pan" : L"is switched on and off");
+		WCHAR appData[MAX_PATH]{};
+		if (GetEnvironmentVariableW(L"LOCALAPPDATA", appData, MAX_PATH) 
+			&& !g_snapshot.Open(std::filesystem::path(appData) / L"asio-dm-activator" / L"mixer-snapshot.bin"))
+			dbg(L"Unable to open the mixer snapshot, levels are kept for this session only");
+		// ASIO_DM_ACTIVATOR_PROBE = lazy | eager
+		bool lazy = !GetEnvironmentVariableW(L"ASIO_DM_ACTIVATOR_PROBE", mode, 16) || std::wstring_view(mode) != L"eager";
 		// Do our job
-		g_driverManager = std::make_unique<AsioDriverManager>();
+		g_driverManager = std::make_unique<AsioDriverManager>(lazy);
 		for (auto &driver : g_driverManager->drivers) 
-			dbg(driver->Info());
+			if (driver->probed) dbg(L"{}", driver->Info());
 		return 1;
 	}
 	catch (const std::exception& e) {
@@ -0,0 +1,216 @@
+// Gain and pan of direct monitoring.
+//
+// ASIO gives the monitor gain as 0..0x7fffffff, linear, 0x20000000 being 0 dB, and the
+// pan as 0..0x7fffffff from left to right. Thesycon mixers take a level in 1/256 dB
+// for each of the L and R crosspoints of an input. GainLaw converts one into the other
+// with precomputed tables, no logarithms when a command arrives.
+//
+// Hosts that follow the channel fader send a stream of commands while it moves, far
+// more than the USB control endpoint should take. GainEngine keeps only the latest
+// target of each channel and lets the device worker write them at a bounded rate,
+// optionally in short ramps instead of one jump. Whatever the host sent in between is
+// never written, and the device always ends up at the newest setting.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include "mixer.h"
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+
+class GainLaw {
+public:
+	static constexpr long Unity = 0x20000000;	// ASIO gain of 0 dB
+	static constexpr long Center = 0x3fffffff;	// ASIO pan
+	static constexpr short MinLevel = -32767;	// lowest level above -inf, 1/256 dB
+	static constexpr short MaxLevel = 0;		// crosspoints above unity are not assumed to exist
+
+	// Both crosspoints of an input
+	static VolPair ToDevice(long gain, long pan) {
+		short level = Level(gain);
+		if (level == ShadowMixer::MinusInf.L) return ShadowMixer::MinusInf;
+		pan = std::clamp<long>(pan, 0, 0x7fffffff);
+		return { Attenuate(level, PanOffset(0x7fffffff - pan)), Attenuate(level, PanOffset(pan)) };
+	}
+
+	// Level for an ASIO gain, 1/256 dB, -32768 = -inf
+	static short Level(long gain) {
+		if (gain <= 0) return ShadowMixer::MinusInf.L;
+		const auto& t = Tables();
+		uint32_t g = (uint32_t)gain;
+		if (g < SubSteps) return t.gain[g];
+		int shift = std::bit_width(g) - 1 - MantissaBits;
+		int index = (shift + 1) * SubSteps + (int)((g >> shift) - SubSteps);
+		uint32_t fraction = g & ((1u << shift) - 1);	// interpolated, the table has the value at the start of each step
+		int a = t.gain[index], b = t.gain[index + 1];
+		return (short)(a + (int)(((int64_t)(b - a) * fraction) >> shift));
+	}
+
+private:
+	static constexpr int MantissaBits = 6;
+	static constexpr uint32_t SubSteps = 1u << MantissaBits;
+	static constexpr int GainEntries = 26 * SubSteps + 1;	// up to 2^31
+	static constexpr int PanEntries = 257;
+
+	struct Table {
+		std::array<short, GainEntries> gain;
+		std::array<short, PanEntries> pan;	// attenuation of the side the input is panned away from, by pan towards it
+	};
+
+	static const Table& Tables() {
+		static const Table table = [] {
+			Table t{};
+			for (int i = 0; i < GainEntries; i++) {
+				double value = i < (int)SubSteps ? i : (double)(SubSteps + i % SubSteps) * std::ldexp(1.0, i / SubSteps - 1);
+				t.gain[i] = i ? ToUnits(20 * std::log10(value / Unity)) : ShadowMixer::MinusInf.L;
+			}
+			// Balance law: the center leaves both sides at 0 dB, moving away attenuates
+			// one side along a constant-power curve, down to -inf at the far end
+			const double pi = 3.14159265358979323846;
+			for (int i = 0; i < PanEntries; i++) {
+				double amplitude = std::min(1.0, std::sqrt(2.0) * std::sin(i / (PanEntries - 1.0) * pi / 2));
+				t.pan[i] = amplitude > 0 ? ToUnits(20 * std::log10(amplitude)) : ShadowMixer::MinusInf.L;
+			}
+			return t;
+		}();
+		return table;
+	}
+
+	static short ToUnits(double db) {
+		return (short)std::clamp<long>(std::lround(db * 256), ShadowMixer::MinusInf.L, 0x7fff);
+	}
+
+	// 0 = fully away from this side, 0x7fffffff = fully towards it
+	static short PanOffset(long towards) {
+		const auto& t = Tables();
+		if (towards <= 0) return t.pan[0];
+		uint32_t position = (uint32_t)towards + 1;	// center (0x3fffffff) and the ends land exactly on an entry
+		int index = (int)(position >> 23);			// 0..256
+		uint32_t fraction = position & 0x7fffff;
+		int a = t.pan[index];
+		if (!fraction) return (short)a;
+		int b = t.pan[index + 1];
+		if (a == ShadowMixer::MinusInf.L) return (short)b;
+		return (short)(a + (int)(((int64_t)(b - a) * fraction) >> 23));
+	}
+
+	static short Attenuate(short level, short offset) {
+		if (offset == ShadowMixer::MinusInf.L) return ShadowMixer::MinusInf.L;
+		return (short)std::clamp<int>(level + offset, MinLevel, MaxLevel);
+	}
+};
+
+
+class GainEngine {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Settings {
+		int pairsPerSecond = 500;	// L+R crosspoint pairs written per second, at most
+		int burst = 64;				// pairs that may go out back to back, e.g. when a whole selection is armed
+		short rampStep = 0x300;		// largest change per write in 1/256 dB, 0 = jump straight to the target
+	};
+
+	// One write of both crosspoints of a channel
+	struct Step {
+		int channel{};
+		VolPair vol{};
+		bool last{};		// the target is reached with this one
+		uint64_t issued{};	// given to SetTarget
+		uint64_t due{};		// same
+	};
+
+	GainEngine() : GainEngine(Settings()) {}
+	explicit GainEngine(Settings settings) : settings(settings), tokens(settings.burst) {}
+
+	GainEngine(const GainEngine&) = delete;
+	GainEngine& operator=(const GainEngine&) = delete;
+
+	// Any thread. Replaces whatever target the channel had. Issued and due are handed back
+	// with the last step, for the caller's statistics.
+	void SetTarget(int channel, VolPair target, uint64_t issued = 0, uint64_t due = 0) {
+		if (channel < 0 || channel >= ShadowMixer::MaxChannels) return;
+		auto& s = slots[channel];
+		s.target.store(target.Pack(), std::memory_order_relaxed);
+		s.issued.store(issued, std::memory_order_relaxed);
+		s.due.store(due, std::memory_order_relaxed);
+		s.pending.store(true, std::memory_order_release);
+	}
+
+	bool Pending() const {
+		for (const auto& s : slots)
+			if (s.pending.load(std::memory_order_acquire)) return true;
+		return false;
+	}
+
+	// Worker thread. How long to wait before Next() may write again.
+	Clock::duration Wait(Clock::time_point now) {
+		Refill(now);
+		if (tokens >= 1) return {};
+		return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - tokens) / settings.pairsPerSecond));
+	}
+
+	// Worker thread. The next write, given what the device has now. Channels take turns,
+	// and a channel already at its target costs nothing. Nothing if there is nothing
+	// to do or the rate doesn't allow another write yet.
+	std::optional<Step> Next(const ShadowMixer& shadow, Clock::time_point now) {
+		Refill(now);
+		for (int i = 0; i < ShadowMixer::MaxChannels; i++) {
+			int channel = (int)((cursor + i) % ShadowMixer::MaxChannels);
+			auto& s = slots[channel];
+			if (!s.pending.load(std::memory_order_acquire)) continue;
+			if (tokens < 1) return std::nullopt;
+			s.pending.store(false, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);	// a SetTarget from now on sets it again
+			Step step{ channel, VolPair::Unpack(s.target.load(std::memory_order_relaxed)), true,
+				s.issued.load(std::memory_order_relaxed), s.due.load(std::memory_order_relaxed) };
+
+			bool known = shadow.IsValid(channel);
+			VolPair from = shadow.Current(channel);
+			if (known && from == step.vol) continue;
+			if (known && settings.rampStep > 0 && from != ShadowMixer::MinusInf && step.vol != ShadowMixer::MinusInf) {
+				VolPair to = { Toward(from.L, step.vol.L), Toward(from.R, step.vol.R) };
+				if (to != step.vol) {
+					step.vol = to;
+					step.last = false;
+					s.pending.store(true, std::memory_order_release);	// the rest of the ramp
+				}
+			}
+			tokens -= 1;
+			cursor = channel + 1;
+			return step;
+		}
+		return std::nullopt;
+	}
+
+private:
+	struct alignas(64) Slot {
+		std::atomic<uint32_t> target{ 0 };	// VolPair::Pack
+		std::atomic<uint64_t> issued{ 0 };
+		std::atomic<uint64_t> due{ 0 };
+		std::atomic<bool> pending{ false };
+	};
+
+	Settings settings;
+	Slot slots[ShadowMixer::MaxChannels];
+	double tokens;				// worker thread only
+	Clock::time_point refilled;
+	unsigned cursor{};
+
+	void Refill(Clock::time_point now) {
+		if (refilled != Clock::time_point{})
+			tokens = std::min<double>(settings.burst, tokens + std::chrono::duration<double>(now - refilled).count() * settings.pairsPerSecond);
+		refilled = now;
+	}
+
+	short Toward(short from, short to) const {
+		if (to > from) return (short)std::min<int>(to, from + settings.rampStep);
+		return (short)std::max<int>(to, from - settings.rampStep);
+	}
+};
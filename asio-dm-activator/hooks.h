@@ -0,0 +1,230 @@
+// Vtable hooking.
+//
+// ThunkArena holds the generated stubs. Its memory is mapped twice, once writable and
+// once executable, and no view is ever both. Stubs are written through the one and run
+// through the other, so a stub added later goes into the same page as the ones before
+// it while those may be running, and every stub is executable as soon as it is added.
+//
+// HookRegistry replaces vtable slots and remembers the originals, so any slot can be
+// hooked and every hook can be undone. A replacement for a slot with more arguments
+// than the generated stubs can shift (future() has three, createBuffers() five) is a
+// plain function with the same signature; it finds its context and the original
+// through the registry, by the vtable of the object it was called on. Lookups don't
+// take locks.
+// Builds on Windows and on POSIX systems, so it can be tested anywhere.
+
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <span>
+#include <cstring>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#endif
+
+
+class ThunkArena {
+public:
+	static constexpr size_t PageSize = 4096;
+	static constexpr size_t ChunkSize = 64 * 1024;	// mapped in allocation granules of this size
+	static constexpr size_t Alignment = 16;
+
+	ThunkArena() = default;
+	ThunkArena(const ThunkArena&) = delete;
+	ThunkArena& operator=(const ThunkArena&) = delete;
+
+	// Copy the code into the arena. Returns where it can be executed, right away, or
+	// nullptr if the code doesn't fit into a page or there is no memory.
+	void* Add(std::span<const uint8_t> code) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (code.size() > PageSize) return nullptr;
+		used = (used + Alignment - 1) & ~(Alignment - 1);
+		if (!writable || used + code.size() > ChunkSize) {
+			if (!NewChunk()) return nullptr;
+			used = 0;
+		}
+		memcpy(writable + used, code.data(), code.size());
+		uint8_t* stub = executable + used;
+		FlushCode(stub, code.size());
+		pagesUsed += (used + code.size() + PageSize - 1) / PageSize - (used + PageSize - 1) / PageSize;
+		used += code.size();
+		return stub;
+	}
+
+	size_t PagesUsed() const {
+		return pagesUsed;
+	}
+
+private:
+	std::mutex mutex;
+	uint8_t* writable{};	// views of the current chunk, never unmapped
+	uint8_t* executable{};
+	size_t used{};
+	size_t pagesUsed{};
+
+	bool NewChunk() {
+	#ifdef _WIN32
+		HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE, 0, (DWORD)ChunkSize, nullptr);
+		if (!section) return false;
+		auto w = (uint8_t*)MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, ChunkSize);
+		auto x = (uint8_t*)MapViewOfFile(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, ChunkSize);
+		CloseHandle(section);	// the views keep it
+		if (!w || !x) {
+			if (w) UnmapViewOfFile(w);
+			if (x) UnmapViewOfFile(x);
+			return false;
+		}
+	#else
+	#ifdef __linux__
+		int fd = memfd_create("thunks", MFD_CLOEXEC);
+	#else
+		char name[64];
+		snprintf(name, sizeof(name), "/thunks-%d-%p", (int)getpid(), (void*)this);
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) shm_unlink(name);
+	#endif
+		if (fd < 0) return false;
+		void* w = MAP_FAILED;
+		void* x = MAP_FAILED;
+		if (!ftruncate(fd, ChunkSize)) {
+			w = mmap(nullptr, ChunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			x = mmap(nullptr, ChunkSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+		}
+		close(fd);	// the mappings keep it
+		if (w == MAP_FAILED || x == MAP_FAILED) {
+			if (w != MAP_FAILED) munmap(w, ChunkSize);
+			if (x != MAP_FAILED) munmap(x, ChunkSize);
+			return false;
+		}
+	#endif
+		writable = (uint8_t*)w;
+		executable = (uint8_t*)x;
+		return true;
+	}
+
+	static void FlushCode(uint8_t* p, size_t size) {
+	#ifdef _WIN32
+		FlushInstructionCache(GetCurrentProcess(), p, size);
+	#else
+		__builtin___clear_cache((char*)p, (char*)p + size);
+	#endif
+	}
+};
+
+
+class HookRegistry {
+public:
+	static constexpr int MaxHooks = 128;
+
+	HookRegistry() = default;
+	HookRegistry(const HookRegistry&) = delete;
+	HookRegistry& operator=(const HookRegistry&) = delete;
+
+	// Point vtable[index] to replacement. Returns the original or 0 on failure.
+	// Hooking a slot again only changes the replacement, the original is kept.
+	uintptr_t Patch(uintptr_t* vtable, int index, uintptr_t replacement, void* context = nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Hook* hook = Find(vtable, index);
+		if (!hook) {
+			int n = count.load(std::memory_order_relaxed);
+			if (n == MaxHooks) return 0;
+			hook = &hooks[n];
+			hook->vtable = vtable;
+			hook->index = index;
+			hook->original = vtable[index];
+			hook->context.store(context, std::memory_order_relaxed);
+			count.store(n + 1, std::memory_order_release);
+		}
+		if (!WriteSlot(&vtable[index], replacement)) return 0;
+		hook->context.store(context, std::memory_order_relaxed);
+		hook->active.store(true, std::memory_order_release);
+		return hook->original;
+	}
+
+	// Put the original back
+	bool Unpatch(uintptr_t* vtable, int index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Hook* hook = Find(vtable, index);
+		if (!hook || !hook->active.load(std::memory_order_relaxed)) return false;
+		if (!WriteSlot(&vtable[index], hook->original)) return false;
+		hook->active.store(false, std::memory_order_release);
+		return true;
+	}
+
+	void UnpatchAll() {
+		int n = count.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++)
+			Unpatch(hooks[i].vtable, hooks[i].index);
+	}
+
+	// Any thread. The function the slot had before it was hooked, 0 if it never was.
+	uintptr_t Original(const void* object, int index) const {
+		const Hook* hook = Find(*(uintptr_t* const*)object, index);
+		return hook ? hook->original : 0;
+	}
+
+	// Any thread. Context given to Patch() for any hooked slot of the object's vtable.
+	void* Context(const void* object) const {
+		const uintptr_t* vtable = *(uintptr_t* const*)object;
+		int n = count.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++)
+			if (hooks[i].vtable == vtable)
+				if (void* context = hooks[i].context.load(std::memory_order_relaxed)) return context;
+		return nullptr;
+	}
+
+	bool IsPatched(const uintptr_t* vtable, int index) const {
+		const Hook* hook = Find(vtable, index);
+		return hook && hook->active.load(std::memory_order_acquire);
+	}
+
+private:
+	struct Hook {
+		uintptr_t* vtable{};
+		int index{};
+		uintptr_t original{};
+		std::atomic<void*> context{};
+		std::atomic<bool> active{};
+	};
+
+	std::mutex mutex;			// Patch/Unpatch
+	Hook hooks[MaxHooks];		// only ever appended to, so readers need no lock
+	std::atomic<int> count{ 0 };
+
+	Hook* Find(const uintptr_t* vtable, int index) {
+		return const_cast<Hook*>(static_cast<const HookRegistry*>(this)->Find(vtable, index));
+	}
+
+	const Hook* Find(const uintptr_t* vtable, int index) const {
+		int n = count.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++)
+			if (hooks[i].vtable == vtable && hooks[i].index == index) return &hooks[i];
+		return nullptr;
+	}
+
+	// Vtables live in read-only data, lift the protection for the write only
+	static bool WriteSlot(uintptr_t* slot, uintptr_t value) {
+	#ifdef _WIN32
+		DWORD oldProtect;
+		if (!VirtualProtect(slot, sizeof(uintptr_t), PAGE_READWRITE, &oldProtect)) return false;
+		std::atomic_ref<uintptr_t>(*slot).store(value);
+		VirtualProtect(slot, sizeof(uintptr_t), oldProtect, &oldProtect);
+		return true;
+	#else
+		long pageSize = 4096;
+		auto page = (uintptr_t)slot & ~(uintptr_t)(pageSize - 1);
+		size_t length = ((uintptr_t)slot + sizeof(uintptr_t) > page + pageSize) ? 2 * pageSize : pageSize;
+		if (mprotect((void*)page, length, PROT_READ | PROT_WRITE)) return false;
+		std::atomic_ref<uintptr_t>(*slot).store(value);
+		mprotect((void*)page, length, PROT_READ);
+		return true;
+	#endif
+	}
+};
@@ -0,0 +1,57 @@
+// Import table patching.
+//
+// Lets the plugin see calls the host makes into system DLLs, e.g. the CoCreateInstance
+// that instantiates an ASIO driver. Entries are matched by the address they point to,
+// not by name, so imports forwarded from ole32 to combase are found as well.
+// Windows only.
+
+#pragma once
+#include <windows.h>
+#include <psapi.h>
+#include <vector>
+#include <cstdint>
+#pragma comment(lib, "psapi.lib")
+
+
+// Point every import table entry of the module that refers to target to replacement.
+// Returns the number of entries patched.
+inline int PatchImports(HMODULE module, uintptr_t target, uintptr_t replacement) {
+	auto base = (uint8_t*)module;
+	auto dos = (IMAGE_DOS_HEADER*)base;
+	if (!base || dos->e_magic != IMAGE_DOS_SIGNATURE) return 0;
+	auto nt = (IMAGE_NT_HEADERS*)(base + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE) return 0;
+	auto& dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if (!dir.VirtualAddress || !dir.Size) return 0;
+
+	int count = 0;
+	for (auto desc = (IMAGE_IMPORT_DESCRIPTOR*)(base + dir.VirtualAddress); desc->Name; desc++) {
+		for (auto thunk = (IMAGE_THUNK_DATA*)(base + desc->FirstThunk); thunk->u1.Function; thunk++) {
+			if ((uintptr_t)thunk->u1.Function != target) continue;
+			DWORD oldProtect;
+			if (!VirtualProtect(&thunk->u1.Function, sizeof(uintptr_t), PAGE_READWRITE, &oldProtect)) continue;
+			thunk->u1.Function = replacement;
+			VirtualProtect(&thunk->u1.Function, sizeof(uintptr_t), oldProtect, &oldProtect);
+			count++;
+		}
+	}
+	return count;
+}
+
+
+// Same for every module currently loaded into the process
+inline int PatchImportsEverywhere(uintptr_t target, uintptr_t replacement) {
+	DWORD needed = 0;
+	std::vector<HMODULE> modules(256);
+	while (true) {
+		if (!EnumProcessModules(GetCurrentProcess(), modules.data(), (DWORD)(modules.size() * sizeof(HMODULE)), &needed)) return 0;
+		if (needed <= modules.size() * sizeof(HMODULE)) break;
+		modules.resize(needed / sizeof(HMODULE));
+	}
+	modules.resize(needed / sizeof(HMODULE));
+
+	int count = 0;
+	for (auto module : modules)
+		count += PatchImports(module, target, replacement);
+	return count;
+}
@@ -0,0 +1,95 @@
+// Whether the plugin disturbs the audio engine.
+//
+// When a user hears a dropout while toggling monitoring, the question is whether the
+// plugin caused it. With the jitter monitor on (ASIO_DM_ACTIVATOR_JITTER=on) every buffer
+// switch of the host is timed in the wrapped callbacks: how far its start is off the
+// measured period, how long the host took in it, and whether it finished so late that
+// the next buffer was due already (a deadline miss, heard as a dropout). The plugin's
+// own work, future() calls and USB transfers on any thread, is marked busy, so every
+// switch and every miss is also counted as overlapping plugin work or not. If misses
+// overlap plugin work no more often than switches do, the plugin is not the cause.
+// Everything goes to the lock-free counters and histograms of the StatsBlock.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include "stats.h"
+#include <atomic>
+#include <cstdint>
+
+
+class JitterMonitor {
+public:
+	// Before the stream runs
+	void Enable(bool on) {
+		enabled.store(on, std::memory_order_relaxed);
+	}
+
+	// Any thread
+	bool IsEnabled() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	// Audio thread or before it runs, when buffers are created. The period is measured again.
+	void Start() {
+		previous = 0;
+		period = 0;
+	}
+
+	// Audio thread. The host's buffer switch callback ran from start to end (StatsBlock::Now()).
+	void Switch(StatsBlock& stats, uint64_t start, uint64_t end) {
+		stats.Record(StatsBlock::CallbackDuration, end - start);
+		uint64_t last = previous;
+		previous = start;
+		if (!last || start <= last) return;
+		double interval = (double)(start - last);
+		if (!period) {
+			period = interval;
+			return;
+		}
+		bool busy = BusySince(last);
+		stats.Add(StatsBlock::Callbacks);
+		if (busy) stats.Add(StatsBlock::CallbacksWhileBusy);
+		stats.Record(StatsBlock::CallbackJitter, (uint64_t)(interval > period ? interval - period : period - interval));
+		// It was due a period after the last one and had one more period to fill its buffer
+		if ((double)(end - last) > 2 * period) {
+			stats.Add(StatsBlock::DeadlineMisses);
+			if (busy) stats.Add(StatsBlock::MissesWhileBusy);
+		}
+		// A stall or restart says nothing about the period
+		if (interval < period * 2 && interval > period / 2) period += (interval - period) / 16;
+	}
+
+	// Any thread, marks the plugin busy for its lifetime. Costs nothing while disabled.
+	class Busy {
+	public:
+		explicit Busy(JitterMonitor& monitor) : monitor(monitor.IsEnabled() ? &monitor : nullptr) {
+			if (this->monitor) this->monitor->inFlight.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		~Busy() {
+			if (!monitor) return;
+			monitor->lastBusy.store(StatsBlock::Now(), std::memory_order_relaxed);
+			monitor->inFlight.fetch_sub(1, std::memory_order_release);
+		}
+
+		Busy(const Busy&) = delete;
+		Busy& operator=(const Busy&) = delete;
+
+	private:
+		JitterMonitor* monitor;
+	};
+
+private:
+	std::atomic<bool> enabled{ false };
+	std::atomic<int> inFlight{ 0 };			// plugin work running now
+	std::atomic<uint64_t> lastBusy{ 0 };	// when the last of it ended
+
+	// Audio thread only
+	uint64_t previous{};	// start of the last switch
+	double period{};
+
+	// Plugin work ran at some point since the given time
+	bool BusySince(uint64_t since) const {
+		return inFlight.load(std::memory_order_acquire) > 0 || lastBusy.load(std::memory_order_relaxed) >= since;
+	}
+};
@@ -0,0 +1,399 @@
+// Logging that stays out of the way of the host.
+//
+// Formatting a message and handing it to OutputDebugString takes a while, and with a
+// debugger or DebugView attached every call is serialized. Instead, a call site copies
+// the format string pointer and the raw arguments into a fixed-size record in a ring
+// buffer of its own thread: no locks, no allocation. A background thread collects the
+// records of all threads, formats them and passes the text to the sinks. Messages
+// below the current level cost one atomic load. String arguments that don't fit into
+// the record continue in the records after it, up to MaxSpill of them.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <format>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <type_traits>
+#include <cstdint>
+
+
+enum class LogLevel : uint8_t {
+	Trace,		// every future() call, off by default
+	Debug,
+	Info,
+	Error,
+	Off
+};
+
+
+// A formatted message, as the sinks get it
+struct LogLine {
+	LogLevel level{};
+	int line{};				// source line of the call site
+	uint32_t thread{};
+	std::chrono::steady_clock::time_point time;
+	std::wstring text;
+};
+
+
+class Logger {
+public:
+	static constexpr int MaxArgs = 8;
+	static constexpr int TextSize = 160;	// room for the string arguments in one record
+	static constexpr int MaxSpill = 7;		// records a message's text may continue in, longer text is cut
+	static constexpr size_t RingSize = 64;	// records per thread
+
+	using Sink = std::function<void(const LogLine&)>;
+	using Clock = std::chrono::steady_clock;
+
+	Logger(LogLevel level = LogLevel::Debug) : level(level) {}
+
+	~Logger() {
+		Stop();
+	}
+
+	Logger(const Logger&) = delete;
+	Logger& operator=(const Logger&) = delete;
+
+	void SetLevel(LogLevel value) {
+		level.store(value, std::memory_order_relaxed);
+	}
+
+	LogLevel GetLevel() const {
+		return level.load(std::memory_order_relaxed);
+	}
+
+	bool Enabled(LogLevel value) const {
+		return value >= level.load(std::memory_order_relaxed);
+	}
+
+	// Sinks are set up before Start()
+	void AddSink(Sink sink) {
+		std::lock_guard<std::mutex> lock(drainMutex);
+		sinks.push_back(std::move(sink));
+	}
+
+	// Messages written before the thread starts are kept until the ring of their thread is full
+	void Start(std::chrono::milliseconds period = std::chrono::milliseconds(25)) {
+		std::lock_guard<std::mutex> lock(threadMutex);
+		if (thread.joinable()) return;
+		running = true;
+		thread = std::thread([this, period] {
+			std::unique_lock<std::mutex> lock(threadMutex);
+			while (running) {
+				lock.unlock();
+				Flush();
+				lock.lock();
+				condition.wait_for(lock, period, [this] { return !running; });
+			}
+		});
+	}
+
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(threadMutex);
+			running = false;
+		}
+		condition.notify_one();
+		if (thread.joinable()) thread.join();
+		Flush();
+	}
+
+	// Any thread, never blocks. Format is a string literal, std::format syntax.
+	template <typename... Args>
+	void Write(LogLevel messageLevel, int line, const wchar_t* format, const Args&... args) {
+		static_assert(sizeof...(Args) <= MaxArgs, "Too many log arguments");
+		Ring& ring = ThreadRing();
+		size_t textLength = (TextLength(args) + ... + 0);
+		size_t slots = 1 + std::min<size_t>(MaxSpill, textLength ? (textLength - 1) / TextSize : 0);
+		size_t head = ring.head.load(std::memory_order_relaxed);
+		if (head + slots - ring.tail.load(std::memory_order_acquire) > RingSize) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		Record& r = ring.records[head % RingSize];
+		r.time = Clock::now();
+		r.format = format;
+		r.line = line;
+		r.level = messageLevel;
+		r.argc = 0;
+		r.spill = (uint8_t)(slots - 1);
+		r.textUsed = 0;
+		(Capture(ring, head, r, args), ...);
+		ring.head.store(head + slots, std::memory_order_release);
+	}
+
+	// Format and deliver everything written so far. Called by the logger thread,
+	// or directly when there is none (tests, shutdown).
+	void Flush() {
+		std::lock_guard<std::mutex> lock(drainMutex);
+		batch.clear();
+		{
+			std::lock_guard<std::mutex> ringsLock(ringsMutex);
+			for (auto& ring : rings) {
+				size_t tail = ring->tail.load(std::memory_order_relaxed);
+				size_t head = ring->head.load(std::memory_order_acquire);
+				while (tail != head) {
+					const Record& record = ring->records[tail % RingSize];
+					Item item{ record, ring->thread, {} };
+					for (int i = 0; i <= record.spill; i++) {
+						const Record& part = ring->records[(tail + i) % RingSize];
+						item.text.append(part.text, std::min<size_t>(TextSize, record.textUsed - i * TextSize));
+					}
+					tail += 1 + record.spill;
+					batch.push_back(std::move(item));
+				}
+				ring->tail.store(tail, std::memory_order_release);
+			}
+		}
+		std::stable_sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) { return a.record.time < b.record.time; });
+
+		if (uint64_t count = dropped.exchange(0, std::memory_order_relaxed))
+			Deliver({ LogLevel::Error, __LINE__, 0, Clock::now(), std::format(L"{} log messages dropped", count) });
+		for (const auto& item : batch) {
+			LogLine line{ item.record.level, item.record.line, item.thread, item.record.time, Format(item.record, item.text) };
+			Deliver(line);
+		}
+	}
+
+	// Level from its name, as in an environment variable
+	static std::optional<LogLevel> ParseLevel(std::wstring_view name) {
+		const std::wstring_view names[] = { L"trace", L"debug", L"info", L"error", L"off" };
+		for (int i = 0; i < 5; i++)
+			if (name == names[i]) return (LogLevel)i;
+		return std::nullopt;
+	}
+
+	// Appends to a file, UTF-8
+	static Sink FileSink(const std::filesystem::path& path) {
+		auto out = std::make_shared<std::ofstream>(path, std::ios::app | std::ios::binary);
+		return [out](const LogLine& line) {
+			*out << ToUtf8(std::format(L"{:>10} {:>6} {}  :{}\n",
+				std::chrono::duration_cast<std::chrono::microseconds>(line.time.time_since_epoch()).count(), line.thread, line.text, line.line));
+			out->flush();
+		};
+	}
+
+	static Sink StderrSink() {
+		return [](const LogLine& line) {
+			std::cerr << ToUtf8(std::format(L"[{}] {} :{}\n", line.thread, line.text, line.line));
+		};
+	}
+
+	static std::string ToUtf8(std::wstring_view text) {
+		std::string result;
+		result.reserve(text.size());
+		for (size_t i = 0; i < text.size(); i++) {
+			uint32_t c = (uint32_t)text[i];
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size())	// UTF-16 surrogate pair
+				c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)text[++i] - 0xDC00);
+			if (c < 0x80) result += (char)c;
+			else if (c < 0x800) { result += (char)(0xC0 | (c >> 6)); result += (char)(0x80 | (c & 0x3F)); }
+			else if (c < 0x10000) { result += (char)(0xE0 | (c >> 12)); result += (char)(0x80 | ((c >> 6) & 0x3F)); result += (char)(0x80 | (c & 0x3F)); }
+			else { result += (char)(0xF0 | (c >> 18)); result += (char)(0x80 | ((c >> 12) & 0x3F)); result += (char)(0x80 | ((c >> 6) & 0x3F)); result += (char)(0x80 | (c & 0x3F)); }
+		}
+		return result;
+	}
+
+private:
+	struct Arg {
+		enum class Type : uint8_t { Signed, Unsigned, Float, Bool, Text } type{};
+		union {
+			int64_t i;
+			uint64_t u;
+			double f;
+			bool b;
+			struct { uint16_t offset, length; } text;
+		};
+	};
+
+	struct Record {
+		Clock::time_point time;
+		const wchar_t* format{};
+		int line{};
+		LogLevel level{};
+		uint8_t argc{};
+		uint8_t spill{};		// records after this one that hold the rest of its text
+		uint16_t textUsed{};	// in this record and the spill records
+		Arg args[MaxArgs];
+		wchar_t text[TextSize];	// all that is used of a spill record
+	};
+
+	// Written by its own thread only, read by the logger thread
+	struct Ring {
+		alignas(64) std::atomic<size_t> head{ 0 };
+		alignas(64) std::atomic<size_t> tail{ 0 };
+		uint32_t thread{};
+		std::thread::id owner;
+		Record records[RingSize];
+	};
+
+	struct Item {
+		Record record;
+		uint32_t thread;
+		std::wstring text;	// of the record and its spill records
+	};
+
+	std::atomic<LogLevel> level;
+	std::atomic<uint64_t> dropped{ 0 };
+	const uint64_t id = NextId();	// a logger may reuse the address of one that is gone
+
+	std::mutex ringsMutex;	// only taken when a thread logs for the first time, and by the logger thread
+	std::vector<std::unique_ptr<Ring>> rings;
+
+	std::mutex drainMutex;
+	std::vector<Sink> sinks;	// guarded by drainMutex
+	std::vector<Item> batch;	// guarded by drainMutex
+
+	std::mutex threadMutex;
+	std::condition_variable condition;
+	bool running{};	// guarded by threadMutex
+	std::thread thread;
+
+	static uint64_t NextId() {
+		static std::atomic<uint64_t> next{ 0 };
+		return ++next;
+	}
+
+	// Rings live as long as the logger, a thread that exits leaves an empty ring behind.
+	// The ring of the logger a thread used last is at hand, others are looked up.
+	Ring& ThreadRing() {
+		thread_local Ring* ring = nullptr;
+		thread_local uint64_t owner = 0;
+		if (ring && owner == id) return *ring;
+		auto self = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		auto found = std::find_if(rings.begin(), rings.end(), [&](const auto& r) { return r->owner == self; });
+		if (found != rings.end()) ring = found->get();
+		else {
+			auto created = std::make_unique<Ring>();
+			created->thread = (uint32_t)std::hash<std::thread::id>{}(self);
+			created->owner = self;
+			ring = created.get();
+			rings.push_back(std::move(created));
+		}
+		owner = id;
+		return *ring;
+	}
+
+	template <typename T>
+	static constexpr bool IsText = !std::is_arithmetic_v<T> && !std::is_enum_v<T> &&
+		!(std::is_pointer_v<T> && !std::is_convertible_v<T, const wchar_t*>);
+
+	template <typename T>
+	static size_t TextLength(const T& value) {
+		if constexpr (IsText<T>) return std::wstring_view(value).size();
+		else return 0;
+	}
+
+	// Record r is at head of the ring, its text continues in the records after it
+	template <typename T>
+	static void Capture(Ring& ring, size_t head, Record& r, const T& value) {
+		Arg& a = r.args[r.argc++];
+		if constexpr (std::is_same_v<T, bool>) {
+			a.type = Arg::Type::Bool;
+			a.b = value;
+		}
+		else if constexpr (std::is_enum_v<T>) {
+			a.type = Arg::Type::Signed;
+			a.i = (int64_t)value;
+		}
+		else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+			a.type = Arg::Type::Signed;
+			a.i = value;
+		}
+		else if constexpr (std::is_integral_v<T>) {
+			a.type = Arg::Type::Unsigned;
+			a.u = value;
+		}
+		else if constexpr (std::is_floating_point_v<T>) {
+			a.type = Arg::Type::Float;
+			a.f = value;
+		}
+		else if constexpr (std::is_pointer_v<T> && !std::is_convertible_v<T, const wchar_t*>) {
+			a.type = Arg::Type::Unsigned;
+			a.u = (uint64_t)(uintptr_t)value;
+		}
+		else {
+			std::wstring_view text(value);
+			size_t length = std::min<size_t>(text.size(), (size_t)TextSize * (r.spill + 1) - r.textUsed);
+			for (size_t done = 0; done < length;) {
+				size_t at = r.textUsed + done;
+				size_t part = std::min<size_t>(length - done, TextSize - at % TextSize);
+				std::copy_n(text.data() + done, part, ring.records[(head + at / TextSize) % RingSize].text + at % TextSize);
+				done += part;
+			}
+			a.type = Arg::Type::Text;
+			a.text = { r.textUsed, (uint16_t)length };
+			r.textUsed += (uint16_t)length;
+		}
+	}
+
+	// Replacement fields are formatted one by one, each with its own format spec
+	static std::wstring Format(const Record& r, std::wstring_view text) {
+		std::wstring result;
+		std::wstring_view format(r.format);
+		int next = 0;
+		for (size_t i = 0; i < format.size(); i++) {
+			wchar_t c = format[i];
+			if ((c == L'{' || c == L'}') && i + 1 < format.size() && format[i + 1] == c) {
+				result += c;
+				i++;
+				continue;
+			}
+			if (c != L'{') {
+				result += c;
+				continue;
+			}
+			size_t end = format.find(L'}', i);
+			if (end == std::wstring_view::npos) break;
+			std::wstring field(format.substr(i, end - i + 1));
+			if (auto colon = field.find(L':'); colon != std::wstring::npos)
+				field = L"{" + field.substr(colon);
+			else
+				field = L"{}";
+			if (next < r.argc) {
+				try {
+					result += FormatArg(field, text, r.args[next]);
+				}
+				catch (const std::exception&) {
+					result += L"?";
+				}
+			}
+			next++;
+			i = end;
+		}
+		return result;
+	}
+
+	static std::wstring FormatArg(const std::wstring& field, std::wstring_view text, const Arg& a) {
+		switch (a.type) {
+			case Arg::Type::Signed: return std::vformat(field, std::make_wformat_args(a.i));
+			case Arg::Type::Unsigned: return std::vformat(field, std::make_wformat_args(a.u));
+			case Arg::Type::Float: return std::vformat(field, std::make_wformat_args(a.f));
+			case Arg::Type::Bool: return std::vformat(field, std::make_wformat_args(a.b));
+			default: {
+				std::wstring_view part = text.substr(a.text.offset, a.text.length);
+				return std::vformat(field, std::make_wformat_args(part));
+			}
+		}
+	}
+
+	void Deliver(const LogLine& line) {
+		for (auto& sink : sinks)
+			sink(line);
+	}
+};
@@ -0,0 +1,94 @@
+// Shadow copy of the hardware mixer crosspoints.
+//
+// Knowing what the device currently has lets a toggle go straight to the write,
+// without reading the crosspoint back first. The copy is kept in sync by reading
+// the whole mixer in the background at a low rate, which also picks up changes
+// made in the vendor's mixer application.
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+
+// Stereo crosspoint level in device units (Thesycon: 1/256 dB, -32768 = -inf)
+struct VolPair {
+	short L{ 0 };
+	short R{ 0 };
+	bool operator==(const VolPair& x) const { return L == x.L && R == x.R; }
+	bool operator!=(const VolPair& x) const { return !(*this == x); }
+
+	uint32_t Pack() const { return (uint16_t)L | ((uint32_t)(uint16_t)R << 16); }
+	static VolPair Unpack(uint32_t x) { return { (short)(uint16_t)x, (short)(uint16_t)(x >> 16) }; }
+};
+
+
+// One entry per input of the Main mix. Entries are written by the worker thread
+// and may be read from any thread.
+class ShadowMixer {
+public:
+	static constexpr int MaxChannels = 64;
+	static inline const VolPair MinusInf = { -32768, -32768 };
+
+	struct alignas(64) Channel {
+		std::atomic<uint32_t> current{ 0 };	// what the device has now
+		std::atomic<uint32_t> saved{ 0 };	// last level that was not muted, restored when monitoring goes on
+		std::atomic<bool> valid{ false };	// current was read from (or written to) the device
+	};
+
+	bool Contains(int channel) const {
+		return channel >= 0 && channel < MaxChannels;
+	}
+
+	bool IsValid(int channel) const {
+		return Contains(channel) && channels[channel].valid.load(std::memory_order_acquire);
+	}
+
+	VolPair Current(int channel) const {
+		return VolPair::Unpack(channels[channel].current.load(std::memory_order_relaxed));
+	}
+
+	VolPair Saved(int channel) const {
+		return VolPair::Unpack(channels[channel].saved.load(std::memory_order_relaxed));
+	}
+
+	// Record the level the device has. Returns true if it differs from the shadow copy.
+	bool Update(int channel, VolPair vol) {
+		if (!Contains(channel)) return false;
+		Channel& c = channels[channel];
+		bool changed = !c.valid.load(std::memory_order_relaxed) || VolPair::Unpack(c.current.load(std::memory_order_relaxed)) != vol;
+		c.current.store(vol.Pack(), std::memory_order_relaxed);
+		if (vol != MinusInf) c.saved.store(vol.Pack(), std::memory_order_relaxed);
+		c.valid.store(true, std::memory_order_release);
+		return changed;
+	}
+
+	// Level to restore, known from elsewhere (a previous session). What the device has
+	// now stays unknown.
+	void SetSaved(int channel, VolPair vol) {
+		if (Contains(channel) && vol != MinusInf) channels[channel].saved.store(vol.Pack(), std::memory_order_relaxed);
+	}
+
+	// Forget what the device has, e.g. after it was reconnected. Saved levels are kept.
+	void Invalidate() {
+		for (auto& c : channels)
+			c.valid.store(false, std::memory_order_release);
+	}
+
+	// Forget what the device has on one channel, e.g. after a write that failed halfway
+	void Invalidate(int channel) {
+		if (Contains(channel)) channels[channel].valid.store(false, std::memory_order_release);
+	}
+
+	// Number of channels the device is known to have, 0 = not probed yet
+	int Size() const {
+		return size.load(std::memory_order_relaxed);
+	}
+
+	void SetSize(int count) {
+		size.store(count < MaxChannels ? count : MaxChannels, std::memory_order_relaxed);
+	}
+
+private:
+	Channel channels[MaxChannels];
+	std::atomic<int> size{ 0 };
+};
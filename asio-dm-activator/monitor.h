@@ -0,0 +1,173 @@
+// Direct monitoring commands, from the host's future() call to the levels on the device.
+//
+// What doesn't depend on the driver classes lives here, so the plugin and the programs
+// in bench/ run the same code: what future() answers for the selectors the plugin
+// handles, how a burst of commands is merged per input, which level a command gives
+// its input, and how a level gets into the two crosspoints of the Main mix through the
+// TUSBAUDIO API. The plugin's devices add the session, retries, the gain engine and the
+// statistics around it; the benchmarks point the API at a stub.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include "mixer.h"
+#include "devices.h"
+#include "gain.h"
+#include <span>
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+const int ASE_OK = 0;
+const int ASE_SUCCESS = 0x3f4847a0;
+const int ASE_NotPresent = -1000;
+const int ASE_HWMalfunction = -999;
+const int ASE_InvalidParameter = -998;
+const int ASE_NoMemory = -994;
+const int kAsioSetInputMonitor = 3;
+const int kAsioCanInputMonitor = 9;
+
+struct ASIOInputMonitor {
+	long input;		// input index (-1 = all)
+	long output;	// output index
+	long gain;		// gain 0..0x7fffffffL (-inf to +12 dB)
+	long state;		// on/off
+	long pan;		// pan, 0..0x7fffffff (left..right)
+};
+
+// A command on its way to the device, with the time the host issued it and, while the
+// stream runs, the buffer boundary it is aimed at
+struct MonitorCommand : ASIOInputMonitor {
+	uint64_t issued{};	// StatsBlock::Now()
+	int64_t sample{};	// stream position when issued
+	uint64_t due{};		// buffer boundary to be heard from, StatsBlock::Now() time, 0 = none
+	std::chrono::steady_clock::time_point deadline{};	// the worker starts writing it by then
+};
+
+
+// TUSBAUDIO API, the same for every Thesycon-based driver
+namespace tusbaudio {
+	using EnumerateDevices = long(*)();
+	using GetDeviceCount = long(*)();
+	using OpenDeviceByIndex = long(*)(long deviceIndex, long* deviceHandle);
+	using CloseDevice = long(*)(long deviceHandle);
+	using RegisterPnpNotification = long(*)(void* deviceArrivalEvent, void* deviceRemovedEvent,
+		void* windowHandle, unsigned int windowMsgCode, unsigned int flags);
+	using AudioControlRequestGet = long(*)(long deviceHandle, long entityID, long request,
+		long controlSelector, char channelOrMixerControl, void* paramBlock, long paramBlockLength,
+		long* bytesTransferred, long timeoutMillisecs);
+	using AudioControlRequestSet = AudioControlRequestGet;
+	using GetDeviceProperties = long(*)(long deviceHandle, void* properties);
+
+	// Entry points, resolved once when the API dll is loaded
+	struct Api {
+		EnumerateDevices enumerateDevices{};
+		GetDeviceCount getDeviceCount{};
+		OpenDeviceByIndex openDeviceByIndex{};
+		CloseDevice closeDevice{};
+		RegisterPnpNotification registerPnpNotification{};
+		AudioControlRequestGet audioControlRequestGet{};
+		AudioControlRequestSet audioControlRequestSet{};
+		GetDeviceProperties getDeviceProperties{};
+
+	#ifdef _WIN32
+		// False if any of the functions every device needs is missing
+		bool Resolve(HMODULE dll) {
+			enumerateDevices = (EnumerateDevices)GetProcAddress(dll, "TUSBAUDIO_EnumerateDevices");
+			getDeviceCount = (GetDeviceCount)GetProcAddress(dll, "TUSBAUDIO_GetDeviceCount");
+			openDeviceByIndex = (OpenDeviceByIndex)GetProcAddress(dll, "TUSBAUDIO_OpenDeviceByIndex");
+			closeDevice = (CloseDevice)GetProcAddress(dll, "TUSBAUDIO_CloseDevice");
+			registerPnpNotification = (RegisterPnpNotification)GetProcAddress(dll, "TUSBAUDIO_RegisterPnpNotification");
+			audioControlRequestGet = (AudioControlRequestGet)GetProcAddress(dll, "TUSBAUDIO_AudioControlRequestGet");
+			audioControlRequestSet = (AudioControlRequestSet)GetProcAddress(dll, "TUSBAUDIO_AudioControlRequestSet");
+			getDeviceProperties = (GetDeviceProperties)GetProcAddress(dll, "TUSBAUDIO_GetDeviceProperties");
+			return enumerateDevices && getDeviceCount && openDeviceByIndex && audioControlRequestGet && audioControlRequestSet && getDeviceProperties;
+		}
+	#endif
+	};
+}
+
+
+namespace monitor {
+
+	// future() for the selectors the plugin handles: it can monitor, and a command goes
+	// to queue(ASIOInputMonitor*). Nothing for the others, they belong to the driver.
+	template <typename Queue>
+	std::optional<long> Future(long selector, void* params, Queue&& queue) {
+		if (selector == kAsioCanInputMonitor) return ASE_SUCCESS;
+		if (selector == kAsioSetInputMonitor) return queue((ASIOInputMonitor*)params);
+		return std::nullopt;
+	}
+
+	// Merge a burst of commands: input = -1 is expanded to every input, and only the latest
+	// request for each input survives. The result is ordered by input index, inputs the
+	// driver doesn't have are dropped.
+	template <typename Command>
+	std::vector<Command> Coalesce(std::span<const Command> batch, long inputs) {
+		std::vector<std::optional<Command>> latest(std::max(inputs, 0L));
+		for (const auto& command : batch) {
+			if (command.input < 0) {
+				for (long i = 0; i < (long)latest.size(); i++) {
+					latest[i] = command;
+					latest[i]->input = i;
+				}
+				continue;
+			}
+			if (command.input < (long)latest.size())
+				latest[command.input] = command;
+		}
+
+		std::vector<Command> result;
+		for (const auto& command : latest)
+			if (command) result.push_back(*command);
+		return result;
+	}
+
+	// Index of the L crosspoint of an input in the Main mix, R is the next one
+	inline int Crosspoint(const DeviceProfile& profile, int channel) {
+		return channel * profile.Stride(); // L+R of every mix
+	}
+
+	// Both crosspoints of the input have a byte index
+	inline bool IsAddressable(const DeviceProfile& profile, int channel) {
+		return channel >= 0 && Crosspoint(profile, channel) + 1 <= 255;
+	}
+
+	// The level a command gives its input. Following the host, that is its gain and pan;
+	// otherwise monitoring is switched, and on is the level the device mixer had.
+	inline VolPair Target(const ASIOInputMonitor& command, const ShadowMixer& shadow, int channel, bool follow) {
+		if (command.state && follow) return GainLaw::ToDevice(command.gain, command.pan);
+		if (command.state && command.gain > 100) return shadow.Saved(channel);
+		return ShadowMixer::MinusInf;
+	}
+
+	// One 2-byte request for a crosspoint of the mixer unit, 0 on success
+	inline long ControlRequest(const tusbaudio::Api& api, long handle, const DeviceProfile& profile, bool set,
+		uint8_t crosspoint, short* value, long timeoutMillisecs) {
+		auto func = set ? api.audioControlRequestSet : api.audioControlRequestGet;
+		if (!func) return -1;
+		return func(handle, profile.mixerEntity, 0x1, 0x1, (char)crosspoint, value, 2, nullptr, timeoutMillisecs);
+	}
+
+	// Both halves of a level, through transfer(set, crosspoint, short*), which returns 0
+	// on success. R isn't sent once L failed.
+	template <typename Transfer>
+	long SetVol(Transfer&& transfer, const DeviceProfile& profile, int channel, VolPair vol) {
+		uint8_t crosspoint = (uint8_t)Crosspoint(profile, channel);
+		long result = transfer(true, crosspoint, &vol.L);
+		if (!result) result = transfer(true, (uint8_t)(crosspoint + 1), &vol.R);
+		return result;
+	}
+
+	template <typename Transfer>
+	long GetVol(Transfer&& transfer, const DeviceProfile& profile, int channel, VolPair& vol) {
+		uint8_t crosspoint = (uint8_t)Crosspoint(profile, channel);
+		long result = transfer(false, crosspoint, &vol.L);
+		if (!result) result = transfer(false, (uint8_t)(crosspoint + 1), &vol.R);
+		return result;
+	}
+}
@@ -9,6 +9,7 @@
 #define PCH_H
 
 // add headers that you want to pre-compile here
+#define NOMINMAX
 #include <windows.h> 
 #include <thread>
 #include <shlwapi.h>
@@ -29,5 +30,6 @@
 #include <typeindex>
 #include <optional>
 #include <functional>
+#include <shared_mutex>
 
 #endif //PCH_H
@@ -0,0 +1,269 @@
+// Static analysis of driver dlls.
+//
+// Finding future() by instantiating the driver runs its constructor, which is slow and
+// may talk to the hardware. The IASIO vtable can be found in the file instead: MSVC
+// puts a pointer to the RTTI complete object locator right before every vtable, and
+// the locator leads to the class and all of its base classes by name. A vtable whose
+// class derives from IASIO, and whose slots carry base relocations and point into
+// code, is what the driver's objects use. Only 64-bit images built with RTTI are
+// understood; for anything else the driver is instantiated as before.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <unordered_set>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <cstdint>
+
+
+class PeImage {
+public:
+	// The whole file is read, sections are not laid out, reads translate RVAs instead
+	static std::optional<PeImage> Load(const std::filesystem::path& path) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) return std::nullopt;
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		return Parse(std::move(data));
+	}
+
+	static std::optional<PeImage> Parse(std::vector<uint8_t> data) {
+		PeImage image;
+		image.data = std::move(data);
+		if (!image.ParseHeaders()) return std::nullopt;
+		return image;
+	}
+
+	// FNV-1a of the file, identifies it wherever it is installed
+	uint64_t Hash() const {
+		uint64_t hash = 0xcbf29ce484222325;
+		for (uint8_t b : data) hash = (hash ^ b) * 0x100000001b3;
+		return hash;
+	}
+
+	uint64_t ImageBase() const {
+		return imageBase;
+	}
+
+	// RVA of the vtable the objects implementing the interface (e.g. "IASIO") use, if
+	// exactly one class qualifies. Classes that others derive from don't count, objects
+	// are of the most derived class. The vtable must have at least minSlots methods.
+	std::optional<uint32_t> FindInterfaceVtable(std::string_view name, int minSlots) const {
+		struct Candidate {
+			uint32_t vtable;
+			uint32_t type;					// TypeDescriptor of the class
+			std::vector<uint32_t> bases;	// TypeDescriptors of its base classes
+		};
+		std::vector<Candidate> candidates;
+		for (uint32_t slot : relocations) {
+			if (IsExecutable(slot)) continue;
+			// Pointer to a locator, then the vtable
+			auto target = Pointer(slot);
+			if (!target || IsExecutable(*target)) continue;
+			auto col = Read<CompleteObjectLocator>(*target);
+			if (!col || col->signature != 1 || col->self != *target) continue;
+			auto offset = InterfaceOffset(col->classDescriptor, name);
+			if (!offset || *offset != col->offset) continue;
+			if (CountMethods(slot + 8) < minSlots) continue;
+			candidates.push_back({ slot + 8, col->typeDescriptor, Bases(col->classDescriptor) });
+		}
+		std::erase_if(candidates, [&](const Candidate& c) {
+			return std::any_of(candidates.begin(), candidates.end(), [&](const Candidate& other) {
+				return other.type != c.type && std::find(other.bases.begin(), other.bases.end(), c.type) != other.bases.end();
+			});
+		});
+		if (candidates.size() != 1) return std::nullopt;
+		return candidates.front().vtable;
+	}
+
+	// Value of a pointer in the image as an RVA, if it points into the image
+	std::optional<uint32_t> Pointer(uint32_t rva) const {
+		auto value = Read<uint64_t>(rva);
+		if (!value || *value < imageBase || *value - imageBase >= sizeOfImage) return std::nullopt;
+		return (uint32_t)(*value - imageBase);
+	}
+
+	bool IsExecutable(uint32_t rva) const {
+		auto s = SectionOf(rva);
+		return s && s->executable;
+	}
+
+	bool IsRelocated(uint32_t rva) const {
+		return relocations.contains(rva);
+	}
+
+	template <typename T>
+	std::optional<T> Read(uint32_t rva) const {
+		auto s = SectionOf(rva);
+		if (!s || rva - s->rva + sizeof(T) > s->fileSize) return std::nullopt;
+		T value;
+		memcpy(&value, &data[s->fileOffset + (rva - s->rva)], sizeof(T));
+		return value;
+	}
+
+private:
+	struct Section {
+		uint32_t rva, size;
+		uint32_t fileOffset, fileSize;
+		bool executable;
+	};
+
+	// MSVC RTTI of 64-bit images, all pointers are RVAs
+	struct CompleteObjectLocator {
+		uint32_t signature;			// 1 for 64-bit images
+		uint32_t offset;			// of the vtable's subobject in the complete object
+		uint32_t constructorOffset;
+		uint32_t typeDescriptor;
+		uint32_t classDescriptor;
+		uint32_t self;
+	};
+
+	struct ClassHierarchyDescriptor {
+		uint32_t signature;
+		uint32_t attributes;
+		uint32_t baseCount;			// including the class itself, first
+		uint32_t baseArray;
+	};
+
+	struct BaseClassDescriptor {
+		uint32_t typeDescriptor;
+		uint32_t containedBases;
+		int32_t mdisp, pdisp, vdisp;	// where the base is: mdisp, if pdisp is -1
+		uint32_t attributes;
+	};
+
+	static constexpr uint32_t TypeNameOffset = 16;	// in a TypeDescriptor, after the vtable and spare pointers
+	static constexpr uint32_t MaxBases = 1024;
+
+	std::vector<uint8_t> data;
+	uint64_t imageBase{};
+	uint32_t sizeOfImage{};
+	std::vector<Section> sections;
+	std::unordered_set<uint32_t> relocations;	// RVAs of 64-bit pointers that get rebased
+
+	template <typename T>
+	std::optional<T> At(size_t offset) const {
+		if (offset + sizeof(T) > data.size()) return std::nullopt;
+		T value;
+		memcpy(&value, &data[offset], sizeof(T));
+		return value;
+	}
+
+	bool ParseHeaders() {
+		auto mz = At<uint16_t>(0);
+		auto lfanew = At<uint32_t>(0x3c);
+		if (!mz || *mz != 0x5a4d || !lfanew) return false;
+		size_t nt = *lfanew;
+		auto signature = At<uint32_t>(nt);
+		auto sectionCount = At<uint16_t>(nt + 6);
+		auto optionalSize = At<uint16_t>(nt + 20);
+		size_t optional = nt + 24;
+		auto magic = At<uint16_t>(optional);
+		if (!signature || *signature != 0x4550 || !sectionCount || !optionalSize || !magic || *magic != 0x20b)
+			return false;	// not PE32+
+		auto base = At<uint64_t>(optional + 24);
+		auto imageSize = At<uint32_t>(optional + 56);
+		auto directories = At<uint32_t>(optional + 108);
+		if (!base || !imageSize || !directories) return false;
+		imageBase = *base;
+		sizeOfImage = *imageSize;
+
+		size_t table = optional + *optionalSize;
+		for (int i = 0; i < *sectionCount; i++) {
+			size_t h = table + i * 40;
+			auto virtualSize = At<uint32_t>(h + 8), rva = At<uint32_t>(h + 12), rawSize = At<uint32_t>(h + 16);
+			auto rawOffset = At<uint32_t>(h + 20), characteristics = At<uint32_t>(h + 36);
+			if (!virtualSize || !rva || !rawSize || !rawOffset || !characteristics) return false;
+			uint32_t fileSize = std::min(*rawSize, *virtualSize);
+			if (*rawOffset > data.size()) fileSize = 0;
+			else fileSize = (uint32_t)std::min<size_t>(fileSize, data.size() - *rawOffset);
+			sections.push_back({ *rva, std::max(*virtualSize, *rawSize), *rawOffset, fileSize, (*characteristics & 0x20000000) != 0 });
+		}
+
+		// Base relocations, directory 5
+		if (*directories > 5) {
+			auto relocRva = At<uint32_t>(optional + 112 + 5 * 8), relocSize = At<uint32_t>(optional + 112 + 5 * 8 + 4);
+			if (relocRva && relocSize) {
+				// In 64 bits, so that no size in a damaged file can wrap the walk around
+				uint64_t end = (uint64_t)*relocRva + *relocSize;
+				for (uint64_t block = *relocRva; block + 8 <= end;) {
+					auto page = Read<uint32_t>((uint32_t)block), size = Read<uint32_t>((uint32_t)block + 4);
+					if (!page || !size || *size < 8 || *size > end - block) break;
+					for (uint32_t e = 8; e + 2 <= *size; e += 2) {
+						auto entry = Read<uint16_t>((uint32_t)block + e);
+						if (!entry) break;
+						if ((*entry >> 12) == 10)	// IMAGE_REL_BASED_DIR64
+							relocations.insert(*page + (*entry & 0xfff));
+					}
+					block += ((uint64_t)*size + 3) & ~3ull;
+				}
+			}
+		}
+		return true;
+	}
+
+	const Section* SectionOf(uint32_t rva) const {
+		for (const auto& s : sections)
+			if (rva >= s.rva && rva - s.rva < s.size) return &s;
+		return nullptr;
+	}
+
+	// Mangled name of a TypeDescriptor, e.g. ".?AUIASIO@@"
+	std::string_view TypeName(uint32_t typeDescriptor) const {
+		auto s = SectionOf(typeDescriptor + TypeNameOffset);
+		if (!s) return {};
+		uint32_t start = typeDescriptor + TypeNameOffset - s->rva;
+		if (start >= s->fileSize) return {};
+		auto begin = (const char*)&data[s->fileOffset + start];
+		return std::string_view(begin, strnlen(begin, s->fileSize - start));
+	}
+
+	static bool IsInterfaceName(std::string_view mangled, std::string_view name) {
+		// struct (U) or class (V) at namespace scope
+		return mangled.size() == name.size() + 6 && mangled.starts_with(".?A") && (mangled[3] == 'U' || mangled[3] == 'V')
+			&& mangled.substr(4, name.size()) == name && mangled.ends_with("@@");
+	}
+
+	std::vector<uint32_t> BaseDescriptors(uint32_t classDescriptor) const {
+		std::vector<uint32_t> result;
+		auto chd = Read<ClassHierarchyDescriptor>(classDescriptor);
+		if (!chd || chd->baseCount > MaxBases) return result;
+		for (uint32_t i = 0; i < chd->baseCount; i++)
+			if (auto bcd = Read<uint32_t>(chd->baseArray + i * 4)) result.push_back(*bcd);
+		return result;
+	}
+
+	// TypeDescriptors of the base classes, without the class itself
+	std::vector<uint32_t> Bases(uint32_t classDescriptor) const {
+		std::vector<uint32_t> result;
+		auto descriptors = BaseDescriptors(classDescriptor);
+		for (size_t i = 1; i < descriptors.size(); i++)
+			if (auto bcd = Read<BaseClassDescriptor>(descriptors[i])) result.push_back(bcd->typeDescriptor);
+		return result;
+	}
+
+	// Where the interface is in objects of the class, if it's a non-virtual base
+	std::optional<uint32_t> InterfaceOffset(uint32_t classDescriptor, std::string_view name) const {
+		for (uint32_t descriptor : BaseDescriptors(classDescriptor)) {
+			auto bcd = Read<BaseClassDescriptor>(descriptor);
+			if (bcd && bcd->pdisp == -1 && IsInterfaceName(TypeName(bcd->typeDescriptor), name))
+				return (uint32_t)bcd->mdisp;
+		}
+		return std::nullopt;
+	}
+
+	// Consecutive rebased pointers into code
+	int CountMethods(uint32_t vtable) const {
+		int count = 0;
+		for (uint32_t slot = vtable; IsRelocated(slot); slot += 8, count++) {
+			auto target = Pointer(slot);
+			if (!target || !IsExecutable(*target)) break;
+		}
+		return count;
+	}
+};
@@ -0,0 +1,99 @@
+// Running driver probes side by side, each with a deadline.
+//
+// Probing a driver loads its dll and may instantiate it, and a driver can hang in
+// either, e.g. in DllMain or while it enumerates its devices. Probes run on their own
+// threads, a few at a time, and the caller waits for each only until its deadline
+// (counted from when it started). A probe that misses it is abandoned: its thread is
+// left to finish on its own, its slot goes to the next probe, and when it does finish
+// its late() callback runs on that thread to undo what it did. Total time is about
+// that of the slowest probe that finishes rather than the sum of all of them. Drivers
+// that hang holding the loader lock still make the others wait for LoadLibrary, but
+// only until their deadline.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+
+class ProbePool {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Task {
+		std::function<void()> work;
+		std::function<void()> late;	// on the task's thread, if it finished after it was abandoned
+	};
+
+	// Runs all tasks, at most parallel at once. Returns for every task whether it
+	// finished by its deadline. The work of a task that didn't may still be running,
+	// whatever it uses must stay alive and untouched.
+	static std::vector<bool> Run(std::vector<Task> tasks, int parallel, std::chrono::milliseconds timeout) {
+		auto shared = std::make_shared<Shared>();
+		shared->slots.resize(tasks.size());
+		std::vector<bool> finished(tasks.size());
+		std::vector<Clock::time_point> deadlines(tasks.size());
+		size_t next = 0;
+		int running = 0;
+
+		std::unique_lock<std::mutex> lock(shared->mutex);
+		while (next < tasks.size() || running) {
+			while (next < tasks.size() && running < std::max(parallel, 1)) {
+				size_t i = next++;
+				deadlines[i] = Clock::now() + timeout;
+				shared->slots[i] = Slot::Running;
+				running++;
+				std::thread([shared, i, task = std::move(tasks[i])]() {
+					task.work();
+					bool abandoned;
+					{
+						std::lock_guard<std::mutex> lock(shared->mutex);
+						abandoned = shared->slots[i] == Slot::Abandoned;
+						if (!abandoned) shared->slots[i] = Slot::Done;
+					}
+					shared->condition.notify_all();
+					if (abandoned && task.late) task.late();
+				}).detach();
+			}
+
+			Clock::time_point earliest = Clock::time_point::max();
+			for (size_t i = 0; i < next; i++)
+				if (shared->slots[i] == Slot::Running) earliest = std::min(earliest, deadlines[i]);
+			shared->condition.wait_until(lock, earliest);
+
+			auto now = Clock::now();
+			for (size_t i = 0; i < next; i++) {
+				if (shared->slots[i] == Slot::Done && !finished[i]) {
+					finished[i] = true;
+					running--;
+				}
+				else if (shared->slots[i] == Slot::Running && now >= deadlines[i]) {
+					shared->slots[i] = Slot::Abandoned;
+					running--;
+				}
+			}
+		}
+		return finished;
+	}
+
+private:
+	enum class Slot {
+		Waiting,
+		Running,
+		Done,
+		Abandoned
+	};
+
+	// Outlives Run() while abandoned tasks still run
+	struct Shared {
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::vector<Slot> slots;
+	};
+};
@@ -0,0 +1,160 @@
+// Connection state of a device, tracked in the background.
+//
+// Checking that the device is alive before every command costs a USB round trip, and
+// a device that is gone makes that check hang until its timeout. Instead the state is
+// kept here and updated from PnP notifications (or a slow heartbeat when there are
+// none), so the command path only has to read a flag. A lost device is reopened on
+// the session's own thread, and until then commands fail right away.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+
+class DeviceSession {
+public:
+	using Clock = std::chrono::steady_clock;
+	using OpenFunction = std::function<long()>;		// (re)open the device, returns 0 on success
+	using ProbeFunction = std::function<long()>;	// check that the device still answers, returns 0 if it does
+
+	enum class State {
+		Open,
+		Lost
+	};
+
+	struct Status {
+		State state{};
+		long lastError{};		// result of the failure that made the device lost, or of the last reopen attempt
+		uint64_t generation{};	// incremented by every successful reopen
+		uint64_t losses{};		// how many times the device was lost
+		uint64_t reopenAttempts{};
+	};
+
+	// The device is expected to be open already when the session is created
+	DeviceSession(OpenFunction open, ProbeFunction probe, std::chrono::milliseconds heartbeatPeriod = std::chrono::milliseconds(5000),
+		std::chrono::milliseconds retryPeriod = std::chrono::milliseconds(1000))
+		: open(std::move(open)), probe(std::move(probe)), heartbeatPeriod(heartbeatPeriod), retryPeriod(retryPeriod) {
+		thread = std::thread([this] { Run(); });
+	}
+
+	~DeviceSession() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		condition.notify_one();
+		if (thread.joinable()) thread.join();
+	}
+
+	DeviceSession(const DeviceSession&) = delete;
+	DeviceSession& operator=(const DeviceSession&) = delete;
+
+	// Any thread, no transfers. False while the device is gone.
+	bool IsOpen() const {
+		return state.load(std::memory_order_acquire) == State::Open;
+	}
+
+	// Any thread. A command failed on the device, stop sending more until it is reopened.
+	void ReportFailure(long error) {
+		lastError.store(error, std::memory_order_relaxed);
+		if (state.exchange(State::Lost, std::memory_order_acq_rel) == State::Open) {
+			losses.fetch_add(1, std::memory_order_relaxed);
+			Wake();
+		}
+	}
+
+	// PnP notifications. Once they arrive the heartbeat is no longer needed.
+	// A removal may be about another device, so the device is probed once to find out.
+	void OnDeviceRemoved() {
+		notifications.store(true, std::memory_order_relaxed);
+		probeRequested.store(true, std::memory_order_relaxed);
+		Wake();
+	}
+
+	void OnDeviceArrived() {
+		notifications.store(true, std::memory_order_relaxed);
+		Wake();
+	}
+
+	// Notifications were registered successfully, don't poll the device
+	void UseNotifications() {
+		notifications.store(true, std::memory_order_relaxed);
+	}
+
+	uint64_t Generation() const {
+		return generation.load(std::memory_order_acquire);
+	}
+
+	Status GetStatus() const {
+		Status s;
+		s.state = state.load(std::memory_order_acquire);
+		s.lastError = lastError.load(std::memory_order_relaxed);
+		s.generation = generation.load(std::memory_order_acquire);
+		s.losses = losses.load(std::memory_order_relaxed);
+		s.reopenAttempts = reopenAttempts.load(std::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	OpenFunction open;
+	ProbeFunction probe;
+	Clock::duration heartbeatPeriod;
+	Clock::duration retryPeriod;
+
+	std::atomic<State> state{ State::Open };
+	std::atomic<long> lastError{ 0 };
+	std::atomic<uint64_t> generation{ 0 };
+	std::atomic<uint64_t> losses{ 0 };
+	std::atomic<uint64_t> reopenAttempts{ 0 };
+	std::atomic<bool> notifications{ false };
+	std::atomic<bool> probeRequested{ false };
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool running{ true };	// guarded by mutex
+	bool woken{ false };	// guarded by mutex
+	std::thread thread;
+
+	void Wake() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			woken = true;
+		}
+		condition.notify_one();
+	}
+
+	void Run() {
+		while (true) {
+			bool lost = state.load(std::memory_order_acquire) == State::Lost;
+			auto period = lost ? retryPeriod : heartbeatPeriod;
+			{
+				// A lost device is retried on a timer even with notifications, in case one was missed
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!woken && running)
+					condition.wait_for(lock, period, [this] { return woken || !running; });
+				woken = false;
+				if (!running) return;
+			}
+
+			if (state.load(std::memory_order_acquire) == State::Lost) {
+				reopenAttempts.fetch_add(1, std::memory_order_relaxed);
+				long result = open();
+				lastError.store(result, std::memory_order_relaxed);
+				if (result == 0) {
+					generation.fetch_add(1, std::memory_order_release);
+					state.store(State::Open, std::memory_order_release);
+				}
+			}
+			else if (probeRequested.exchange(false, std::memory_order_relaxed) || !notifications.load(std::memory_order_relaxed)) {
+				if (long result = probe())
+					ReportFailure(result);
+			}
+		}
+	}
+};
@@ -0,0 +1,352 @@
+// Device sessions shared between processes.
+//
+// More than one process may load the plugin at a time: two hosts, or a host and its
+// plugin scanner. Each would read the device mixer on its own and write levels over
+// the other's. Instead the processes share a small segment per device (a named file
+// mapping, or POSIX shared memory) with the shadow mixer, a lease and a command ring.
+// The process holding the lease owns the device and is the only one sending control
+// requests. The others put their monitoring commands in the ring and wake the owner,
+// which executes them as its own, and everybody reads levels from the shared shadow
+// mixer. The owner renews the lease every second. When it stops, because the process
+// quit, died or hangs, another process takes the device over. Times are steady clock,
+// which is the same for all processes of a system.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include "mixer.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <cerrno>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <time.h>
+#endif
+
+
+// A monitoring command of a process that doesn't own the device, kAsioSetInputMonitor
+// with the input numbered on the device
+struct SharedCommand {
+	int32_t input{};
+	int32_t gain{};
+	int32_t state{};
+	int32_t pan{};
+	uint64_t issued{};	// steady clock, ns
+};
+
+
+class SharedDevice {
+public:
+	using CommandFunction = std::function<void(const SharedCommand&)>;	// owner, on the session's thread
+	using OwnerFunction = std::function<void(bool owner)>;				// this process took the device over or lost it, later on
+
+	static constexpr uint32_t Magic = 0x444D4441;	// "ADMD"
+	static constexpr uint32_t FormatVersion = 1;
+	static constexpr int RingSize = 256;
+	static constexpr std::chrono::milliseconds RenewPeriod{ 1000 };
+	static constexpr std::chrono::milliseconds LeaseTime{ 3000 };	// a lease not renewed for this long is free
+
+	SharedDevice() = default;
+	SharedDevice(const SharedDevice&) = delete;
+	SharedDevice& operator=(const SharedDevice&) = delete;
+
+	~SharedDevice() {
+		Close();
+	}
+
+	// Name of the segment of a device, the same in every process
+	static std::string Name(uint64_t model, std::wstring_view serial) {
+		std::string name = "asio-dm-activator-device-";
+		for (int shift = 60; shift >= 0; shift -= 4) name += "0123456789abcdef"[(model >> shift) & 0xf];
+		name += '-';
+		for (wchar_t c : serial)
+			if ((c >= L'0' && c <= L'9') || (c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z')) name += (char)c;
+		return name;
+	}
+
+	// Join the device's segment, creating it if this is the first process. The lease is
+	// taken right away if nobody holds it, IsOwner() tells. False if shared memory is not
+	// available or another version of the plugin has the segment, the process then works
+	// alone.
+	bool Open(const std::string& name, uint32_t pid = CurrentProcess()) {
+		Close();
+		if (!(mapping = Mapping::Open(name))) return false;
+		this->pid = pid;
+		owner = TakeOver();
+		return true;
+	}
+
+	// Start renewing the lease, and executing commands while this process owns the device.
+	// onOwner hears of changes of ownership from now on.
+	void Listen(CommandFunction onCommand, OwnerFunction onOwner) {
+		if (!mapping || thread.joinable()) return;
+		this->onCommand = std::move(onCommand);
+		this->onOwner = std::move(onOwner);
+		running = true;
+		thread = std::thread([this] { Run(); });
+	}
+
+	// Leaves the lease to the next process, which takes it over within a renewal period
+	void Close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		condition.notify_one();
+		if (mapping) mapping->Post();
+		if (thread.joinable()) thread.join();
+		if (mapping) {
+			uint64_t lease = mapping->segment->lease.load();
+			if (Holder(lease) == pid) mapping->segment->lease.compare_exchange_strong(lease, 0);
+		}
+		mapping.reset();
+		owner = false;
+	}
+
+	bool IsOpen() const {
+		return mapping != nullptr;
+	}
+
+	// Any thread
+	bool IsOwner() const {
+		return owner.load(std::memory_order_acquire);
+	}
+
+	// Process holding the lease, 0 = nobody
+	uint32_t Owner() const {
+		return mapping ? Holder(mapping->segment->lease.load(std::memory_order_relaxed)) : 0;
+	}
+
+	// The shadow mixer of all processes. Stays valid as long as the pointer is kept,
+	// even after Close.
+	std::shared_ptr<ShadowMixer> Shadow() const {
+		if (!mapping) return nullptr;
+		return std::shared_ptr<ShadowMixer>(mapping, &mapping->segment->shadow);
+	}
+
+	// Any thread, never blocks. Hands the command to the owner. False if the ring is full.
+	// A process that dies in the middle of this stops the ring, it's a few instructions.
+	bool Submit(const SharedCommand& command) {
+		if (!mapping) return false;
+		Segment& s = *mapping->segment;
+		uint64_t position = s.tail.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &s.cells[position % RingSize];
+			uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+			int64_t diff = (int64_t)(sequence - position);
+			if (diff == 0 && s.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			if (diff < 0) return false;
+			if (diff > 0) position = s.tail.load(std::memory_order_relaxed);
+		}
+		cell->command = command;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		mapping->Post();
+		return true;
+	}
+
+	static uint64_t Now() {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static uint32_t CurrentProcess() {
+	#ifdef _WIN32
+		return GetCurrentProcessId();
+	#else
+		return (uint32_t)getpid();
+	#endif
+	}
+
+private:
+	struct Cell {
+		std::atomic<uint64_t> sequence;
+		SharedCommand command;
+	};
+
+	struct Segment {
+		std::atomic<uint32_t> magic;	// set last, once the segment is ready
+		std::atomic<uint32_t> formatting;
+		uint32_t version;
+		uint32_t size;
+		std::atomic<uint64_t> lease;	// process id holding it, then the time of the last renewal, see Lease()
+		ShadowMixer shadow;
+		alignas(64) std::atomic<uint64_t> head;	// next command to execute, owner only
+		alignas(64) std::atomic<uint64_t> tail;	// next free cell
+		Cell cells[RingSize];
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "The segment is shared between processes");
+
+	// The segment and the semaphore waking its owner, unmapped when the last user lets go
+	class Mapping {
+	public:
+		Segment* segment{};
+
+		static std::shared_ptr<Mapping> Open(const std::string& name) {
+			auto m = std::make_shared<Mapping>();
+		#ifdef _WIN32
+			std::wstring wide(name.begin(), name.end());
+			m->file = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Segment), (L"Local\\" + wide).c_str());
+			if (m->file) m->segment = (Segment*)MapViewOfFile(m->file, FILE_MAP_WRITE, 0, 0, sizeof(Segment));
+			m->wake = CreateSemaphoreW(NULL, 0, RingSize, (L"Local\\" + wide + L"-wake").c_str());
+			if (!m->segment || !m->wake) return nullptr;
+		#else
+			int fd = shm_open(("/" + name).c_str(), O_CREAT | O_RDWR, 0600);
+			if (fd < 0) return nullptr;
+			struct stat st{};
+			if (fstat(fd, &st) == 0 && (st.st_size >= (off_t)sizeof(Segment) || ftruncate(fd, sizeof(Segment)) == 0)) {
+				void* memory = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (memory != MAP_FAILED) m->segment = (Segment*)memory;
+			}
+			close(fd);
+			m->wake = sem_open(("/" + name + "-wake").c_str(), O_CREAT, 0600, 0);
+			if (!m->segment || m->wake == SEM_FAILED) return nullptr;
+		#endif
+			if (!m->Format()) return nullptr;
+			return m;
+		}
+
+		~Mapping() {
+		#ifdef _WIN32
+			if (segment) UnmapViewOfFile(segment);
+			if (file) CloseHandle(file);
+			if (wake) CloseHandle(wake);
+		#else
+			if (segment) munmap(segment, sizeof(Segment));
+			if (wake != SEM_FAILED) sem_close(wake);
+		#endif
+		}
+
+		void Post() {
+		#ifdef _WIN32
+			ReleaseSemaphore(wake, 1, NULL);	// fails when the count is full, the owner is awake then
+		#else
+			sem_post(wake);
+		#endif
+		}
+
+		void Wait(std::chrono::milliseconds timeout) {
+		#ifdef _WIN32
+			WaitForSingleObject(wake, (DWORD)timeout.count());
+		#else
+			timespec until{};
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += (long)(timeout.count() % 1000) * 1000000;
+			until.tv_sec += timeout.count() / 1000 + until.tv_nsec / 1000000000;
+			until.tv_nsec %= 1000000000;
+			while (sem_timedwait(wake, &until) != 0 && errno == EINTR) {}
+		#endif
+		}
+
+	private:
+	#ifdef _WIN32
+		HANDLE file{};
+		HANDLE wake{};
+	#else
+		sem_t* wake = SEM_FAILED;
+	#endif
+
+		// A new segment is all zeros. The first process lays it out, the others wait for that.
+		bool Format() {
+			auto& s = *segment;
+			uint32_t expected = 0;
+			if (s.magic.load(std::memory_order_acquire) != Magic && s.formatting.compare_exchange_strong(expected, 1)) {
+				s.version = FormatVersion;
+				s.size = sizeof(Segment);
+				new (&s.shadow) ShadowMixer();
+				s.head.store(0, std::memory_order_relaxed);
+				s.tail.store(0, std::memory_order_relaxed);
+				for (uint64_t i = 0; i < RingSize; i++) s.cells[i].sequence.store(i, std::memory_order_relaxed);
+				s.magic.store(Magic, std::memory_order_release);
+			}
+			for (int attempt = 0; attempt < 1000 && s.magic.load(std::memory_order_acquire) != Magic; attempt++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return s.magic.load(std::memory_order_acquire) == Magic && s.version == FormatVersion && s.size == sizeof(Segment);
+		}
+	};
+
+	std::shared_ptr<Mapping> mapping;
+	CommandFunction onCommand;
+	OwnerFunction onOwner;
+	uint32_t pid{};
+	std::atomic<bool> owner{ false };
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool running{};
+
+	// Holder and renewal time in one word, so they change together. The time is in ms and
+	// wraps every 49 days, only differences of it are used.
+	static uint64_t Lease(uint32_t holder) {
+		return ((uint64_t)holder << 32) | (uint32_t)(Now() / 1000000);
+	}
+
+	static uint32_t Holder(uint64_t lease) {
+		return (uint32_t)(lease >> 32);
+	}
+
+	static bool Expired(uint64_t lease) {
+		return (uint32_t)(Lease(0) - (uint32_t)lease) > (uint32_t)LeaseTime.count();
+	}
+
+	// Renew the lease if this process holds it, or take it if it is free or expired
+	bool TakeOver() {
+		Segment& s = *mapping->segment;
+		uint64_t lease = s.lease.load(std::memory_order_acquire);
+		uint32_t holder = Holder(lease);
+		if (holder && holder != pid && !Expired(lease)) return false;
+		return s.lease.compare_exchange_strong(lease, Lease(pid), std::memory_order_acq_rel);
+	}
+
+	// The owner waits for commands on the semaphore, the others only watch the lease. All
+	// processes wait on one semaphore, which must wake the owner and nobody else.
+	void Run() {
+		bool wasOwner = owner.load();
+		while (true) {
+			if (owner.load(std::memory_order_relaxed)) mapping->Wait(RenewPeriod);
+			else {
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait_for(lock, RenewPeriod, [this] { return !running; });
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!running) break;
+			}
+			// Another process may have taken the lease while this one hung, or may have quit
+			bool isOwner = TakeOver();
+			owner.store(isOwner, std::memory_order_release);
+			if (isOwner != wasOwner && onOwner) onOwner(isOwner);
+			wasOwner = isOwner;
+			if (isOwner) Drain();
+		}
+	}
+
+	// A former owner coming back from a hang may still be draining, hence the CAS
+	void Drain() {
+		Segment& s = *mapping->segment;
+		while (true) {
+			uint64_t position = s.head.load(std::memory_order_relaxed);
+			Cell& cell = s.cells[position % RingSize];
+			if (cell.sequence.load(std::memory_order_acquire) != position + 1) return;
+			if (!s.head.compare_exchange_strong(position, position + 1, std::memory_order_relaxed)) continue;
+			SharedCommand command = cell.command;
+			cell.sequence.store(position + RingSize, std::memory_order_release);
+			if (onCommand) onCommand(command);
+		}
+	}
+};
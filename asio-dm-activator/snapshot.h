@@ -0,0 +1,220 @@
+// Mixer levels that outlive the host.
+//
+// The level an input had before monitoring muted it is only known to the plugin. If
+// the host crashes while the input is muted, the device stays muted and the level is
+// gone. The snapshot keeps these levels in a small memory-mapped file, one record per
+// device (model and serial), so they survive crashes, replugs and restarts: a process
+// that dies leaves its writes in the file, and every input is a single 64-bit entry
+// written in one atomic store, so no entry is ever half-written. The file is laid out
+// by the first host that opens it and records are claimed with a compare-and-swap,
+// several hosts may share the file.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include "mixer.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <optional>
+#include <string_view>
+#include <filesystem>
+#include <system_error>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+class MixerSnapshot {
+public:
+	static constexpr uint32_t Magic = 0x584D4441;	// "ADMX"
+	static constexpr uint32_t FormatVersion = 2;
+	static constexpr int MaxDevices = 16;
+	static constexpr int MaxChannels = ShadowMixer::MaxChannels;
+	static constexpr int SerialSize = 32;
+
+	// What is known about one input
+	struct Level {
+		VolPair vol{};		// last level that was not muted
+		bool muted{};		// the plugin muted it and hasn't restored it since
+	};
+
+	MixerSnapshot() = default;
+	MixerSnapshot(const MixerSnapshot&) = delete;
+	MixerSnapshot& operator=(const MixerSnapshot&) = delete;
+
+	~MixerSnapshot() {
+		Close();
+	}
+
+	// Map the file, creating it if needed. A file of another format is started over.
+	bool Open(const std::filesystem::path& path) {
+		Close();
+		std::error_code ec;
+		std::filesystem::create_directories(path.parent_path(), ec);
+	#ifdef _WIN32
+		file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, sizeof(File), NULL);
+		if (mapping) data = (File*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sizeof(File));
+	#else
+		int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+		if (fd < 0) return false;
+		struct stat st{};
+		if (fstat(fd, &st) == 0 && (st.st_size >= (off_t)sizeof(File) || ftruncate(fd, sizeof(File)) == 0)) {
+			void* memory = mmap(nullptr, sizeof(File), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (memory != MAP_FAILED) data = (File*)memory;
+		}
+		close(fd);
+	#endif
+		if (!data) {
+			Close();
+			return false;
+		}
+		// A new file is all zeros, one of another format is started over. The host that
+		// takes the formatting word lays it out, the others wait for that.
+		auto magic = std::atomic_ref<uint32_t>(data->magic);
+		auto formatting = std::atomic_ref<uint32_t>(data->formatting);
+		uint32_t expected = formatting.load();
+		if (!Formatted() && expected != Formatting && formatting.compare_exchange_strong(expected, Formatting)) {
+			magic.store(0);
+			memset((char*)data + offsetof(File, version), 0, sizeof(File) - offsetof(File, version));
+			data->version = FormatVersion;
+			data->recordSize = sizeof(Record);
+			data->records = MaxDevices;
+			magic.store(Magic, std::memory_order_release);
+		}
+		for (int attempt = 0; attempt < 1000 && !Formatted(); attempt++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (!Formatted()) {
+			// Whoever took the word died half way, the next Open starts over
+			expected = Formatting;
+			formatting.compare_exchange_strong(expected, 0);
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	bool IsOpen() const {
+		return data != nullptr;
+	}
+
+	// Record of the device, claimed if it doesn't have one yet. -1 if the file is not
+	// open or full.
+	int Attach(uint64_t model, std::wstring_view serial) {
+		if (!data) return -1;
+		uint16_t key[SerialSize]{};
+		for (size_t i = 0; i < serial.size() && i < SerialSize; i++) key[i] = (uint16_t)serial[i];
+
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < MaxDevices; i++) {
+				Record& r = data->devices[i];
+				auto state = std::atomic_ref<uint32_t>(r.state);
+				if (pass == 0) {
+					if (state.load(std::memory_order_acquire) == Used && r.model == model && !memcmp(r.serial, key, sizeof(key))) return i;
+					continue;
+				}
+				uint32_t expected = Free;
+				if (!state.compare_exchange_strong(expected, Claimed)) continue;
+				r.model = model;
+				memcpy(r.serial, key, sizeof(key));
+				for (auto& c : r.channels) std::atomic_ref<uint64_t>(c).store(0, std::memory_order_relaxed);
+				state.store(Used, std::memory_order_release);
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// Any thread
+	std::optional<Level> Get(int device, int channel) const {
+		if (!Valid(device, channel)) return std::nullopt;
+		uint64_t entry = std::atomic_ref<uint64_t>(data->devices[device].channels[channel]).load(std::memory_order_relaxed);
+		if (!(entry & HasLevel)) return std::nullopt;
+		return Level{ VolPair::Unpack((uint32_t)entry), (entry & Muted) != 0 };
+	}
+
+	// Any thread. The device has vol now; byPlugin tells if the plugin set it. A level that
+	// is not muted is remembered. Muting is only recorded if the plugin did it, muting
+	// in the device mixer is the user's business.
+	void Set(int device, int channel, VolPair vol, bool byPlugin) {
+		if (!Valid(device, channel)) return;
+		auto entry = std::atomic_ref<uint64_t>(data->devices[device].channels[channel]);
+		uint64_t old = entry.load(std::memory_order_relaxed);
+		uint64_t value = old;
+		if (vol != ShadowMixer::MinusInf)
+			value = HasLevel | vol.Pack();
+		else if (byPlugin && (old & HasLevel))
+			value = old | Muted;
+		if (value != old) entry.store(value, std::memory_order_relaxed);
+	}
+
+	// Push the pages to disk, in case the whole system goes down rather than the host
+	void Flush() {
+		if (!data) return;
+	#ifdef _WIN32
+		FlushViewOfFile(data, sizeof(File));
+	#else
+		msync(data, sizeof(File), MS_ASYNC);
+	#endif
+	}
+
+	void Close() {
+	#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+	#else
+		if (data) munmap(data, sizeof(File));
+	#endif
+		data = nullptr;
+	}
+
+private:
+	static constexpr uint32_t Formatting = 0x544D5246;	// "FRMT", in the formatting word
+	static constexpr uint32_t Free = 0, Claimed = 1, Used = 2;
+	static constexpr uint64_t HasLevel = 1ull << 32;
+	static constexpr uint64_t Muted = 1ull << 33;
+
+	struct Record {
+		uint32_t state;			// Free, Claimed, Used
+		uint32_t reserved;
+		uint64_t model;
+		uint16_t serial[SerialSize];	// UTF-16, zero padded
+		uint64_t channels[MaxChannels];	// low 32 bits VolPair::Pack, then HasLevel and Muted
+	};
+
+	struct File {
+		uint32_t magic;			// set last, once the file is laid out
+		uint32_t formatting;	// Formatting once a host took it on
+		uint32_t version;
+		uint32_t recordSize;
+		uint32_t records;
+		Record devices[MaxDevices];
+	};
+
+	File* data{};
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping{};
+#endif
+
+	bool Formatted() const {
+		return std::atomic_ref<uint32_t>(data->magic).load(std::memory_order_acquire) == Magic
+			&& data->version == FormatVersion && data->recordSize == sizeof(Record) && data->records == MaxDevices;
+	}
+
+	bool Valid(int device, int channel) const {
+		return data && device >= 0 && device < MaxDevices && channel >= 0 && channel < MaxChannels;
+	}
+};
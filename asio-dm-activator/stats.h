@@ -0,0 +1,229 @@
+// Live statistics, readable from outside the host.
+//
+// Counters and latency histograms sit in one block of shared memory named after the
+// host's process id. The plugin updates them with relaxed atomic increments and a
+// reader (tools/asio-dm-stats.cpp) maps the same block and loads the values, so
+// neither side ever takes a lock. Histograms are HDR-style: 16 linear buckets per
+// power of two, about 6% resolution from nanoseconds to minutes, in fixed memory.
+// Builds on Windows and on POSIX systems.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <new>
+#include <bit>
+#include <algorithm>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Counters are shared between processes");
+
+
+class LatencyHistogram {
+public:
+	static constexpr int SubBucketBits = 4;
+	static constexpr int SubBuckets = 1 << SubBucketBits;
+	static constexpr int MaxShift = 36;		// values are capped at 2^40 ns, about 18 minutes
+	static constexpr int Buckets = (MaxShift + 2) * SubBuckets;
+
+	// Any thread
+	void Record(uint64_t ns) {
+		counts[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t m = max.load(std::memory_order_relaxed);
+		while (ns > m && !max.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+	}
+
+	uint64_t Count() const { return total.load(std::memory_order_relaxed); }
+	uint64_t Max() const { return max.load(std::memory_order_relaxed); }
+	uint64_t Mean() const { uint64_t n = Count(); return n ? sum.load(std::memory_order_relaxed) / n : 0; }
+
+	// Upper bound of the bucket the p-th fraction of the values falls into, 0 if empty.
+	// Concurrent updates may make it off by the few values recorded meanwhile.
+	uint64_t Percentile(double p) const {
+		uint64_t n = Count();
+		if (!n) return 0;
+		uint64_t rank = (uint64_t)(p * n);
+		uint64_t seen = 0;
+		for (int b = 0; b < Buckets; b++) {
+			seen += counts[b].load(std::memory_order_relaxed);
+			if (seen > rank) return std::min(UpperBound(b), Max());
+		}
+		return Max();
+	}
+
+	static int BucketOf(uint64_t ns) {
+		if (ns < SubBuckets) return (int)ns;
+		int shift = std::bit_width(ns) - 1 - SubBucketBits;
+		if (shift > MaxShift) return Buckets - 1;
+		return (shift + 1) * SubBuckets + (int)((ns >> shift) - SubBuckets);
+	}
+
+	static uint64_t UpperBound(int bucket) {
+		if (bucket < SubBuckets) return bucket;
+		int shift = bucket / SubBuckets - 1;
+		uint64_t top = SubBuckets + bucket % SubBuckets;
+		return ((top + 1) << shift) - 1;
+	}
+
+private:
+	std::atomic<uint64_t> counts[Buckets]{};
+	std::atomic<uint64_t> total{ 0 };
+	std::atomic<uint64_t> sum{ 0 };
+	std::atomic<uint64_t> max{ 0 };
+};
+
+
+struct StatsBlock {
+	static constexpr uint32_t Magic = 0x534D4441;	// "ADMS"
+	static constexpr uint32_t FormatVersion = 4;
+
+	enum Counter {
+		PassThrough,		// future() calls the stub sent straight to the driver
+		Hooked,				// future() calls handled by the plugin
+		Queued,				// SetInputMonitor commands accepted from the host
+		Coalesced,			// commands merged away by a later one for the same input
+		Executed,			// commands that reached a device
+		CommandFailures,
+		Transfers,			// USB control requests
+		TransferFailures,
+		Timeouts,			// failed requests that took their whole timeout
+		Reopens,			// devices brought back after a loss
+		SwitchesOnTime,		// commands that reached the device by the buffer boundary they aimed at
+		SwitchesLate,		// and those that didn't
+		Retries,			// control requests sent again after failing
+		DevicesLost,		// devices given up because requests kept failing
+		Callbacks,			// buffer switches timed by the jitter monitor (ASIO_DM_ACTIVATOR_JITTER)
+		CallbacksWhileBusy,	// of them, while the plugin was working
+		DeadlineMisses,		// buffer switches that finished after the next buffer was due
+		MissesWhileBusy,	// of them, while the plugin was working
+		CounterCount
+	};
+
+	enum Histogram {
+		TransferSet,		// one AudioControlRequestSet
+		TransferGet,		// one AudioControlRequestGet
+		SetInputMonitor,	// from future() to the crosspoints written
+		SwitchLate,			// how far behind its buffer boundary a late command landed
+		CallbackJitter,		// how far a buffer switch was off the period
+		CallbackDuration,	// time the host spent in a buffer switch
+		HistogramCount
+	};
+
+	static constexpr const char* CounterNames[CounterCount] = {
+		"pass-through", "hooked", "queued", "coalesced", "executed", "command failures",
+		"transfers", "transfer failures", "timeouts", "reopens", "switches on time", "switches late",
+		"retries", "devices lost", "callbacks", "callbacks while busy", "deadline misses", "misses while busy"
+	};
+
+	static constexpr const char* HistogramNames[HistogramCount] = {
+		"transfer set", "transfer get", "SetInputMonitor", "switch late", "callback jitter", "callback duration"
+	};
+
+	std::atomic<uint32_t> magic{ 0 };	// set last, once the block is ready
+	uint32_t version = FormatVersion;
+	uint32_t size = sizeof(StatsBlock);
+	uint32_t pid{};
+	std::atomic<uint64_t> counters[CounterCount]{};
+	LatencyHistogram histograms[HistogramCount];
+
+	static uint64_t Now() {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Any thread
+	void Add(Counter counter, uint64_t n = 1) {
+		counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t Get(Counter counter) const {
+		return counters[counter].load(std::memory_order_relaxed);
+	}
+
+	void Record(Histogram histogram, uint64_t ns) {
+		histograms[histogram].Record(ns);
+	}
+
+	// One control request, started at start (Now())
+	void RecordTransfer(bool set, uint64_t start, long result, long timeoutMillisecs) {
+		uint64_t elapsed = Now() - start;
+		Record(set ? TransferSet : TransferGet, elapsed);
+		Add(Transfers);
+		if (result == 0) return;
+		Add(TransferFailures);
+		if (elapsed >= (uint64_t)timeoutMillisecs * 1000000) Add(Timeouts);
+	}
+
+	bool IsValid() const {
+		return magic.load(std::memory_order_acquire) == Magic && version == FormatVersion && size == sizeof(StatsBlock);
+	}
+
+	static std::string Name(uint32_t pid) {
+	#ifdef _WIN32
+		return "Local\\asio-dm-activator-stats-" + std::to_string(pid);
+	#else
+		return "/asio-dm-activator-stats-" + std::to_string(pid);
+	#endif
+	}
+
+	// Create the shared block of this process. It stays mapped until the process exits.
+	// Returns nullptr if shared memory is not available.
+	static StatsBlock* Publish(uint32_t pid) {
+		void* memory = nullptr;
+	#ifdef _WIN32
+		auto name = Name(pid);
+		HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(StatsBlock), std::wstring(name.begin(), name.end()).c_str());
+		if (!mapping) return nullptr;
+		memory = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sizeof(StatsBlock));
+		if (!memory) {
+			CloseHandle(mapping);
+			return nullptr;
+		}
+	#else
+		shm_unlink(Name(pid).c_str());	// left over from a process that had the same id
+		int fd = shm_open(Name(pid).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) return nullptr;
+		if (ftruncate(fd, sizeof(StatsBlock)) == 0)
+			memory = mmap(nullptr, sizeof(StatsBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (!memory || memory == MAP_FAILED) return nullptr;
+	#endif
+		auto block = new (memory) StatsBlock();
+		block->pid = pid;
+		block->magic.store(Magic, std::memory_order_release);
+		return block;
+	}
+
+	// The block of another process, read-only. Returns nullptr if there is none
+	// (no such process, or it has no plugin loaded) or it's from another version.
+	static const StatsBlock* Open(uint32_t pid) {
+		const void* memory = nullptr;
+	#ifdef _WIN32
+		auto name = Name(pid);
+		HANDLE mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, std::wstring(name.begin(), name.end()).c_str());
+		if (!mapping) return nullptr;
+		memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(StatsBlock));
+		CloseHandle(mapping);	// the view keeps the mapping alive
+		if (!memory) return nullptr;
+	#else
+		int fd = shm_open(Name(pid).c_str(), O_RDONLY, 0);
+		if (fd < 0) return nullptr;
+		struct stat st{};
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(StatsBlock))
+			memory = mmap(nullptr, sizeof(StatsBlock), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (!memory || memory == MAP_FAILED) return nullptr;
+	#endif
+		auto block = (const StatsBlock*)memory;
+		return block->IsValid() ? block : nullptr;
+	}
+};
@@ -0,0 +1,80 @@
+// Machine code generation for the patched future() entry.
+//
+// The driver's future() is called with many selectors the plugin has no interest in
+// (time info, timecode, IO format...). The generated stub looks at the selector itself
+// and jumps straight to the original function for everything but the selectors it
+// was built for, leaving all arguments untouched. Only those reach the C++ handler.
+//
+// The code follows the Microsoft x64 calling convention, which is what ASIO drivers
+// use. On other x86-64 systems it can be called through an ms_abi function pointer,
+// so the generator can be tested and measured there as well. ThunkArena (hooks.h)
+// provides the executable memory.
+
+#pragma once
+#include <vector>
+#include <span>
+#include <cstring>
+#include <cstdint>
+
+
+namespace thunk {
+
+	// long future(void* iasio, long selector, void* params)
+	//     rcx = iasio, edx = selector, r8 = params
+	//
+	// Call handler(instance, iasio, selector, params) for every selector
+	inline std::vector<uint8_t> FutureForward(uintptr_t instance, uintptr_t handler) {
+		std::vector<uint8_t> code;
+		code.reserve(32);	// all of it, 31 bytes
+		auto emit = [&](std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); };
+		auto emit64 = [&](uint64_t x) { for (int i = 0; i < 8; i++) code.push_back((uint8_t)(x >> (i * 8))); };
+
+		// Shift 3 arguments right and add the instance pointer ("this" as the first argument)
+		emit({ 0x4D, 0x89, 0xC1 });				// mov r9, r8
+		emit({ 0x49, 0x89, 0xD0 });				// mov r8, rdx
+		emit({ 0x48, 0x89, 0xCA });				// mov rdx, rcx
+		emit({ 0x48, 0xB9 }); emit64(instance);	// mov rcx, instance
+		emit({ 0x48, 0xB8 }); emit64(handler);	// mov rax, handler
+		emit({ 0xFF, 0xE0 });					// jmp rax
+		return code;
+	}
+
+	// long future(void* iasio, long selector, void* params)
+	//     rcx = iasio, edx = selector, r8 = params
+	//
+	// For a selector in the list, call handler(instance, iasio, selector, params),
+	// otherwise tail-jump to original(iasio, selector, params). If passCounter is given,
+	// the 64-bit counter there is incremented for every call that takes the second path.
+	inline std::vector<uint8_t> FutureFilter(uintptr_t instance, uintptr_t handler, uintptr_t original, std::span<const long> selectors,
+		uintptr_t passCounter = 0) {
+		std::vector<uint8_t> code;
+		auto emit = [&](std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); };
+		auto emit32 = [&](uint32_t x) { for (int i = 0; i < 4; i++) code.push_back((uint8_t)(x >> (i * 8))); };
+		auto emit64 = [&](uint64_t x) { for (int i = 0; i < 8; i++) code.push_back((uint8_t)(x >> (i * 8))); };
+
+		// cmp edx, selector / je handler, once per selector
+		std::vector<size_t> jumps;
+		for (long selector : selectors) {
+			emit({ 0x81, 0xFA }); emit32((uint32_t)selector);	// cmp edx, imm32
+			emit({ 0x0F, 0x84 }); jumps.push_back(code.size()); emit32(0);	// je rel32
+		}
+
+		// Not ours, continue in the original function as if nothing happened
+		if (passCounter) {
+			emit({ 0x48, 0xB8 }); emit64(passCounter);	// mov rax, passCounter
+			emit({ 0xF0, 0x48, 0xFF, 0x00 });			// lock inc qword ptr [rax]
+		}
+		emit({ 0x48, 0xB8 }); emit64(original);	// mov rax, original
+		emit({ 0xFF, 0xE0 });					// jmp rax
+
+		// Ours
+		size_t handlerPath = code.size();
+		for (size_t at : jumps) {
+			uint32_t rel = (uint32_t)(handlerPath - (at + 4));
+			memcpy(&code[at], &rel, 4);
+		}
+		auto forward = FutureForward(instance, handler);
+		code.insert(code.end(), forward.begin(), forward.end());
+		return code;
+	}
+}
@@ -0,0 +1,134 @@
+// Where the host's audio stream is, for switching monitoring on buffer boundaries.
+//
+// The plugin sees every buffer switch of the driver (the host's callbacks are wrapped
+// in createBuffers), so it knows when each buffer starts, in the steady clock and in
+// samples. Between switches the position is projected with the measured buffer period.
+// A monitoring command is stamped with the sample position it was issued at and aimed
+// at the first buffer boundary its USB transfers can still make, given how long they
+// took so far; the worker starts writing in time for it instead of whenever its batch
+// window happens to close. Whether the switch made it is measured when it lands.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <atomic>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+
+
+class BufferClock {
+public:
+	static constexpr uint64_t Margin = 500000;	// ns, for the hops between the worker threads
+
+	// A command's place in the stream
+	struct Target {
+		int64_t sample{};	// where the stream was when it was issued
+		uint64_t due{};		// buffer boundary it should be heard from, StatsBlock::Now() time
+		uint64_t start{};	// latest time to start writing it
+	};
+
+	// Audio thread, when the host's buffers are created
+	void Start(long bufferSize) {
+		Publish(0, 0, 0, bufferSize);
+		measured = 0;
+	}
+
+	// When they are disposed of
+	void Stop() {
+		Publish(0, 0, 0, 0);
+	}
+
+	// Audio thread, at every buffer switch. The sample position is counted if the driver
+	// doesn't give it.
+	void Tick(uint64_t now, std::optional<int64_t> samplePosition = std::nullopt) {
+		uint64_t last = lastTime.load(std::memory_order_relaxed);
+		long size = bufferSize.load(std::memory_order_relaxed);
+		if (!size) return;
+		int64_t sample = samplePosition ? *samplePosition : (last ? lastSample.load(std::memory_order_relaxed) + size : 0);
+		if (last && now > last) {
+			double interval = (double)(now - last);
+			// A stall or restart says nothing about the period
+			if (!measured) measured = interval;
+			else if (interval < measured * 2 && interval > measured / 2) measured += (interval - measured) / 16;
+		}
+		Publish(now, sample, (uint64_t)measured, size);
+	}
+
+	// Any thread. Nothing while the stream doesn't run or the period isn't known yet.
+	std::optional<Target> Aim(uint64_t now) const {
+		State s;
+		if (!Load(s) || !s.period || !s.bufferSize) return std::nullopt;
+		now = std::max(now, s.time);	// a switch just happened
+		if (now - s.time > StaleAfter * s.period) return std::nullopt;
+		uint64_t lead = cost.load(std::memory_order_relaxed) + Margin;
+		uint64_t boundaries = (now + lead - s.time + s.period - 1) / s.period;
+		Target t;
+		t.sample = s.sample + (int64_t)((now - s.time) * s.bufferSize / s.period);
+		t.due = s.time + boundaries * s.period;
+		t.start = t.due - lead;
+		return t;
+	}
+
+	// Any worker. Writing one switch took this long (ns).
+	void Measured(uint64_t ns) {
+		uint64_t c = cost.load(std::memory_order_relaxed);
+		cost.store(c ? c + ((int64_t)ns - (int64_t)c) / 8 : ns, std::memory_order_relaxed);
+	}
+
+	// Expected time to write one switch, ns
+	uint64_t Cost() const {
+		return cost.load(std::memory_order_relaxed);
+	}
+
+	// A time span in samples of the running stream, 0 if it doesn't run
+	int64_t ToSamples(int64_t ns) const {
+		State s;
+		if (!Load(s) || !s.period) return 0;
+		return ns * s.bufferSize / (int64_t)s.period;
+	}
+
+private:
+	static constexpr uint64_t StaleAfter = 8;	// periods without a switch, the stream stopped
+
+	struct State {
+		uint64_t time{};
+		int64_t sample{};
+		uint64_t period{};
+		long bufferSize{};
+	};
+
+	// Seqlock, written by the audio thread only
+	std::atomic<uint32_t> sequence{ 0 };
+	std::atomic<uint64_t> lastTime{ 0 };
+	std::atomic<int64_t> lastSample{ 0 };
+	std::atomic<uint64_t> period{ 0 };
+	std::atomic<long> bufferSize{ 0 };
+	double measured{};	// audio thread only
+
+	std::atomic<uint64_t> cost{ 0 };
+
+	void Publish(uint64_t time, int64_t sample, uint64_t p, long size) {
+		uint32_t s = sequence.load(std::memory_order_relaxed);
+		sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		lastTime.store(time, std::memory_order_relaxed);
+		lastSample.store(sample, std::memory_order_relaxed);
+		period.store(p, std::memory_order_relaxed);
+		bufferSize.store(size, std::memory_order_relaxed);
+		sequence.store(s + 2, std::memory_order_release);
+	}
+
+	bool Load(State& state) const {
+		for (int attempt = 0; attempt < 16; attempt++) {
+			uint32_t before = sequence.load(std::memory_order_acquire);
+			if (before & 1) continue;
+			state.time = lastTime.load(std::memory_order_relaxed);
+			state.sample = lastSample.load(std::memory_order_relaxed);
+			state.period = period.load(std::memory_order_relaxed);
+			state.bufferSize = bufferSize.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == before) return true;
+		}
+		return false;
+	}
+};
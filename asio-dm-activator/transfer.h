@@ -0,0 +1,116 @@
+// Deadlines, retries and giving up on USB control requests.
+//
+// A control request takes well under a millisecond, but one sent to a wedged device
+// hangs until its timeout, and the timeouts used to be fixed at seconds. The policy
+// learns how long requests really take, a smoothed mean and mean deviation as TCP
+// keeps for its retransmission timer, and gives each request a deadline a few times
+// that. A request that fails is tried again after a short, growing pause, a bounded
+// number of times. When requests keep failing after their retries the device is given
+// up: the caller reports it to its DeviceSession, which makes the following commands
+// fail right away until the device is reopened (the session is the circuit breaker,
+// its heartbeat and reopen attempts are the half-open state).
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+
+class TransferPolicy {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Settings {
+		long minTimeout = 50;		// ms, no deadline is tighter than this
+		long maxTimeout = 1000;		// ms, and none is looser; also used until requests were seen
+		double factor = 4;			// deadline = factor * (mean + 4 * deviation)
+		int attempts = 3;			// per request, the first one included
+		std::chrono::milliseconds backoff{ 2 };		// pause before the first retry, doubled for every next one
+		std::chrono::milliseconds maxBackoff{ 20 };
+		int tripAfter = 2;			// requests failing in a row, after their retries, before the device is given up
+	};
+
+	TransferPolicy() : TransferPolicy(Settings()) {}
+	explicit TransferPolicy(const Settings& settings) : settings(settings) {}
+
+	// Any thread. Deadline of the next request, ms.
+	long Timeout() const {
+		double mean = smoothed.load(std::memory_order_relaxed);
+		if (mean <= 0) return settings.maxTimeout;
+		double ms = settings.factor * (mean + 4 * deviation.load(std::memory_order_relaxed)) / 1e6;
+		return std::clamp((long)std::ceil(ms), settings.minTimeout, settings.maxTimeout);
+	}
+
+	// Pause before retry number n (1 = the second attempt)
+	std::chrono::milliseconds Backoff(int n) const {
+		std::chrono::milliseconds pause = settings.backoff * (1 << std::clamp(n - 1, 0, 16));
+		return std::min(pause, settings.maxBackoff);
+	}
+
+	// Sends request(timeoutMillisecs), which returns 0 on success, until it succeeds or
+	// the attempts are used up. cancel() is asked before every retry, e.g. whether the
+	// device was lost meanwhile. onRetry() is told about every retry. Returns the last result.
+	template <typename Request, typename Cancel, typename OnRetry>
+	long Run(Request&& request, Cancel&& cancel, OnRetry&& onRetry) {
+		long result = -1;
+		for (int attempt = 0; attempt < std::max(settings.attempts, 1); attempt++) {
+			if (attempt) {
+				if (cancel()) break;
+				onRetry();
+				std::this_thread::sleep_for(Backoff(attempt));
+			}
+			auto start = Clock::now();
+			if ((result = request(Timeout())) == 0) {
+				Succeeded(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+				return result;
+			}
+		}
+		return result;
+	}
+
+	// Any thread. A request succeeded after ns. Failures say nothing about the latency,
+	// a timeout would only teach the deadline itself.
+	void Succeeded(int64_t ns) {
+		double sample = (double)std::max<int64_t>(ns, 0);
+		double mean = smoothed.load(std::memory_order_relaxed);
+		if (mean <= 0) {
+			smoothed.store(sample, std::memory_order_relaxed);
+			deviation.store(sample / 2, std::memory_order_relaxed);
+		}
+		else {
+			double dev = deviation.load(std::memory_order_relaxed);
+			deviation.store(dev + (std::abs(sample - mean) - dev) / 4, std::memory_order_relaxed);
+			smoothed.store(mean + (sample - mean) / 8, std::memory_order_relaxed);
+		}
+		failures.store(0, std::memory_order_relaxed);
+	}
+
+	// Any thread. A request failed for good, after its retries. True if the device should
+	// be given up now.
+	bool Failed() {
+		return failures.fetch_add(1, std::memory_order_relaxed) + 1 >= settings.tripAfter;
+	}
+
+	// Requests that failed in a row
+	int Failures() const {
+		return failures.load(std::memory_order_relaxed);
+	}
+
+	// A reopened device may be a different one, with other timing
+	void Reset() {
+		smoothed.store(0, std::memory_order_relaxed);
+		deviation.store(0, std::memory_order_relaxed);
+		failures.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	Settings settings;
+	// Written by the device worker and the session thread. A lost update only delays learning.
+	std::atomic<double> smoothed{ 0 };		// ns
+	std::atomic<double> deviation{ 0 };		// ns
+	std::atomic<int> failures{ 0 };
+};
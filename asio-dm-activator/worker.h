@@ -0,0 +1,274 @@
+// Background command execution for the driver classes.
+//
+// The host calls future() from its UI or audio engine thread, so every millisecond
+// spent there is a millisecond the host is stalled. Commands are pushed into a
+// lock-free queue instead and executed in batches on a dedicated worker thread.
+// Nothing here depends on the driver classes, so it can be built and run on any OS.
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <span>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+
+
+// The driver classes are promoted by copying, so their atomic members must be copyable.
+// Copying is not atomic as a whole; it only happens before the driver is patched.
+template <typename T>
+struct CopyableAtomic : std::atomic<T> {
+	CopyableAtomic(T value = T{}) : std::atomic<T>(value) {}
+	CopyableAtomic(const CopyableAtomic& x) : std::atomic<T>(x.load()) {}
+	CopyableAtomic& operator=(const CopyableAtomic& x) { this->store(x.load()); return *this; }
+	using std::atomic<T>::operator=;
+};
+
+
+// Bounded multi-producer single-consumer queue (D. Vyukov's array-based design).
+// Push() never blocks and never allocates; it fails when the queue is full.
+template <typename T, size_t Capacity>
+class MpscQueue {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr size_t mask = Capacity - 1;
+
+	struct alignas(64) Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells = std::make_unique<Cell[]>(Capacity);
+	alignas(64) std::atomic<size_t> head{ 0 };	// next position to be written by producers
+	alignas(64) size_t tail{ 0 };				// next position to be read by the consumer
+
+public:
+	MpscQueue() {
+		for (size_t i = 0; i < Capacity; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Any thread. Returns the 1-based queue position of the item or 0 if the queue is full.
+	uint64_t Push(const T& value) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return pos + 1;
+				}
+			}
+			else if (diff < 0)
+				return 0;
+			else
+				pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Consumer thread only
+	bool Pop(T& value) {
+		Cell& cell = cells[tail & mask];
+		if (cell.sequence.load(std::memory_order_acquire) != tail + 1)
+			return false;
+		value = cell.data;
+		cell.sequence.store(tail + Capacity, std::memory_order_release);
+		tail++;
+		return true;
+	}
+
+	// Consumer thread only
+	bool Empty() const {
+		return cells[tail & mask].sequence.load(std::memory_order_acquire) != tail + 1;
+	}
+};
+
+
+// Commands that must be started by a certain time have a deadline member, zero if not
+template <typename Command>
+concept HasDeadline = requires(const Command& c) {
+	{ c.deadline } -> std::convertible_to<std::chrono::steady_clock::time_point>;
+};
+
+
+// A single thread that executes queued commands in submission order.
+// Commands arriving within the debounce window of each other are handed over to the
+// handler as one batch, so it can merge them. The window is restarted by every new
+// command but never stretches beyond maxDelay from the first one, or the deadline of
+// any command in it.
+// The handler returns a driver status code; anything but successCode counts as a failure
+// of the whole batch. The optional idle handler runs every idlePeriod while the queue is
+// empty, the first time right after the worker starts. The thread runs at audio priority
+// unless elevated is false.
+template <typename Command, size_t Capacity = 256>
+class CommandWorker {
+public:
+	using Handler = std::function<long(std::span<Command>)>;
+	using IdleHandler = std::function<void()>;
+	using Clock = std::chrono::steady_clock;
+
+	struct Status {
+		uint64_t submitted{};	// accepted by Submit()
+		uint64_t completed{};	// executed, successfully or not
+		uint64_t failed{};		// executed with an error
+		uint64_t rejected{};	// not accepted because the queue was full
+		long lastResult{};		// result of the most recent command
+	};
+
+	CommandWorker(Handler handler, long successCode, std::chrono::milliseconds debounce = {}, std::chrono::milliseconds maxDelay = {},
+		IdleHandler idleHandler = {}, std::chrono::milliseconds idlePeriod = {}, bool elevated = true)
+		: handler(std::move(handler)), successCode(successCode), debounce(debounce), maxDelay(std::max(debounce, maxDelay)),
+		  idleHandler(std::move(idleHandler)), idlePeriod(idlePeriod) {
+		batch.reserve(Capacity);
+		thread = std::thread([this, elevated] { Run(elevated); });
+	}
+
+	~CommandWorker() {
+		running.store(false);
+		Wake();
+		if (thread.joinable()) thread.join();
+	}
+
+	CommandWorker(const CommandWorker&) = delete;
+	CommandWorker& operator=(const CommandWorker&) = delete;
+
+	// Any thread, never blocks. Returns a ticket for IsDone() or 0 if the command was rejected.
+	uint64_t Submit(const Command& command) {
+		uint64_t ticket = queue.Push(command);
+		if (!ticket) {
+			rejected.fetch_add(1, std::memory_order_relaxed);
+			return 0;
+		}
+		submitted.fetch_add(1, std::memory_order_relaxed);
+		Wake();
+		return ticket;
+	}
+
+	// True once the command with this ticket (and everything queued before it) was executed
+	bool IsDone(uint64_t ticket) const {
+		return completed.load(std::memory_order_acquire) >= ticket;
+	}
+
+	Status GetStatus() const {
+		Status s;
+		s.submitted = submitted.load(std::memory_order_relaxed);
+		s.completed = completed.load(std::memory_order_acquire);
+		s.failed = failed.load(std::memory_order_relaxed);
+		s.rejected = rejected.load(std::memory_order_relaxed);
+		s.lastResult = lastResult.load(std::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	MpscQueue<Command, Capacity> queue;
+	Handler handler;
+	long successCode;
+	Clock::duration debounce;
+	Clock::duration maxDelay;
+	IdleHandler idleHandler;
+	Clock::duration idlePeriod;
+	std::vector<Command> batch;	// worker thread only
+
+	std::atomic<uint64_t> submitted{ 0 };
+	std::atomic<uint64_t> completed{ 0 };
+	std::atomic<uint64_t> failed{ 0 };
+	std::atomic<uint64_t> rejected{ 0 };
+	std::atomic<long> lastResult{ 0 };
+
+	// Producers only touch the mutex when the worker is actually asleep
+	std::atomic<bool> running{ true };
+	std::atomic<bool> parked{ false };
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	std::thread thread;
+
+	void Wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (parked.load(std::memory_order_seq_cst) || !running.load()) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCondition.notify_one();
+		}
+	}
+
+	void Run(bool elevated) {
+		if (elevated) ElevatePriority();
+		Command command;
+		auto nextIdle = Clock::now();
+		while (running.load()) {
+			if (!queue.Pop(command)) {
+				if (!idleHandler) {
+					Park(std::nullopt);
+					continue;
+				}
+				if (Clock::now() >= nextIdle) {
+					idleHandler();
+					nextIdle = Clock::now() + idlePeriod;
+				}
+				Park(nextIdle);
+				continue;
+			}
+
+			// Collect everything that arrives within the debounce window
+			batch.clear();
+			batch.push_back(command);
+			auto first = Clock::now();
+			auto due = Clock::time_point::max();
+			auto windowEnd = std::min(first + debounce, Due(command, due));
+			while (batch.size() < Capacity) {
+				if (queue.Pop(command)) {
+					batch.push_back(command);
+					windowEnd = std::min({ Clock::now() + debounce, first + maxDelay, Due(command, due) });
+					continue;
+				}
+				if (Clock::now() >= windowEnd || !running.load()) break;
+				Park(windowEnd);
+			}
+
+			long result = handler(std::span<Command>(batch));
+			lastResult.store(result, std::memory_order_relaxed);
+			if (result != successCode) failed.fetch_add(batch.size(), std::memory_order_relaxed);
+			completed.fetch_add(batch.size(), std::memory_order_release);
+		}
+	}
+
+	// Earliest deadline of the batch so far
+	static Clock::time_point Due(const Command& command, Clock::time_point& due) {
+		if constexpr (HasDeadline<Command>)
+			if (command.deadline != Clock::time_point{}) due = std::min(due, Clock::time_point(command.deadline));
+		return due;
+	}
+
+	// Sleep until a command arrives or the deadline passes
+	void Park(std::optional<Clock::time_point> deadline) {
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		parked.store(true, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (queue.Empty() && running.load()) {
+			if (deadline) sleepCondition.wait_until(lock, *deadline);
+			else sleepCondition.wait(lock);
+		}
+		parked.store(false, std::memory_order_relaxed);
+	}
+
+	// USB control transfers are short but latency sensitive, run them like audio work
+	static void ElevatePriority() {
+	#ifdef _WIN32
+		using AvSetMmThreadCharacteristicsFunction = HANDLE(WINAPI*)(LPCWSTR, LPDWORD);
+		DWORD taskIndex = 0;
+		if (HMODULE avrt = LoadLibraryW(L"avrt.dll"))
+			if (auto func = (AvSetMmThreadCharacteristicsFunction)GetProcAddress(avrt, "AvSetMmThreadCharacteristicsW"))
+				if (func(L"Pro Audio", &taskIndex))
+					return;
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	#endif
+	}
+};
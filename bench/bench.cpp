@@ -0,0 +1,174 @@
+// Microbenchmarks for what the plugin costs the host.
+//
+// The plugin only builds for Windows, but the parts that run when the host calls it
+// don't depend on it: the generated future() stub, the command worker, the command
+// path of monitor.h, the shadow mixer and the device profiles. This program runs them
+// on any x86-64 OS, with the TUSBAUDIO API replaced by a stub that takes a configurable
+// time per USB request.
+//
+// Build and run:
+//     g++ -std=c++20 -O2 -pthread bench/bench.cpp -o asio-dm-bench
+//     ./asio-dm-bench --label v1.2 --out results.jsonl
+//
+// Options:
+//     --samples N          samples per benchmark (2000)
+//     --usb-latency-us N   time one control request takes (125)
+//     --tracks N           commands per burst (32)
+//     --label TEXT         stored with the results, e.g. the release
+//     --out FILE           append the results to a file instead of printing them
+//
+// Each benchmark writes one JSON object per line: percentiles of the samples in
+// nanoseconds, plus the parameters, so results of two releases can be compared.
+
+#include "common.h"
+#include "../asio-dm-activator/thunk.h"
+#include "../asio-dm-activator/hooks.h"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+
+// Time calls in groups, a single one is shorter than what the clock resolves
+template <typename F>
+std::vector<double> Measure(int samples, int callsPerSample, F&& call) {
+	std::vector<double> result;
+	result.reserve(samples);
+	for (int i = 0; i < samples; i++) {
+		auto start = Clock::now();
+		for (int j = 0; j < callsPerSample; j++) call(j);
+		result.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / callsPerSample);
+	}
+	return result;
+}
+
+
+// ---- future() --------------------------------------------------------------
+
+// A driver without direct monitoring
+NOINLINE long MSABI DriverFuture(void* /*iasio*/, long selector, void* /*params*/) {
+	return selector == kAsioCanInputMonitor || selector == kAsioSetInputMonitor ? ASE_InvalidParameter : ASE_SUCCESS;
+}
+
+struct FutureContext {
+	uintptr_t original{};
+};
+
+// AsioDriver::FutureFunctionReplacement, without the command itself
+NOINLINE long MSABI FutureReplacement(FutureContext* self, void* iasio, long selector, void* params) {
+	if (!self->original) return ASE_NotPresent;
+	if (auto result = monitor::Future(selector, params, [](ASIOInputMonitor*) { return (long)ASE_SUCCESS; }))
+		return *result;
+	return ((long(MSABI*)(void*, long, void*))self->original)(iasio, selector, params);
+}
+
+void BenchFuture(const Options& options, Report& report) {
+#if defined(__x86_64__) || defined(_M_X64)
+	using Future = long(MSABI*)(void*, long, void*);
+	static ThunkArena arena;
+	static FutureContext context;
+	context.original = (uintptr_t)&DriverFuture;
+	long selectors[] = { kAsioCanInputMonitor, kAsioSetInputMonitor };
+	auto code = thunk::FutureFilter((uintptr_t)&context, (uintptr_t)&FutureReplacement, context.original, selectors);
+	auto stub = (Future)arena.Add(code);
+	if (!stub) {
+		std::cerr << "Unable to set up the stub\n";
+		return;
+	}
+
+	// The host calls through the driver's vtable, so do the same
+	volatile Future direct = &DriverFuture, patched = stub;
+	volatile long sink = 0;
+	const int calls = 1000;
+	report.Add("future.direct", Measure(options.samples, calls, [&](int) { sink = direct(nullptr, kAsioGetInternalBufferSamples, nullptr); }));
+	report.Add("future.passthrough", Measure(options.samples, calls, [&](int) { sink = patched(nullptr, kAsioGetInternalBufferSamples, nullptr); }));
+	report.Add("future.hooked", Measure(options.samples, calls, [&](int) { sink = patched(nullptr, kAsioCanInputMonitor, nullptr); }));
+#else
+	std::cerr << "future(): the stub is x86-64 code, skipped\n";
+#endif
+}
+
+
+// From future(kAsioSetInputMonitor) returning to the level being set on the device
+void BenchSetInputMonitor(const Options& options, Report& report) {
+	Device device(DeviceDatabase::BuiltIn[7], 16);	// iD14 mk2
+	CommandWorker<ASIOInputMonitor> worker([&](std::span<ASIOInputMonitor> batch) { return device.Execute(batch); }, ASE_SUCCESS);
+
+	std::vector<double> samples;
+	for (int i = 0; i < options.samples; i++) {
+		ASIOInputMonitor command{ i % 16, 0, 0x20000000, (i / 16) % 2, 0x3fffffff };
+		auto start = Clock::now();
+		uint64_t ticket = worker.Submit(command);
+		WaitFor(worker, ticket);
+		samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+	}
+	report.Add("set_input_monitor", samples, "\"requests_per_command\":2");
+}
+
+
+void BenchChannelIndex(const Options& options, Report& report) {
+	DeviceDatabase database;
+	std::mt19937 random(1);
+	std::vector<uint64_t> models;
+	for (int i = 0; i < 1024; i++)
+		models.push_back(i % 8 ? DeviceDatabase::BuiltIn[random() % DeviceDatabase::BuiltIn.size()].model : random());
+	Device device(DeviceDatabase::BuiltIn[7], 16);
+	volatile int sink = 0;
+
+	report.Add("channel_index", Measure(options.samples, 1000, [&](int j) { sink = device.GetVirtualChannelIndex(j % 16); }));
+	report.Add("profile_find", Measure(options.samples, 1000, [&](int j) { sink = database.Find(models[j % models.size()]).Stride(); }));
+}
+
+
+// All tracks toggled at once, as when the host arms or disarms a whole selection.
+// Goes through both stages the plugin has: the driver worker with its debounce window,
+// which merges the burst, and the worker of the device.
+void BenchBurst(const Options& options, Report& report) {
+	const int inputs = std::min(options.tracks, ShadowMixer::MaxChannels);
+	Device device(DeviceDatabase::BuiltIn[10], inputs);	// iD44 mk2
+	CommandWorker<ASIOInputMonitor> deviceWorker([&](std::span<ASIOInputMonitor> batch) { return device.Execute(batch); }, ASE_SUCCESS);
+	uint64_t forwarded = 0;
+	CommandWorker<ASIOInputMonitor> driverWorker([&](std::span<ASIOInputMonitor> batch) {
+			for (auto& command : monitor::Coalesce<ASIOInputMonitor>(batch, inputs)) forwarded = deviceWorker.Submit(command);
+			return (long)ASE_SUCCESS;
+		}, ASE_SUCCESS, std::chrono::milliseconds(5), std::chrono::milliseconds(20));
+
+	std::vector<double> samples;
+	int bursts = std::max(10, options.samples / 20);	// each one takes milliseconds
+	for (int i = 0; i < bursts; i++) {
+		auto start = Clock::now();
+		uint64_t ticket = 0;
+		for (int track = 0; track < options.tracks; track++)
+			ticket = driverWorker.Submit({ track % inputs, 0, 0x20000000, i % 2, 0x3fffffff });
+		WaitFor(driverWorker, ticket);
+		WaitFor(deviceWorker, forwarded);
+		samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+	}
+	std::sort(samples.begin(), samples.end());
+	double perSecond = options.tracks / (samples[samples.size() / 2] / 1e9);
+	report.Add("burst", samples, "\"tracks\":" + std::to_string(options.tracks) + ",\"commands_per_second\":" + std::to_string((long long)perSecond));
+}
+
+
+int main(int argc, char** argv) {
+	Options options;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string name = argv[i], value = argv[i + 1];
+		if (name == "--samples") options.samples = std::max(10, std::atoi(value.c_str()));
+		else if (name == "--usb-latency-us") options.usbLatencyUs = std::max(0, std::atoi(value.c_str()));
+		else if (name == "--tracks") options.tracks = std::max(1, std::atoi(value.c_str()));
+		else if (name == "--label") options.label = value;
+		else if (name == "--out") options.out = value;
+		else {
+			std::cerr << "Unknown option " << name << "\n";
+			return 2;
+		}
+	}
+	stub::device.latency = std::chrono::microseconds(options.usbLatencyUs);
+
+	Report report(options);
+	BenchFuture(options, report);
+	BenchChannelIndex(options, report);
+	BenchSetInputMonitor(options, report);
+	BenchBurst(options, report);
+	return report.Write() ? 0 : 1;
+}
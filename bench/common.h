@@ -0,0 +1,130 @@
+// What the benchmarks and the replay have in common: the plugin's command path on the
+// stub TUSBAUDIO API, and the JSON report.
+
+#pragma once
+#include "../asio-dm-activator/worker.h"
+#include "../asio-dm-activator/monitor.h"
+#include "tusbaudio_stub.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+
+#ifdef _WIN32
+#define MSABI
+#define NOINLINE __declspec(noinline)
+#else
+#define MSABI __attribute__((ms_abi))	// the generated code follows the Windows calling convention
+#define NOINLINE __attribute__((noinline))
+#endif
+
+const int kAsioGetInternalBufferSamples = 1010;	// a selector hosts send often and the plugin doesn't handle
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Options {
+	int samples = 2000;
+	int usbLatencyUs = 125;
+	int tracks = 32;
+	std::string label;
+	std::string out;
+};
+
+
+class Report {
+public:
+	Report(const Options& options) : options(options) {
+		for (char c : options.label)
+			label += (c == '"' || c == '\\') ? std::string("\\") + c : std::string(1, c);
+	}
+
+	// Samples in nanoseconds. Extra is added to the JSON object as it is, e.g. "\"x\":1".
+	void Add(const std::string& name, std::vector<double> samples, const std::string& extra = {}) {
+		std::sort(samples.begin(), samples.end());
+		double sum = 0;
+		for (double s : samples) sum += s;
+		auto at = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+
+		std::ostringstream line;
+		line.precision(1);
+		line << std::fixed << "{\"name\":\"" << name << "\",\"label\":\"" << label << "\",\"unit\":\"ns\""
+			<< ",\"samples\":" << samples.size() << ",\"mean\":" << sum / samples.size()
+			<< ",\"min\":" << samples.front() << ",\"p50\":" << at(0.5) << ",\"p90\":" << at(0.9)
+			<< ",\"p99\":" << at(0.99) << ",\"p999\":" << at(0.999) << ",\"max\":" << samples.back()
+			<< ",\"usb_latency_us\":" << options.usbLatencyUs;
+		if (!extra.empty()) line << "," << extra;
+		line << "}\n";
+		lines += line.str();
+		std::cerr << name << ": p50 " << at(0.5) << " ns, p99 " << at(0.99) << " ns\n";
+	}
+
+	bool Write() const {
+		if (options.out.empty()) {
+			std::cout << lines;
+			return true;
+		}
+		std::ofstream out(options.out, std::ios::app);
+		return (bool)(out << lines);
+	}
+
+private:
+	const Options& options;
+	std::string label;	// escaped for JSON
+	std::string lines;
+};
+
+
+// ---- Device ----------------------------------------------------------------
+
+// ThesyconDevice::SetInputMonitor without the device session, the gain engine and the
+// statistics, on the stub API
+class Device {
+public:
+	DeviceProfile profile;
+	ShadowMixer shadow;
+	tusbaudio::Api api = stub::Api();
+	bool follow = false;	// ASIO_DM_ACTIVATOR_MONITOR=follow
+
+	Device(const DeviceProfile& profile, int inputs) : profile(profile) {
+		shadow.SetSize(inputs);
+		for (int i = 0; i < inputs; i++) shadow.Update(i, { 0, 0 });
+	}
+
+	NOINLINE uint8_t GetVirtualChannelIndex(uint8_t channel) {
+		return (uint8_t)monitor::Crosspoint(profile, channel);
+	}
+
+	long SetInputMonitor(const ASIOInputMonitor& params) {
+		if (!shadow.Contains(params.input) || !monitor::IsAddressable(profile, params.input)) return ASE_InvalidParameter;
+		int channel = params.input;
+		auto transfer = [&](bool set, uint8_t at, short* value) { return monitor::ControlRequest(api, 0, profile, set, at, value, 10000); };
+		if (!shadow.IsValid(channel)) {
+			VolPair v{};
+			if (!monitor::GetVol(transfer, profile, channel, v)) shadow.Update(channel, v);
+		}
+		VolPair target = monitor::Target(params, shadow, channel, follow);
+		if (monitor::SetVol(transfer, profile, channel, target)) {
+			shadow.Invalidate(channel);
+			return ASE_HWMalfunction;
+		}
+		shadow.Update(channel, target);
+		return ASE_SUCCESS;
+	}
+
+	long Execute(std::span<ASIOInputMonitor> batch) {
+		long status = ASE_SUCCESS;
+		for (auto& command : batch)
+			if (long result = SetInputMonitor(command); result != ASE_SUCCESS && status == ASE_SUCCESS) status = result;
+		return status;
+	}
+};
+
+
+template <typename Worker>
+void WaitFor(Worker& worker, uint64_t ticket) {
+	while (!worker.IsDone(ticket)) std::this_thread::yield();
+}
@@ -0,0 +1,160 @@
+// Replays a capture of a host's monitoring commands against a simulated device.
+//
+// A capture (ASIO_DM_ACTIVATOR_CAPTURE, see capture.h) has every future() call the
+// plugin handled and every control request it sent, with their timing. This sends the
+// kAsioSetInputMonitor commands again, in the same order and at the same pace or
+// faster, through the plugin's command path: the driver worker that merges bursts,
+// then the device worker that writes the crosspoints to the stub TUSBAUDIO API. Field
+// problems can be reproduced and the command path load-tested without the host or the
+// device. Other selectors never reach a device and are only counted.
+//
+// Build and run:
+//     g++ -std=c++20 -O2 -pthread bench/replay.cpp -o asio-dm-replay
+//     ./asio-dm-replay capture.admt --speed 10
+//
+// Options:
+//     --speed X            1 = as captured, 10 = ten times faster, 0 = as fast as possible (1)
+//     --usb-latency-us N   time one control request takes (median of the captured ones, or 125)
+//     --label TEXT         stored with the results
+//     --out FILE           append the results to a file instead of printing them
+//
+// The results are JSON lines like those of asio-dm-bench: what the calls took when
+// they were captured, and what the replayed ones took from future() to the device.
+
+#include "common.h"
+#include "../asio-dm-activator/capture.h"
+#include <cstdlib>
+#include <thread>
+
+
+struct ReplayCommand : ASIOInputMonitor {
+	Clock::time_point issued;
+};
+
+
+static double Nanoseconds(Clock::duration d) {
+	return std::chrono::duration<double, std::nano>(d).count();
+}
+
+
+// Sleeping alone oversleeps by up to a scheduler tick, spin for the rest
+static void WaitUntil(Clock::time_point due) {
+	if (due - Clock::now() > std::chrono::milliseconds(2))
+		std::this_thread::sleep_until(due - std::chrono::milliseconds(1));
+	while (Clock::now() < due) {}
+}
+
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: asio-dm-replay <capture> [--speed X] [--usb-latency-us N] [--label TEXT] [--out FILE]\n";
+		return 2;
+	}
+	Options options;
+	options.usbLatencyUs = -1;
+	double speed = 1;
+	for (int i = 2; i + 1 < argc; i += 2) {
+		std::string name = argv[i], value = argv[i + 1];
+		if (name == "--speed") speed = std::max(0.0, std::atof(value.c_str()));
+		else if (name == "--usb-latency-us") options.usbLatencyUs = std::max(0, std::atoi(value.c_str()));
+		else if (name == "--label") options.label = value;
+		else if (name == "--out") options.out = value;
+		else {
+			std::cerr << "Unknown option " << name << "\n";
+			return 2;
+		}
+	}
+
+	auto records = Capture::Load(argv[1]);
+	if (!records) {
+		std::cerr << "Not a capture, or from another version: " << argv[1] << "\n";
+		return 1;
+	}
+	// Writers of different threads may have queued them slightly out of order
+	std::stable_sort(records->begin(), records->end(), [](const auto& a, const auto& b) { return a.time < b.time; });
+
+	std::vector<double> capturedFuture, capturedTransfers;
+	int inputs = 1, commands = 0;
+	for (const auto& r : *records) {
+		if (r.kind != CaptureRecord::Future) {
+			capturedTransfers.push_back(r.duration);
+			continue;
+		}
+		capturedFuture.push_back(r.duration);
+		if (r.selector == kAsioSetInputMonitor) {
+			inputs = std::max(inputs, r.params[0] + 1);
+			commands++;
+		}
+	}
+	inputs = std::min<int>(inputs, ShadowMixer::MaxChannels);
+	if (!commands) {
+		std::cerr << "No monitoring commands in the capture\n";
+		return 1;
+	}
+	if (options.usbLatencyUs < 0) {
+		std::sort(capturedTransfers.begin(), capturedTransfers.end());
+		options.usbLatencyUs = capturedTransfers.empty() ? 125 : (int)(capturedTransfers[capturedTransfers.size() / 2] / 1000);
+	}
+	stub::device.latency = std::chrono::microseconds(options.usbLatencyUs);
+
+	Report report(options);
+	std::string extra = "\"speed\":" + std::to_string(speed);
+	report.Add("capture.future", capturedFuture, extra);
+	if (!capturedTransfers.empty()) report.Add("capture.transfer", capturedTransfers, extra);
+
+	// The two stages of the plugin, as in the burst benchmark
+	Device device(DeviceDatabase::BuiltIn[10], inputs);	// iD44 mk2
+	std::vector<double> latencies;	// device worker only
+	CommandWorker<ReplayCommand> deviceWorker([&](std::span<ReplayCommand> batch) {
+			long status = ASE_SUCCESS;
+			for (auto& command : batch) {
+				if (long result = device.SetInputMonitor(command); result != ASE_SUCCESS && status == ASE_SUCCESS) status = result;
+				latencies.push_back(Nanoseconds(Clock::now() - command.issued));
+			}
+			return status;
+		}, ASE_SUCCESS);
+	uint64_t forwarded = 0;
+	CommandWorker<ReplayCommand> driverWorker([&](std::span<ReplayCommand> batch) {
+			for (auto& command : monitor::Coalesce<ReplayCommand>(batch, inputs))
+				if (auto ticket = deviceWorker.Submit(command)) forwarded = ticket;
+			return (long)ASE_SUCCESS;
+		}, ASE_SUCCESS, std::chrono::milliseconds(5), std::chrono::milliseconds(20));
+
+	std::vector<double> submits;
+	submits.reserve(commands);
+	double behind = 0;	// how late the replay was at worst
+	uint64_t ticket = 0;
+	uint64_t first = records->front().time, last = first;
+	auto start = Clock::now();
+	for (const auto& r : *records) {
+		if (r.kind != CaptureRecord::Future || r.selector != kAsioSetInputMonitor) continue;
+		last = r.time;
+		if (speed > 0) {
+			auto due = start + std::chrono::nanoseconds((int64_t)((r.time - first) / speed));
+			WaitUntil(due);
+			behind = std::max(behind, Nanoseconds(Clock::now() - due));
+		}
+		ReplayCommand command{};
+		command.input = r.params[0];
+		command.output = r.params[1];
+		command.gain = r.params[2];
+		command.state = r.params[3];
+		command.pan = r.params[4];
+		command.issued = Clock::now();
+		if (auto t = driverWorker.Submit(command)) ticket = t;
+		submits.push_back(Nanoseconds(Clock::now() - command.issued));
+	}
+	WaitFor(driverWorker, ticket);
+	WaitFor(deviceWorker, forwarded);
+	double elapsed = Nanoseconds(Clock::now() - start);
+
+	auto d = driverWorker.GetStatus(), w = deviceWorker.GetStatus();
+	uint64_t rejected = d.rejected + w.rejected;
+	extra += ",\"commands\":" + std::to_string(commands) + ",\"executed\":" + std::to_string(latencies.size())
+		+ ",\"rejected\":" + std::to_string(rejected) + ",\"coalesced\":" + std::to_string(commands - rejected - latencies.size())
+		+ ",\"inputs\":" + std::to_string(inputs) + ",\"captured_ms\":" + std::to_string((last - first) / 1000000)
+		+ ",\"replayed_ms\":" + std::to_string((uint64_t)(elapsed / 1e6)) + ",\"max_behind_ns\":" + std::to_string((uint64_t)behind);
+	report.Add("replay.future", submits, extra);
+	if (!latencies.empty()) report.Add("replay.set_input_monitor", latencies, extra);
+	return report.Write() ? 0 : 1;
+}
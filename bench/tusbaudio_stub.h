@@ -0,0 +1,59 @@
+// Stand-in for the TUSBAUDIO API of Thesycon drivers, for the benchmarks.
+//
+// The functions have the signatures the plugin calls. The device is just an array of
+// mixer crosspoints, and every control request takes as long as a USB round trip is
+// set to take. Waiting is done by spinning, sleeping is far too coarse for this.
+
+#pragma once
+#include "../asio-dm-activator/monitor.h"
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+
+
+namespace stub {
+
+	struct Device {
+		std::array<short, 256> crosspoints{};		// 1/256 dB, by virtual channel index
+		std::chrono::nanoseconds latency{ 125000 };	// per control request
+		long failWith{};							// result of every request, 0 = success
+		std::atomic<uint64_t> requests{ 0 };
+	};
+
+	inline Device device;
+
+	inline void Wait(std::chrono::nanoseconds duration) {
+		auto end = std::chrono::steady_clock::now() + duration;
+		while (std::chrono::steady_clock::now() < end) {}
+	}
+
+	inline long AudioControlRequestGet(long /*deviceHandle*/, long /*entityID*/, long /*request*/, long /*controlSelector*/,
+		char channelOrMixerControl, void* paramBlock, long /*paramBlockLength*/, long* bytesTransferred, long /*timeoutMillisecs*/) {
+		device.requests.fetch_add(1, std::memory_order_relaxed);
+		Wait(device.latency);
+		if (device.failWith) return device.failWith;
+		memcpy(paramBlock, &device.crosspoints[(uint8_t)channelOrMixerControl], 2);
+		if (bytesTransferred) *bytesTransferred = 2;
+		return 0;
+	}
+
+	inline long AudioControlRequestSet(long /*deviceHandle*/, long /*entityID*/, long /*request*/, long /*controlSelector*/,
+		char channelOrMixerControl, void* paramBlock, long /*paramBlockLength*/, long* bytesTransferred, long /*timeoutMillisecs*/) {
+		device.requests.fetch_add(1, std::memory_order_relaxed);
+		Wait(device.latency);
+		if (device.failWith) return device.failWith;
+		memcpy(&device.crosspoints[(uint8_t)channelOrMixerControl], paramBlock, 2);
+		if (bytesTransferred) *bytesTransferred = 2;
+		return 0;
+	}
+
+	// The entry points the plugin resolves, those the stub has
+	inline tusbaudio::Api Api() {
+		tusbaudio::Api api;
+		api.audioControlRequestGet = AudioControlRequestGet;
+		api.audioControlRequestSet = AudioControlRequestSet;
+		return api;
+	}
+}
@@ -0,0 +1,33 @@
+// What the tests have in common: a check that reports the failing expression and goes
+// on with the next one, and the summary that makes the exit code.
+
+#pragma once
+#include <iostream>
+#include <string>
+
+
+inline int g_checks = 0;
+inline int g_failures = 0;
+
+#define CHECK(x) do { \
+		g_checks++; \
+		if (!(x)) { \
+			g_failures++; \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #x ") failed\n"; \
+		} \
+	} while (0)
+
+
+// Runs a group of checks under a name, so a failure can be found in the output
+template <typename F>
+void Test(const std::string& name, F&& test) {
+	int before = g_failures;
+	test();
+	std::cerr << (g_failures == before ? "ok     " : "FAILED ") << name << "\n";
+}
+
+
+inline int Summary() {
+	std::cerr << g_checks - g_failures << " of " << g_checks << " checks passed\n";
+	return g_failures ? 1 : 0;
+}
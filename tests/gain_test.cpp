@@ -0,0 +1,219 @@
+// Tests of the gain law and the gain engine (gain.h).
+//
+// The law is checked against the formulas its tables are made from: levels in 1/256 dB
+// for ASIO gains, and the balance law of the pan. The engine runs on a shadow mixer
+// that stands for the device, with the clock given by the test, so its rate limit and
+// ramps are checked step by step.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -fsanitize=address,undefined tests/gain_test.cpp -o gain-test
+//     ./gain-test
+
+#include "check.h"
+#include "../asio-dm-activator/gain.h"
+#include <cmath>
+#include <vector>
+
+
+const short MinusInf = ShadowMixer::MinusInf.L;
+const long Right = 0x7fffffff;
+const VolPair Zero = { 0, 0 };
+
+// 1/256 dB as the tables compute it
+int Expected(double gain) {
+	return (int)std::lround(20 * std::log10(gain / GainLaw::Unity) * 256);
+}
+
+// A device at 0 dB on every channel
+void AtZero(ShadowMixer& shadow) {
+	shadow.SetSize(ShadowMixer::MaxChannels);
+	for (int i = 0; i < ShadowMixer::MaxChannels; i++) shadow.Update(i, Zero);
+}
+
+
+int main() {
+	Test("unity and zero gain", [] {
+		CHECK(GainLaw::Level(GainLaw::Unity) == 0);
+		CHECK(GainLaw::ToDevice(GainLaw::Unity, GainLaw::Center) == Zero);
+		CHECK(GainLaw::Level(0) == MinusInf && GainLaw::Level(-1) == MinusInf);
+		CHECK(GainLaw::ToDevice(0, GainLaw::Center) == ShadowMixer::MinusInf);
+		CHECK(GainLaw::ToDevice(0, 0) == ShadowMixer::MinusInf);
+	});
+
+	Test("levels", [] {
+		CHECK(std::abs(GainLaw::Level(GainLaw::Unity / 2) - Expected(GainLaw::Unity / 2)) <= 1);	// -6 dB
+		CHECK(std::abs(GainLaw::Level(0x7fffffff) - Expected(0x7fffffff)) <= 1);				// +12 dB
+
+		// Within 1/128 dB of the formula and never falling, from -126 dB up
+		bool close = true, rising = true;
+		int previous = MinusInf;
+		for (double g = 256; g < 0x7fffffff; g *= 1.0007) {
+			int level = GainLaw::Level((long)g);
+			close &= std::abs(level - Expected((double)(long)g)) <= 2;
+			rising &= level >= previous;
+			previous = level;
+		}
+		CHECK(close && rising);
+		CHECK(GainLaw::Level(1) == MinusInf);	// below the device range
+
+		// Above unity the crosspoints stay at 0 dB
+		CHECK(GainLaw::ToDevice(GainLaw::Unity * 2, GainLaw::Center) == Zero);
+		CHECK(GainLaw::ToDevice(0x7fffffff, GainLaw::Center) == Zero);
+		VolPair half = GainLaw::ToDevice(GainLaw::Unity / 2, GainLaw::Center);
+		CHECK(half.L == GainLaw::Level(GainLaw::Unity / 2) && half.R == half.L);
+	});
+
+	Test("pan", [] {
+		CHECK(GainLaw::ToDevice(GainLaw::Unity, 0) == (VolPair{ 0, MinusInf }));		// hard left
+		CHECK(GainLaw::ToDevice(GainLaw::Unity, Right) == (VolPair{ MinusInf, 0 }));	// hard right
+		CHECK(GainLaw::ToDevice(GainLaw::Unity, -5) == GainLaw::ToDevice(GainLaw::Unity, 0));
+
+		// Half way to the right, the left side is at the constant-power level
+		VolPair quarter = GainLaw::ToDevice(GainLaw::Unity, 0x5fffffff);
+		double amplitude = std::sqrt(2.0) * std::sin(3.14159265358979323846 / 8);
+		CHECK(quarter.R == 0 && std::abs(quarter.L - std::lround(20 * std::log10(amplitude) * 256)) <= 1);
+
+		// From the center to the right the left side only falls, the right one stays
+		bool falling = true, kept = true;
+		short previous = 0;
+		for (long pan = GainLaw::Center; pan < Right; pan += 0x100000) {
+			VolPair v = GainLaw::ToDevice(GainLaw::Unity, pan);
+			falling &= v.L <= previous;
+			kept &= v.R == 0;
+			previous = v.L;
+		}
+		CHECK(falling && kept);
+
+		// Mirrored
+		bool mirrored = true;
+		for (long pan = 0; pan < GainLaw::Center; pan += 0x1000000) {
+			VolPair a = GainLaw::ToDevice(GainLaw::Unity / 3, pan), b = GainLaw::ToDevice(GainLaw::Unity / 3, Right - pan);
+			mirrored &= a.L == b.R && a.R == b.L;
+		}
+		CHECK(mirrored);
+	});
+
+	Test("the newest target replaces a stale one", [] {
+		GainEngine engine({ 10, 1, 0 });	// one write per 100 ms, no ramps
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+
+		engine.SetTarget(3, { -256, -256 });
+		auto first = engine.Next(shadow, t0);
+		CHECK(first && first->vol == (VolPair{ -256, -256 }) && first->last);
+		shadow.Update(3, first->vol);
+
+		// Many targets inside one rate window, one write of the newest
+		for (int i = 1; i <= 20; i++) engine.SetTarget(3, { (short)(-256 * i), (short)(-128 * i) }, 1000 + i, 2000 + i);
+		CHECK(!engine.Next(shadow, t0 + std::chrono::milliseconds(50)));
+		CHECK(engine.Wait(t0 + std::chrono::milliseconds(50)) > GainEngine::Clock::duration{});
+		CHECK(engine.Pending());
+		int writes = 0;
+		std::optional<GainEngine::Step> step;
+		for (int ms = 100; ms <= 1000; ms += 100)
+			if (auto s = engine.Next(shadow, t0 + std::chrono::milliseconds(ms))) {
+				writes++;
+				step = s;
+				shadow.Update(s->channel, s->vol);
+			}
+		CHECK(writes == 1);
+		CHECK(step && step->channel == 3 && step->vol == (VolPair{ -256 * 20, -128 * 20 }) && step->last);
+		CHECK(step && step->issued == 1020 && step->due == 2020);
+		CHECK(!engine.Pending());
+	});
+
+	Test("rate limit", [] {
+		GainEngine engine({ 100, 4, 0 });
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+		for (int ch = 0; ch < 8; ch++) engine.SetTarget(ch, { -512, -512 });
+
+		int burst = 0;
+		while (auto s = engine.Next(shadow, t0)) burst++;
+		CHECK(burst == 4);
+		CHECK(!engine.Next(shadow, t0 + std::chrono::milliseconds(5)));
+		CHECK(engine.Next(shadow, t0 + std::chrono::milliseconds(10)));
+		auto wait = engine.Wait(t0 + std::chrono::milliseconds(10));
+		CHECK(wait > std::chrono::milliseconds(9) && wait <= std::chrono::milliseconds(10));
+	});
+
+	Test("a target the device has costs nothing", [] {
+		GainEngine engine({ 10, 1, 0 });
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+		engine.SetTarget(1, Zero);
+		CHECK(!engine.Next(shadow, t0) && !engine.Pending());
+		engine.SetTarget(2, { -1, -1 });
+		CHECK(engine.Next(shadow, t0));	// the token is still there
+	});
+
+	Test("a ramp ends on the target", [] {
+		GainEngine engine({ 100000, 1000, 0x300 });
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+		const VolPair target = { -0x1000, -0x0800 };
+		engine.SetTarget(5, target, 7, 8);
+
+		std::vector<GainEngine::Step> steps;
+		while (auto s = engine.Next(shadow, t0)) {
+			VolPair from = shadow.Current(5);
+			CHECK(std::abs(s->vol.L - from.L) <= 0x300 && std::abs(s->vol.R - from.R) <= 0x300);
+			shadow.Update(s->channel, s->vol);
+			steps.push_back(*s);
+			if (steps.size() > 100) break;
+		}
+		CHECK(steps.size() == 6);	// 0x1000 / 0x300, rounded up
+		CHECK(!steps.empty() && steps.back().vol == target && steps.back().last);
+		bool lastOnlyAtEnd = true;
+		for (size_t i = 0; i + 1 < steps.size(); i++) lastOnlyAtEnd &= !steps[i].last;
+		CHECK(lastOnlyAtEnd);
+		CHECK(shadow.Current(5) == target && !engine.Pending());
+
+		// Muting and unknown levels don't ramp
+		engine.SetTarget(5, ShadowMixer::MinusInf);
+		auto mute = engine.Next(shadow, t0);
+		CHECK(mute && mute->vol == ShadowMixer::MinusInf && mute->last);
+		shadow.Invalidate(6);
+		engine.SetTarget(6, target);
+		auto unknown = engine.Next(shadow, t0);
+		CHECK(unknown && unknown->vol == target && unknown->last);
+	});
+
+	Test("a new target during a ramp", [] {
+		GainEngine engine({ 100000, 1000, 0x300 });
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+		engine.SetTarget(0, { -0x2000, -0x2000 });
+		auto s = engine.Next(shadow, t0);
+		CHECK(s && !s->last);
+		shadow.Update(0, s->vol);
+		engine.SetTarget(0, { -0x100, -0x100 });	// back up, close to where it is now
+		s = engine.Next(shadow, t0);
+		CHECK(s && s->vol == (VolPair{ -0x100, -0x100 }) && s->last);
+	});
+
+	Test("channels take turns", [] {
+		GainEngine engine({ 100000, 1000, 0x300 });
+		ShadowMixer shadow;
+		AtZero(shadow);
+		auto t0 = GainEngine::Clock::now();
+		engine.SetTarget(1, { -0x1000, -0x1000 });
+		engine.SetTarget(2, { -0x1000, -0x1000 });
+		std::vector<int> order;
+		while (auto s = engine.Next(shadow, t0)) {
+			order.push_back(s->channel);
+			shadow.Update(s->channel, s->vol);
+		}
+		CHECK(order.size() == 12);
+		bool alternating = true;
+		for (size_t i = 1; i < order.size(); i++) alternating &= order[i] != order[i - 1];
+		CHECK(alternating);
+	});
+
+	return Summary();
+}
@@ -0,0 +1,272 @@
+// Tests of the logger (log.h).
+//
+// Messages are written as the plugin's call sites write them and collected by a sink
+// that keeps the lines, with Flush() called by the test instead of the logger thread
+// where the order matters. The checks cover the formatting of the arguments, text that
+// continues in the records after its own and text that is cut, a full ring dropping
+// and counting, messages of several threads in timestamp order, levels, and the
+// stderr and file sinks.
+//
+// Needs a standard library with <format> (GCC 13, Clang 17 with libc++, MSVC).
+// Build and run:
+//     g++ -std=c++20 -O1 -g -pthread -fsanitize=address,undefined tests/log_test.cpp -o log-test
+//     ./log-test
+
+#include "check.h"
+#include "../asio-dm-activator/log.h"
+#include <sstream>
+
+
+// The lines a logger delivered
+struct Capture {
+	std::shared_ptr<std::vector<LogLine>> lines = std::make_shared<std::vector<LogLine>>();
+
+	Logger::Sink Sink() const {
+		return [lines = lines](const LogLine& line) { lines->push_back(line); };
+	}
+
+	std::vector<std::wstring> Texts() const {
+		std::vector<std::wstring> texts;
+		for (const auto& line : *lines) texts.push_back(line.text);
+		return texts;
+	}
+};
+
+// Text that shows where it was cut: a run of letters, each position its own
+std::wstring Text(size_t length) {
+	std::wstring text;
+	for (size_t i = 0; i < length; i++) text += (wchar_t)(L'a' + i % 26);
+	return text;
+}
+
+
+int main() {
+	Test("arguments", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		std::wstring name = L"iD14";
+		int value = -42;
+		log.Write(LogLevel::Debug, 1, L"{} {} {} {} {}", value, 7u, 1.5, true, name);
+		log.Write(LogLevel::Debug, 2, L"{:>5}|{:x}|{:04}|{{}}", 12, 255u, 7);
+		log.Write(LogLevel::Debug, 3, L"{} {} {}", L"wide", std::wstring_view(L"view"), LogLevel::Error);
+		log.Write(LogLevel::Debug, 4, L"no arguments");
+		log.Write(LogLevel::Debug, 5, L"{} {}", 1);		// a field without argument stays empty
+		log.Flush();
+		CHECK(capture.Texts() == (std::vector<std::wstring>{
+			L"-42 7 1.5 true iD14", L"   12|ff|0007|{}", L"wide view 3", L"no arguments", L"1 " }));
+		CHECK(capture.lines->size() == 5 && capture.lines->at(1).line == 2 && capture.lines->at(1).level == LogLevel::Debug);
+	});
+
+	Test("text longer than a record", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		for (size_t length : { (size_t)Logger::TextSize - 1, (size_t)Logger::TextSize, (size_t)Logger::TextSize + 1, (size_t)500 })
+			log.Write(LogLevel::Debug, 1, L"<{}>", Text(length));
+		log.Write(LogLevel::Debug, 2, L"{}|{}|{}", Text(100), 5, Text(100));	// the second text starts in the first record
+		log.Write(LogLevel::Debug, 3, L"after");
+		log.Flush();
+		CHECK(capture.Texts() == (std::vector<std::wstring>{
+			L"<" + Text(Logger::TextSize - 1) + L">", L"<" + Text(Logger::TextSize) + L">", L"<" + Text(Logger::TextSize + 1) + L">",
+			L"<" + Text(500) + L">", Text(100) + L"|5|" + Text(100), L"after" }));
+	});
+
+	Test("text longer than all records of a message", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		const size_t most = (size_t)Logger::TextSize * (Logger::MaxSpill + 1);	// 1280
+		log.Write(LogLevel::Debug, 1, L"{}", Text(most));
+		log.Write(LogLevel::Debug, 2, L"{}", Text(most + 1));
+		log.Write(LogLevel::Debug, 3, L"{}|{}", Text(1000), Text(1000));
+		log.Write(LogLevel::Debug, 4, L"after");
+		log.Flush();
+		CHECK(capture.Texts() == (std::vector<std::wstring>{
+			Text(most), Text(most), Text(1000) + L"|" + Text(280), L"after" }));
+	});
+
+	Test("long text around the end of the ring", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		bool intact = true;
+		for (int round = 0; round < 20; round++) {
+			capture.lines->clear();
+			for (int i = 0; i < 5; i++) log.Write(LogLevel::Debug, i, L"{} {}", round, Text(300 + 97 * i));
+			log.Flush();
+			intact &= capture.lines->size() == 5;
+			for (int i = 0; i < 5 && intact; i++) intact = capture.lines->at(i).text == std::to_wstring(round) + L" " + Text(300 + 97 * i);
+		}
+		CHECK(intact);
+	});
+
+	Test("full ring", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		for (int i = 0; i < (int)Logger::RingSize + 6; i++) log.Write(LogLevel::Debug, 1, L"{}", i);
+		log.Flush();
+		auto texts = capture.Texts();
+		CHECK(texts.size() == Logger::RingSize + 1);
+		if (texts.size() != Logger::RingSize + 1) return;
+		CHECK(texts.front() == L"6 log messages dropped" && capture.lines->front().level == LogLevel::Error);
+		CHECK(texts[1] == L"0" && texts.back() == std::to_wstring(Logger::RingSize - 1));	// the newest are dropped
+
+		// A long message needs all its records free
+		capture.lines->clear();
+		for (int i = 0; i < (int)Logger::RingSize - 4; i++) log.Write(LogLevel::Debug, 1, L"{}", i);
+		log.Write(LogLevel::Debug, 2, L"{}", Text(800));	// 5 records, 4 left
+		log.Write(LogLevel::Debug, 3, L"{}", Text(600));	// 4 records
+		log.Flush();
+		texts = capture.Texts();
+		CHECK(texts.size() == Logger::RingSize - 2 && texts.front() == L"1 log messages dropped" && texts.back() == Text(600));
+
+		// The count starts again after it was reported
+		capture.lines->clear();
+		log.Write(LogLevel::Debug, 1, L"next");
+		log.Flush();
+		CHECK(capture.Texts() == std::vector<std::wstring>{ L"next" });
+	});
+
+	Test("threads in timestamp order", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++)
+			threads.emplace_back([&log, t] {
+				for (int i = 0; i < 60; i++) {	// one record each, all fit into the ring
+					log.Write(LogLevel::Debug, t, L"{} {}", i, Text(i * 2));
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			});
+		for (auto& thread : threads) thread.join();
+		log.Flush();
+
+		const auto& lines = *capture.lines;
+		CHECK(lines.size() == 240);
+		if (lines.size() != 240) return;
+		bool sorted = true, ordered = true, intact = true;
+		std::vector<int> next(4, 0);
+		for (size_t i = 0; i < lines.size(); i++) {
+			if (i) sorted &= lines[i - 1].time <= lines[i].time;
+			int n = next[lines[i].line]++;
+			ordered &= lines[i].text.starts_with(std::to_wstring(n) + L" ");
+			intact &= lines[i].text == std::to_wstring(n) + L" " + Text(n * 2);
+		}
+		CHECK(sorted && ordered && intact);
+		std::vector<uint32_t> ids;
+		for (const auto& line : lines) if (std::find(ids.begin(), ids.end(), line.thread) == ids.end()) ids.push_back(line.thread);
+		CHECK(ids.size() == 4);
+	});
+
+	Test("logger thread", [] {
+		Logger log(LogLevel::Trace);
+		Capture capture;
+		log.AddSink(capture.Sink());
+		log.Write(LogLevel::Info, 1, L"before the start");
+		log.Start(std::chrono::milliseconds(1));
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++)
+			threads.emplace_back([&log] {
+				for (int i = 0; i < 500; i++) {
+					log.Write(LogLevel::Debug, 2, L"{}", i);
+					if (i % 32 == 0) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				}
+			});
+		for (auto& thread : threads) thread.join();
+		log.Stop();
+
+		// Whatever was dropped is counted
+		size_t delivered = 0, dropped = 0;
+		for (const auto& line : *capture.lines)
+			if (line.text.ends_with(L" log messages dropped")) dropped += std::stoul(line.text);
+			else delivered++;
+		CHECK(delivered + dropped == 2001);
+		CHECK(capture.lines->front().text == L"before the start");
+	});
+
+	Test("loggers one after the other", [] {
+		// Each in the place of the one before, and two at a time on one thread
+		bool own = true;
+		for (int i = 0; i < 3; i++) {
+			Logger log;
+			Capture capture;
+			log.AddSink(capture.Sink());
+			log.Write(LogLevel::Debug, 1, L"{}", i);
+			log.Flush();
+			own &= capture.Texts() == std::vector<std::wstring>{ std::to_wstring(i) };
+		}
+		CHECK(own);
+
+		Logger a, b;
+		Capture ca, cb;
+		a.AddSink(ca.Sink());
+		b.AddSink(cb.Sink());
+		for (int i = 0; i < 3; i++) {
+			a.Write(LogLevel::Debug, 1, L"a{}", i);
+			b.Write(LogLevel::Debug, 1, L"b{}", i);
+		}
+		a.Flush();
+		b.Flush();
+		CHECK(ca.Texts() == (std::vector<std::wstring>{ L"a0", L"a1", L"a2" }));
+		CHECK(cb.Texts() == (std::vector<std::wstring>{ L"b0", L"b1", L"b2" }));
+	});
+
+	Test("levels", [] {
+		CHECK(Logger::ParseLevel(L"trace") == LogLevel::Trace);
+		CHECK(Logger::ParseLevel(L"debug") == LogLevel::Debug);
+		CHECK(Logger::ParseLevel(L"info") == LogLevel::Info);
+		CHECK(Logger::ParseLevel(L"error") == LogLevel::Error);
+		CHECK(Logger::ParseLevel(L"off") == LogLevel::Off);
+		CHECK(!Logger::ParseLevel(L""));
+		CHECK(!Logger::ParseLevel(L"Debug"));
+		CHECK(!Logger::ParseLevel(L"verbose"));
+
+		Logger log;
+		CHECK(log.GetLevel() == LogLevel::Debug);
+		CHECK(!log.Enabled(LogLevel::Trace) && log.Enabled(LogLevel::Debug) && log.Enabled(LogLevel::Error));
+		log.SetLevel(LogLevel::Error);
+		CHECK(!log.Enabled(LogLevel::Info) && log.Enabled(LogLevel::Error));
+		log.SetLevel(LogLevel::Off);
+		CHECK(!log.Enabled(LogLevel::Error));
+	});
+
+	Test("stderr sink", [] {
+		Logger log;
+		log.AddSink(Logger::StderrSink());
+		std::ostringstream err;
+		auto previous = std::cerr.rdbuf(err.rdbuf());
+		log.Write(LogLevel::Info, 77, L"level {} é €", 3);
+		log.Flush();
+		std::cerr.rdbuf(previous);
+		std::string out = err.str();
+		CHECK(out.starts_with("[") && out.ends_with("] level 3 \xc3\xa9 \xe2\x82\xac :77\n"));
+	});
+
+	Test("file sink", [] {
+		auto path = std::filesystem::temp_directory_path() / "asio-dm-activator-log-test.log";
+		std::filesystem::remove(path);
+		{
+			Logger log;
+			log.AddSink(Logger::FileSink(path));
+			log.Write(LogLevel::Info, 5, L"first {}", Text(300));
+			log.Write(LogLevel::Info, 6, L"second");
+			log.Flush();
+		}
+		std::ifstream in(path);
+		std::string first, second;
+		std::getline(in, first);
+		std::getline(in, second);
+		CHECK(first.ends_with(" first " + Logger::ToUtf8(Text(300)) + "  :5"));
+		CHECK(second.ends_with(" second  :6"));
+		std::filesystem::remove(path);
+
+		CHECK(Logger::ToUtf8(L"aé€") == "a\xc3\xa9\xe2\x82\xac");
+		std::wstring pair = { (wchar_t)0xD83C, (wchar_t)0xDFB5 };	// U+1F3B5 as UTF-16
+		CHECK(Logger::ToUtf8(pair) == "\xf0\x9f\x8e\xb5");
+	});
+
+	return Summary();
+}
@@ -0,0 +1,303 @@
+// Tests of the static analysis of driver dlls (pe.h).
+//
+// There are no driver dlls to test with here, so the image is built in memory: a PE32+
+// file with a code section, an .rdata section holding MSVC RTTI and vtables, and base
+// relocations, laid out as the linker does. The checks find the IASIO vtable in it and
+// make sure that damaged or foreign files are refused rather than misread.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -fsanitize=address,undefined tests/pe_test.cpp -o pe-test
+//     ./pe-test
+
+#include "check.h"
+#include "../asio-dm-activator/pe.h"
+#include <map>
+#include <random>
+
+
+// A 64-bit dll: headers, .text, .rdata and .reloc, each section a page
+class Fixture {
+public:
+	static constexpr uint64_t ImageBase = 0x180000000;
+	static constexpr uint32_t Text = 0x1000, Rdata = 0x2000, Reloc = 0x3000;
+	static constexpr uint32_t SectionSize = 0x1000;
+	static constexpr uint32_t Headers = 0x400;	// file offset of the first section
+	static constexpr uint32_t Nt = 0x80;
+	static constexpr uint32_t Optional = Nt + 24;
+	static constexpr int IasioMethods = 24;		// IUnknown and IASIO, up to outputReady()
+
+	std::vector<uint8_t> rdata = std::vector<uint8_t>(SectionSize);
+	std::vector<uint32_t> relocations;	// RVAs of the 64-bit pointers
+	uint32_t used = 0;					// of .rdata
+
+	uint32_t Allocate(uint32_t size, uint32_t alignment = 8) {
+		used = (used + alignment - 1) & ~(alignment - 1);
+		uint32_t rva = Rdata + used;
+		used += size;
+		return rva;
+	}
+
+	template <typename T>
+	void Put(uint32_t rva, T value) {
+		memcpy(&rdata[rva - Rdata], &value, sizeof(T));
+	}
+
+	void PutPointer(uint32_t rva, uint32_t target) {
+		Put<uint64_t>(rva, ImageBase + target);
+		relocations.push_back(rva);
+	}
+
+	// TypeDescriptor, e.g. of ".?AUIASIO@@"
+	uint32_t Type(const std::string& mangled) {
+		uint32_t type = Allocate(16 + (uint32_t)mangled.size() + 1);
+		memcpy(&rdata[type + 16 - Rdata], mangled.c_str(), mangled.size() + 1);
+		return type;
+	}
+
+	// ClassHierarchyDescriptor of a class and its bases, the class itself first
+	uint32_t Hierarchy(const std::vector<uint32_t>& types) {
+		std::vector<uint32_t> descriptors;
+		for (size_t i = 0; i < types.size(); i++) {
+			uint32_t bcd = Allocate(24, 4);
+			Put<uint32_t>(bcd, types[i]);
+			Put<uint32_t>(bcd + 4, (uint32_t)(types.size() - 1 - i));	// containedBases
+			Put<int32_t>(bcd + 8, 0);	// mdisp, single inheritance
+			Put<int32_t>(bcd + 12, -1);	// pdisp, not a virtual base
+			descriptors.push_back(bcd);
+		}
+		uint32_t array = Allocate(4 * (uint32_t)types.size(), 4);
+		for (size_t i = 0; i < descriptors.size(); i++) Put<uint32_t>(array + 4 * (uint32_t)i, descriptors[i]);
+		uint32_t chd = Allocate(16, 4);
+		Put<uint32_t>(chd + 8, (uint32_t)types.size());
+		Put<uint32_t>(chd + 12, array);
+		return chd;
+	}
+
+	// CompleteObjectLocator, the pointer to it, then the methods. Returns the vtable.
+	uint32_t Vtable(uint32_t type, uint32_t hierarchy, int methods, bool relocated = true) {
+		uint32_t col = Allocate(24, 4);
+		Put<uint32_t>(col, 1);
+		Put<uint32_t>(col + 12, type);
+		Put<uint32_t>(col + 16, hierarchy);
+		Put<uint32_t>(col + 20, col);
+		uint32_t at = Allocate(8 * (methods + 1));
+		PutPointer(at, col);
+		for (int i = 0; i < methods; i++) {
+			if (relocated) PutPointer(at + 8 + 8 * i, Text + 16 * i);
+			else Put<uint64_t>(at + 8 + 8 * i, ImageBase + Text + 16 * i);
+		}
+		return at + 8;
+	}
+
+	// A driver class implementing IASIO, returns its vtable
+	uint32_t Driver(const std::string& name, std::vector<uint32_t> bases = {}) {
+		uint32_t type = Type(".?AV" + name + "@@");
+		bases.insert(bases.begin(), type);
+		return Vtable(type, Hierarchy(bases), IasioMethods);
+	}
+
+	uint32_t Iasio() {
+		if (!iasio) iasio = Type(".?AUIASIO@@");
+		return iasio;
+	}
+
+	std::vector<uint8_t> Build() const {
+		std::vector<uint8_t> file(Headers + 3 * SectionSize);
+		auto put16 = [&](size_t at, uint16_t x) { memcpy(&file[at], &x, 2); };
+		auto put32 = [&](size_t at, uint32_t x) { memcpy(&file[at], &x, 4); };
+		auto put64 = [&](size_t at, uint64_t x) { memcpy(&file[at], &x, 8); };
+
+		put16(0, 0x5a4d);	// MZ
+		put32(0x3c, Nt);
+		put32(Nt, 0x4550);	// PE
+		put16(Nt + 4, 0x8664);
+		put16(Nt + 6, 3);
+		put16(Nt + 20, 240);
+		put16(Optional, 0x20b);	// PE32+
+		put64(Optional + 24, ImageBase);
+		put32(Optional + 56, Reloc + SectionSize);
+		put32(Optional + 108, 16);
+
+		struct { const char* name; uint32_t rva; uint32_t characteristics; } sections[] = {
+			{ ".text", Text, 0x60000020 },	// code, execute, read
+			{ ".rdata", Rdata, 0x40000040 },
+			{ ".reloc", Reloc, 0x42000040 },
+		};
+		for (int i = 0; i < 3; i++) {
+			size_t h = Optional + 240 + i * 40;
+			memcpy(&file[h], sections[i].name, strlen(sections[i].name));
+			put32(h + 8, SectionSize);
+			put32(h + 12, sections[i].rva);
+			put32(h + 16, SectionSize);
+			put32(h + 20, Headers + i * SectionSize);
+			put32(h + 36, sections[i].characteristics);
+		}
+
+		std::fill(file.begin() + Headers, file.begin() + Headers + SectionSize, 0xcc);	// int 3
+		std::copy(rdata.begin(), rdata.end(), file.begin() + Headers + SectionSize);
+
+		// One block of IMAGE_REL_BASED_DIR64 entries per page
+		std::map<uint32_t, std::vector<uint16_t>> pages;
+		for (uint32_t rva : relocations) pages[rva & ~0xfffu].push_back((uint16_t)(0xa000 | (rva & 0xfff)));
+		size_t at = Headers + 2 * SectionSize;
+		for (auto& [page, entries] : pages) {
+			if (entries.size() % 2) entries.push_back(0);	// padding entry, type 0
+			put32(at, page);
+			put32(at + 4, 8 + 2 * (uint32_t)entries.size());
+			for (size_t i = 0; i < entries.size(); i++) put16(at + 8 + 2 * i, entries[i]);
+			at += 8 + 2 * entries.size();
+		}
+		put32(Optional + 112 + 5 * 8, Reloc);
+		put32(Optional + 112 + 5 * 8 + 4, (uint32_t)(at - Headers - 2 * SectionSize));
+		return file;
+	}
+
+private:
+	uint32_t iasio{};
+};
+
+
+int main() {
+	Test("sections", [] {
+		Fixture f;
+		f.Driver("CDriver", { f.Iasio() });
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image);
+		if (!image) return;
+		CHECK(image->ImageBase() == Fixture::ImageBase);
+		CHECK(image->IsExecutable(Fixture::Text + 0x10));
+		CHECK(!image->IsExecutable(Fixture::Rdata));
+		CHECK(!image->IsExecutable(Fixture::Reloc + Fixture::SectionSize));
+		CHECK(image->Read<uint8_t>(Fixture::Text) == (uint8_t)0xcc);
+		CHECK(!image->Read<uint32_t>(Fixture::Rdata + Fixture::SectionSize - 2));	// would cross the end
+		CHECK(!image->Read<uint8_t>(0x10000));
+	});
+
+	Test("rtti complete object locator", [] {
+		Fixture f;
+		uint32_t vtable = f.Driver("CDriver", { f.Iasio() });
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image);
+		if (!image) return;
+		CHECK(image->IsRelocated(vtable - 8));
+		auto col = image->Pointer(vtable - 8);
+		CHECK(col);
+		if (!col) return;
+		CHECK(image->Read<uint32_t>(*col) == 1u);				// signature of 64-bit images
+		CHECK(image->Read<uint32_t>(*col + 20) == *col);		// self
+		CHECK(image->Pointer(vtable) == Fixture::Text);
+		CHECK(!image->IsRelocated(vtable + 4));
+	});
+
+	Test("IASIO vtable", [] {
+		Fixture f;
+		uint32_t vtable = f.Driver("CDriver", { f.Iasio() });
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image);
+		if (!image) return;
+		CHECK(image->FindInterfaceVtable("IASIO", Fixture::IasioMethods) == vtable);
+		CHECK(!image->FindInterfaceVtable("IASIO", Fixture::IasioMethods + 1));	// too short
+		CHECK(!image->FindInterfaceVtable("IASI", 1));
+		CHECK(!image->FindInterfaceVtable("IUnknown", 1));
+	});
+
+	Test("most derived class", [] {
+		Fixture f;
+		uint32_t base = f.Type(".?AVCDriverBase@@");
+		f.Vtable(base, f.Hierarchy({ base, f.Iasio() }), Fixture::IasioMethods);
+		uint32_t derived = f.Driver("CDriver", { base, f.Iasio() });
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image && image->FindInterfaceVtable("IASIO", Fixture::IasioMethods) == derived);
+	});
+
+	Test("ambiguous classes", [] {
+		Fixture f;
+		f.Driver("CDriverA", { f.Iasio() });
+		f.Driver("CDriverB", { f.Iasio() });
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image && !image->FindInterfaceVtable("IASIO", Fixture::IasioMethods));
+	});
+
+	Test("methods without relocations", [] {
+		Fixture f;
+		uint32_t type = f.Type(".?AVCDriver@@");
+		f.Vtable(type, f.Hierarchy({ type, f.Iasio() }), Fixture::IasioMethods, false);
+		auto image = PeImage::Parse(f.Build());
+		CHECK(image && !image->FindInterfaceVtable("IASIO", 1));
+	});
+
+	Test("damaged headers", [] {
+		Fixture f;
+		f.Driver("CDriver", { f.Iasio() });
+		const auto good = f.Build();
+		auto patched = [&](size_t at, uint32_t value) {
+			auto file = good;
+			memcpy(&file[at], &value, 4);
+			return file;
+		};
+		CHECK(!PeImage::Parse({}));
+		CHECK(!PeImage::Parse(std::vector<uint8_t>(good.begin(), good.begin() + 0x3c)));	// no e_lfanew
+		CHECK(!PeImage::Parse(patched(0, 0x5a4e)));									// not MZ
+		CHECK(!PeImage::Parse(patched(0x3c, (uint32_t)good.size())));					// NT headers past the end
+		CHECK(!PeImage::Parse(patched(Fixture::Nt, 0x4551)));							// not PE
+		CHECK(!PeImage::Parse(patched(Fixture::Optional, 0x10b)));						// PE32, not PE32+
+		CHECK(!PeImage::Parse(std::vector<uint8_t>(good.begin(), good.begin() + Fixture::Optional + 240 + 60)));	// section table cut
+	});
+
+	Test("damaged relocations", [] {
+		Fixture f;
+		f.Driver("CDriver", { f.Iasio() });
+		auto file = f.Build();
+		for (uint32_t size : { 0u, 4u, 0xfffffffeu, 0x7ffffff8u }) {
+			memcpy(&file[Fixture::Headers + 2 * Fixture::SectionSize + 4], &size, 4);
+			auto image = PeImage::Parse(file);	// returns, whatever the block size says
+			CHECK(image && !image->FindInterfaceVtable("IASIO", Fixture::IasioMethods));
+		}
+	});
+
+	Test("truncated file", [] {
+		Fixture f;
+		uint32_t vtable = f.Driver("CDriver", { f.Iasio() });
+		const auto good = f.Build();
+		// Cut anywhere, it still parses if the headers are there, but nothing is read past the end
+		for (size_t size = Fixture::Headers; size <= good.size(); size += 0x40) {
+			auto image = PeImage::Parse(std::vector<uint8_t>(good.begin(), good.begin() + size));
+			CHECK(image);
+			if (!image) continue;
+			auto found = image->FindInterfaceVtable("IASIO", Fixture::IasioMethods);
+			CHECK(!found || *found == vtable);
+			if (size < Fixture::Headers + Fixture::SectionSize + f.used) CHECK(!found);	// .rdata cut
+		}
+	});
+
+	Test("corrupt bytes", [] {
+		Fixture f;
+		f.Driver("CDriver", { f.Iasio() });
+		const auto good = f.Build();
+		std::mt19937 random(1);
+		for (int i = 0; i < 2000; i++) {
+			auto file = good;
+			for (int j = 0; j < 8; j++) file[random() % file.size()] = (uint8_t)random();
+			if (auto image = PeImage::Parse(std::move(file))) image->FindInterfaceVtable("IASIO", Fixture::IasioMethods);
+		}
+		CHECK(true);	// what counts is getting here, under the sanitizers
+	});
+
+	Test("hash and file", [] {
+		Fixture f;
+		uint32_t vtable = f.Driver("CDriver", { f.Iasio() });
+		auto file = f.Build();
+		auto path = std::filesystem::temp_directory_path() / "asio-dm-activator-pe-test.dll";
+		std::ofstream(path, std::ios::binary).write((const char*)file.data(), file.size());
+		auto loaded = PeImage::Load(path);
+		auto parsed = PeImage::Parse(file);
+		CHECK(loaded && parsed && loaded->Hash() == parsed->Hash());
+		CHECK(loaded && loaded->FindInterfaceVtable("IASIO", Fixture::IasioMethods) == vtable);
+		file[Fixture::Headers] ^= 1;
+		CHECK(parsed && PeImage::Parse(file)->Hash() != parsed->Hash());
+		std::filesystem::remove(path);
+		CHECK(!PeImage::Load(path));
+	});
+
+	return Summary();
+}
@@ -0,0 +1,184 @@
+// Tests of device sessions shared between processes (shared.h).
+//
+// Two SharedDevice objects in one process stand for two processes: they are given
+// different process ids and map the segment each on their own, as separate processes
+// would. The checks cover who gets the lease, commands going through the ring to the
+// owner in order, a full ring, the shared shadow mixer, and the device being taken over
+// when its owner closes it or stops renewing the lease. The last takes a few seconds,
+// as long as a lease lasts.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -pthread -fsanitize=address,undefined tests/shared_test.cpp -o shared-test
+//     ./shared-test
+
+#include "check.h"
+#include "../asio-dm-activator/shared.h"
+#include <vector>
+
+
+const uint32_t First = 1000001, Second = 1000002;
+
+// A segment no other run uses, removed again at the end of the test
+class Segment {
+public:
+	std::string name;
+
+	Segment() {
+		static int count = 0;
+		name = SharedDevice::Name(0x0102, L"test" + std::to_wstring(SharedDevice::CurrentProcess()) + L"x" + std::to_wstring(count++));
+	}
+
+	~Segment() {
+	#ifndef _WIN32
+		shm_unlink(("/" + name).c_str());
+		sem_unlink(("/" + name + "-wake").c_str());
+	#endif
+	}
+};
+
+// What the callbacks of a device heard, on its session thread
+struct Events {
+	std::mutex mutex;
+	std::vector<SharedCommand> commands;
+	std::vector<bool> owner;
+
+	void Listen(SharedDevice& device) {
+		device.Listen([this](const SharedCommand& c) { std::lock_guard<std::mutex> lock(mutex); commands.push_back(c); },
+			[this](bool isOwner) { std::lock_guard<std::mutex> lock(mutex); owner.push_back(isOwner); });
+	}
+
+	size_t Commands() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return commands.size();
+	}
+
+	std::vector<bool> Owner() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return owner;
+	}
+};
+
+// Waits for something the session threads bring about
+template <typename F>
+bool Eventually(F&& condition, std::chrono::milliseconds timeout) {
+	auto end = std::chrono::steady_clock::now() + timeout;
+	while (!condition())
+		if (std::chrono::steady_clock::now() > end) return false;
+		else std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	return true;
+}
+
+SharedCommand Command(int input, int gain = 0x20000000, int state = 1) {
+	return { input, gain, state, 0x3fffffff, SharedDevice::Now() };
+}
+
+
+int main() {
+	Test("name", [] {
+		CHECK(SharedDevice::Name(0x0200002708, L"AB-12 c") == "asio-dm-activator-device-0000000200002708-AB12c");
+		CHECK(SharedDevice::Name(1, L"") != SharedDevice::Name(2, L""));
+	});
+
+	Test("the first process owns the device", [] {
+		Segment segment;
+		SharedDevice first, second;
+		CHECK(first.Open(segment.name, First));
+		CHECK(second.Open(segment.name, Second));
+		CHECK(first.IsOwner() && !second.IsOwner());
+		CHECK(first.Owner() == First && second.Owner() == First);
+
+		CHECK(first.Open(segment.name, First));	// opening again keeps the lease
+		CHECK(first.IsOwner());
+	});
+
+	Test("commands reach the owner in order", [] {
+		Segment segment;
+		SharedDevice owner, other;
+		Events events;
+		CHECK(owner.Open(segment.name, First) && other.Open(segment.name, Second));
+		events.Listen(owner);
+
+		for (int i = 0; i < 100; i++) CHECK(other.Submit(Command(i % 8, i)));
+		CHECK(Eventually([&] { return events.Commands() == 100; }, std::chrono::milliseconds(2000)));
+		std::lock_guard<std::mutex> lock(events.mutex);
+		bool ordered = events.commands.size() == 100;
+		for (size_t i = 0; ordered && i < 100; i++) ordered = events.commands[i].gain == (int)i && events.commands[i].input == (int)i % 8;
+		CHECK(ordered);
+		CHECK(events.owner.empty());	// was the owner from the start
+	});
+
+	Test("full ring", [] {
+		Segment segment;
+		SharedDevice owner, other;
+		CHECK(owner.Open(segment.name, First) && other.Open(segment.name, Second));
+
+		// Nobody drains while the owner doesn't listen
+		int accepted = 0;
+		for (int i = 0; i < SharedDevice::RingSize + 10; i++) accepted += other.Submit(Command(0, i));
+		CHECK(accepted == SharedDevice::RingSize);
+
+		Events events;
+		events.Listen(owner);
+		CHECK(Eventually([&] { return events.Commands() == SharedDevice::RingSize; }, std::chrono::milliseconds(2000)));
+		CHECK(Eventually([&] { return other.Submit(Command(0, -1)); }, std::chrono::milliseconds(100)));	// room again
+		CHECK(Eventually([&] { return events.Commands() == SharedDevice::RingSize + 1; }, std::chrono::milliseconds(2000)));
+		std::lock_guard<std::mutex> lock(events.mutex);
+		CHECK(events.commands.front().gain == 0 && events.commands.back().gain == -1);
+	});
+
+	Test("shared shadow mixer", [] {
+		Segment segment;
+		SharedDevice first, second;
+		CHECK(first.Open(segment.name, First) && second.Open(segment.name, Second));
+		auto a = first.Shadow(), b = second.Shadow();
+		CHECK(a && b && a.get() != b.get());	// mapped twice, as in two processes
+		if (!a || !b) return;
+		a->Update(5, { -256, -512 });
+		CHECK(b->IsValid(5) && b->Current(5) == (VolPair{ -256, -512 }));
+		b->Invalidate(5);
+		CHECK(!a->IsValid(5));
+
+		first.Close();
+		CHECK(a->Current(5) == (VolPair{ -256, -512 }));	// the pointer keeps the segment
+	});
+
+	Test("the owner closes", [] {
+		Segment segment;
+		SharedDevice first, second;
+		Events events;
+		CHECK(first.Open(segment.name, First) && second.Open(segment.name, Second));
+		events.Listen(second);
+		first.Close();
+		CHECK(!first.IsOwner());
+
+		// Commands waiting in the ring go to the new owner
+		CHECK(second.Submit(Command(2)));
+		CHECK(Eventually([&] { return second.IsOwner(); }, SharedDevice::RenewPeriod * 2));
+		CHECK(second.Owner() == Second);
+		CHECK(Eventually([&] { return events.Commands() == 1; }, std::chrono::milliseconds(2000)));
+		CHECK(events.Owner() == std::vector<bool>{ true });
+	});
+
+	Test("the owner stops renewing", [] {
+		Segment segment;
+		SharedDevice hung, second;
+		Events events, former;
+		CHECK(hung.Open(segment.name, First) && second.Open(segment.name, Second));
+		events.Listen(second);
+
+		// A lease isn't taken over before it expired
+		std::this_thread::sleep_for(SharedDevice::RenewPeriod * 3 / 2);
+		CHECK(!second.IsOwner() && second.Owner() == First);
+		CHECK(Eventually([&] { return second.IsOwner(); }, SharedDevice::LeaseTime + SharedDevice::RenewPeriod * 2));
+		CHECK(events.Owner() == std::vector<bool>{ true });
+
+		// The former owner comes back from its hang and finds the device gone
+		CHECK(hung.IsOwner());
+		former.Listen(hung);
+		CHECK(Eventually([&] { return !hung.IsOwner(); }, SharedDevice::RenewPeriod * 2));
+		CHECK(former.Owner() == std::vector<bool>{ false });
+		CHECK(second.IsOwner() && hung.Owner() == Second);
+	});
+
+	return Summary();
+}
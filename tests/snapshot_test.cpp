@@ -0,0 +1,163 @@
+// Tests of the mixer snapshot file (snapshot.h).
+//
+// Two MixerSnapshot objects on one file stand for two hosts: each maps the file on its
+// own, as separate processes would. The checks cover records claimed once per device,
+// levels written by one seen by the other, muting, the file laid out once when several
+// open it at the same time, and a file of another format started over.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -pthread -fsanitize=address,undefined tests/snapshot_test.cpp -o snapshot-test
+//     ./snapshot-test
+
+#include "check.h"
+#include "../asio-dm-activator/snapshot.h"
+#include <fstream>
+#include <thread>
+#include <vector>
+
+
+const uint64_t Model = 0x0200002708;
+
+// A file no other run uses, removed again at the end of the test
+class TempFile {
+public:
+	std::filesystem::path path;
+
+	TempFile() {
+		static int count = 0;
+		auto stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+		path = std::filesystem::temp_directory_path() / "asio-dm-activator-test" / ("snapshot-" + std::to_string(stamp) + "-" + std::to_string(count++) + ".bin");
+	}
+
+	~TempFile() {
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+		std::filesystem::remove(path.parent_path(), ec);	// if empty
+	}
+};
+
+
+int main() {
+	Test("one record per device", [] {
+		TempFile file;
+		MixerSnapshot first, second;
+		CHECK(first.Open(file.path) && second.Open(file.path));
+		int a = first.Attach(Model, L"AB12");
+		CHECK(a >= 0);
+		CHECK(second.Attach(Model, L"AB12") == a);
+		CHECK(first.Attach(Model, L"AB12") == a);
+		int b = second.Attach(Model, L"CD34");
+		int c = first.Attach(Model + 1, L"AB12");
+		CHECK(b >= 0 && c >= 0 && b != a && c != a && b != c);
+		CHECK(first.Attach(Model, L"CD34") == b);
+	});
+
+	Test("levels go from one to the other", [] {
+		TempFile file;
+		MixerSnapshot first, second;
+		CHECK(first.Open(file.path) && second.Open(file.path));
+		int a = first.Attach(Model, L"AB12"), b = second.Attach(Model, L"AB12");
+		CHECK(a >= 0 && a == b);
+
+		CHECK(!second.Get(b, 3));
+		first.Set(a, 3, { -256, -512 }, true);
+		auto level = second.Get(b, 3);
+		CHECK(level && level->vol == (VolPair{ -256, -512 }) && !level->muted);
+
+		// Muted by the plugin, the level is kept
+		second.Set(b, 3, ShadowMixer::MinusInf, true);
+		level = first.Get(a, 3);
+		CHECK(level && level->vol == (VolPair{ -256, -512 }) && level->muted);
+
+		// Restored
+		first.Set(a, 3, { -256, -512 }, true);
+		level = second.Get(b, 3);
+		CHECK(level && !level->muted);
+
+		// Muted in the device mixer, that's the user's business
+		first.Set(a, 3, ShadowMixer::MinusInf, false);
+		level = second.Get(b, 3);
+		CHECK(level && !level->muted);
+
+		// Nothing to keep for an input never heard at a level
+		second.Set(b, 4, ShadowMixer::MinusInf, true);
+		CHECK(!first.Get(a, 4));
+
+		CHECK(!first.Get(a, -1) && !first.Get(a, MixerSnapshot::MaxChannels) && !first.Get(MixerSnapshot::MaxDevices, 0));
+		first.Set(a, MixerSnapshot::MaxChannels, { -1, -1 }, true);	// ignored
+	});
+
+	Test("levels outlive the host", [] {
+		TempFile file;
+		{
+			MixerSnapshot host;
+			CHECK(host.Open(file.path));
+			host.Set(host.Attach(Model, L"AB12"), 7, { -1024, -1024 }, true);
+			host.Set(host.Attach(Model, L"AB12"), 7, ShadowMixer::MinusInf, true);
+			host.Flush();
+		}
+		MixerSnapshot next;
+		CHECK(next.Open(file.path));
+		auto level = next.Get(next.Attach(Model, L"AB12"), 7);
+		CHECK(level && level->vol == (VolPair{ -1024, -1024 }) && level->muted);
+	});
+
+	Test("full file", [] {
+		TempFile file;
+		MixerSnapshot first, second;
+		CHECK(first.Open(file.path) && second.Open(file.path));
+		bool claimed = true;
+		for (int i = 0; i < MixerSnapshot::MaxDevices; i++)
+			claimed &= (i % 2 ? first : second).Attach(Model, std::to_wstring(i)) >= 0;
+		CHECK(claimed);
+		CHECK(first.Attach(Model, L"one more") == -1 && second.Attach(Model, L"one more") == -1);
+		CHECK(first.Attach(Model, L"3") >= 0);	// known ones still found
+	});
+
+	Test("opened at the same time", [] {
+		TempFile file;
+		const int Hosts = 8;
+		std::vector<MixerSnapshot> hosts(Hosts);
+		std::vector<int> opened(Hosts), records(Hosts);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < Hosts; i++)
+			threads.emplace_back([&, i] {
+				opened[i] = hosts[i].Open(file.path);
+				records[i] = hosts[i].Attach(Model, L"AB12");
+				hosts[i].Set(records[i], i, { (short)(-256 * (i + 1)), 0 }, true);
+			});
+		for (auto& t : threads) t.join();
+
+		bool all = true, same = true, kept = true;
+		for (int i = 0; i < Hosts; i++) {
+			all &= opened[i] != 0;
+			same &= records[i] == records[0];
+			auto level = hosts[0].Get(records[0], i);	// nobody's level was formatted away
+			kept &= level && level->vol.L == -256 * (i + 1);
+		}
+		CHECK(all && records[0] >= 0 && same && kept);
+	});
+
+	Test("a file of another format is started over", [] {
+		TempFile file;
+		std::filesystem::create_directories(file.path.parent_path());
+		{
+			std::ofstream old(file.path, std::ios::binary);
+			const uint32_t header[] = { MixerSnapshot::Magic, 1, 100, 16 };	// the first version
+			old.write((const char*)header, sizeof(header));
+			old << std::string(4096, '\x7f');
+		}
+		MixerSnapshot host;
+		CHECK(host.Open(file.path));
+		int record = host.Attach(Model, L"AB12");
+		CHECK(record == 0 && !host.Get(record, 0));
+		host.Set(record, 0, { -256, -256 }, true);
+
+		MixerSnapshot other;
+		CHECK(other.Open(file.path));	// and isn't started over again
+		auto level = other.Get(other.Attach(Model, L"AB12"), 0);
+		CHECK(level && level->vol == (VolPair{ -256, -256 }));
+	});
+
+	return Summary();
+}
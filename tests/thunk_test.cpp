@@ -0,0 +1,214 @@
+// Tests of the generated future() stubs (thunk.h) in the stub arena (hooks.h).
+//
+// The stubs are x86-64 code for the Microsoft calling convention. Called through ms_abi
+// function pointers they run on any x86-64 OS, so the checks call them as a host would
+// and see which function each selector ends up in, with which arguments.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -fsanitize=address,undefined tests/thunk_test.cpp -o thunk-test
+//     ./thunk-test
+
+#include "check.h"
+#include "../asio-dm-activator/thunk.h"
+#include "../asio-dm-activator/hooks.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#ifdef _WIN32
+#define MSABI
+#else
+#define MSABI __attribute__((ms_abi))
+#endif
+
+using Future = long(MSABI*)(void*, long, void*);
+
+const long kAsioCanInputMonitor = 9;
+const long kAsioSetInputMonitor = 3;
+const long kAsioGetInternalBufferSamples = 1010;
+
+// Where the last call went and what it got
+struct Call {
+	const void* instance{};
+	void* iasio{};
+	long selector{};
+	void* params{};
+	int count{};
+};
+
+struct Context {
+	Call handled;
+	Call original;
+} context;
+
+long MSABI Handler(Context* self, void* iasio, long selector, void* params) {
+	self->handled = { self, iasio, selector, params, self->handled.count + 1 };
+	return 1000 + selector;
+}
+
+long MSABI Original(void* iasio, long selector, void* params) {
+	context.original = { nullptr, iasio, selector, params, context.original.count + 1 };
+	return -selector;
+}
+
+ThunkArena arena;
+
+Future Filter(std::span<const long> selectors, uint64_t* passCounter = nullptr) {
+	auto code = thunk::FutureFilter((uintptr_t)&context, (uintptr_t)&Handler, (uintptr_t)&Original, selectors, (uintptr_t)passCounter);
+	return (Future)arena.Add(code);
+}
+
+// A page for a vtable, read-only once filled in, as a driver's .rdata
+uintptr_t* NewPage() {
+#ifdef _WIN32
+	return (uintptr_t*)VirtualAlloc(nullptr, 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* page = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return page == MAP_FAILED ? nullptr : (uintptr_t*)page;
+#endif
+}
+
+void Protect(uintptr_t* page) {
+#ifdef _WIN32
+	DWORD oldProtect;
+	VirtualProtect(page, 4096, PAGE_READONLY, &oldProtect);
+#else
+	mprotect(page, 4096, PROT_READ);
+#endif
+}
+
+void FreePage(uintptr_t* page) {
+#ifdef _WIN32
+	VirtualFree(page, 0, MEM_RELEASE);
+#else
+	munmap(page, 4096);
+#endif
+}
+
+void* const Iasio = (void*)0x1234;
+void* const Params = (void*)0x5678;
+
+
+int main() {
+	Test("listed selectors reach the handler", [] {
+		context = {};
+		long selectors[] = { kAsioCanInputMonitor, kAsioSetInputMonitor };
+		auto future = Filter(selectors);
+		CHECK(future);
+		if (!future) return;
+
+		CHECK(future(Iasio, kAsioSetInputMonitor, Params) == 1000 + kAsioSetInputMonitor);
+		CHECK(context.handled.count == 1 && context.original.count == 0);
+		CHECK(context.handled.instance == &context);
+		CHECK(context.handled.iasio == Iasio && context.handled.selector == kAsioSetInputMonitor && context.handled.params == Params);
+
+		CHECK(future(Iasio, kAsioCanInputMonitor, nullptr) == 1000 + kAsioCanInputMonitor);
+		CHECK(context.handled.count == 2 && context.handled.params == nullptr);
+	});
+
+	Test("other selectors go to the original untouched", [] {
+		context = {};
+		long selectors[] = { kAsioCanInputMonitor, kAsioSetInputMonitor };
+		auto future = Filter(selectors);
+		CHECK(future);
+		if (!future) return;
+
+		for (long selector : { kAsioGetInternalBufferSamples, 0L, 1L, 4L, 8L, 10L, 0x7fffffffL, -1L }) {
+			CHECK(future(Iasio, selector, Params) == -selector);
+			CHECK(context.original.iasio == Iasio && context.original.selector == selector && context.original.params == Params);
+		}
+		CHECK(context.original.count == 8 && context.handled.count == 0);
+	});
+
+	Test("pass counter", [] {
+		context = {};
+		uint64_t passed = 0;
+		long selectors[] = { kAsioSetInputMonitor };
+		auto future = Filter(selectors, &passed);
+		CHECK(future);
+		if (!future) return;
+
+		future(Iasio, kAsioSetInputMonitor, Params);
+		CHECK(passed == 0);
+		for (int i = 0; i < 5; i++) future(Iasio, kAsioGetInternalBufferSamples, Params);
+		CHECK(passed == 5 && context.original.count == 5 && context.handled.count == 1);
+	});
+
+	Test("no selectors, many selectors", [] {
+		context = {};
+		auto none = Filter({});
+		CHECK(none && none(Iasio, kAsioSetInputMonitor, Params) == -kAsioSetInputMonitor);
+		CHECK(context.handled.count == 0);
+
+		std::vector<long> many;
+		for (long s = 100; s < 140; s++) many.push_back(s);
+		auto future = Filter(many);
+		CHECK(future);
+		if (!future) return;
+		bool routed = true;
+		for (long s = 95; s < 145; s++) routed &= future(Iasio, s, Params) == (s >= 100 && s < 140 ? 1000 + s : -s);
+		CHECK(routed);
+		CHECK(context.handled.count == 40 && context.original.count == 11);
+	});
+
+	Test("forward", [] {
+		context = {};
+		auto future = (Future)arena.Add(thunk::FutureForward((uintptr_t)&context, (uintptr_t)&Handler));
+		CHECK(future);
+		if (!future) return;
+		for (long selector : { kAsioSetInputMonitor, kAsioGetInternalBufferSamples, -1L })
+			CHECK(future(Iasio, selector, Params) == 1000 + selector && context.handled.selector == selector);
+		CHECK(context.handled.count == 3 && context.original.count == 0);
+		CHECK(context.handled.instance == &context && context.handled.params == Params);
+	});
+
+	Test("through a hooked vtable", [] {
+		context = {};
+		const int futureSlot = 23;
+		auto vtable = NewPage();
+		CHECK(vtable);
+		if (!vtable) return;
+		vtable[futureSlot] = (uintptr_t)&Original;
+		Protect(vtable);
+		uintptr_t* object[] = { vtable };	// what the host holds
+
+		long selectors[] = { kAsioSetInputMonitor };
+		auto stub = Filter(selectors);
+		HookRegistry hooks;
+		CHECK(hooks.Patch(vtable, futureSlot, (uintptr_t)stub, &context) == (uintptr_t)&Original);
+		CHECK(hooks.IsPatched(vtable, futureSlot));
+		CHECK(hooks.Original(object, futureSlot) == (uintptr_t)&Original);
+		CHECK(hooks.Context(object) == &context);
+
+		auto call = [&](long selector) { return ((Future)object[0][futureSlot])(object, selector, Params); };
+		CHECK(call(kAsioSetInputMonitor) == 1000 + kAsioSetInputMonitor && context.handled.iasio == object);
+		CHECK(call(kAsioGetInternalBufferSamples) == -kAsioGetInternalBufferSamples && context.original.iasio == object);
+
+		CHECK(hooks.Unpatch(vtable, futureSlot));
+		CHECK(!hooks.IsPatched(vtable, futureSlot));
+		CHECK(call(kAsioSetInputMonitor) == -kAsioSetInputMonitor && context.handled.count == 1);
+		FreePage(vtable);
+	});
+
+	Test("stubs share pages", [] {
+		size_t before = arena.PagesUsed();
+		long selectors[] = { kAsioCanInputMonitor, kAsioSetInputMonitor };
+		std::vector<Future> stubs;
+		for (int i = 0; i < 100; i++) stubs.push_back(Filter(selectors));
+		CHECK(arena.PagesUsed() - before <= 4);
+		context = {};
+		bool all = true;
+		for (auto future : stubs) all &= future && future(Iasio, kAsioSetInputMonitor, Params) == 1000 + kAsioSetInputMonitor;
+		CHECK(all && context.handled.count == 100);
+	});
+
+	return Summary();
+}
+
+#else
+
+int main() {
+	std::cerr << "The stubs are x86-64 code, skipped\n";
+	return 0;
+}
+
+#endif
@@ -0,0 +1,231 @@
+// Tests of the command worker (worker.h) and the command path of monitor.h.
+//
+// The worker runs as in the plugin, with the device of the benchmarks as its handler:
+// the plugin's SetInputMonitor on the stub TUSBAUDIO API, which writes the crosspoints
+// into an array. The checks cover what reaches the device, the status counters, a full
+// queue, the ordering of commands, debouncing and the merging of a burst.
+//
+// Build and run:
+//     g++ -std=c++20 -O1 -g -pthread -fsanitize=address,undefined tests/worker_test.cpp -o worker-test
+//     ./worker-test
+
+#include "check.h"
+#include "../bench/common.h"
+
+
+const DeviceProfile& Profile = DeviceDatabase::BuiltIn[7];	// iD14 mk2, two mixes
+const int Inputs = 16;
+const long Gain0dB = 0x20000000;
+const long Center = 0x3fffffff;
+
+VolPair Crosspoints(int input) {
+	int at = monitor::Crosspoint(Profile, input);
+	return { stub::device.crosspoints[at], stub::device.crosspoints[at + 1] };
+}
+
+// Waits for a condition the worker brings about, false after a second
+template <typename F>
+bool Eventually(F&& condition) {
+	auto end = Clock::now() + std::chrono::seconds(1);
+	while (!condition())
+		if (Clock::now() > end) return false;
+		else std::this_thread::sleep_for(std::chrono::microseconds(100));
+	return true;
+}
+
+using Worker = CommandWorker<ASIOInputMonitor>;
+
+// A command for the queue tests, they only look at the input and the gain
+ASIOInputMonitor Command(long input, long gain = 0) {
+	return { input, 0, gain, 0, 0 };
+}
+
+
+int main() {
+	stub::device.latency = {};
+
+	Test("commands reach the device", [] {
+		Device device(Profile, Inputs);
+		Worker worker([&](std::span<ASIOInputMonitor> batch) { return device.Execute(batch); }, ASE_SUCCESS);
+		stub::device.crosspoints.fill(0x100);
+
+		WaitFor(worker, worker.Submit({ 3, 0, Gain0dB, 0, Center }));	// off
+		CHECK(Crosspoints(3) == ShadowMixer::MinusInf);
+		CHECK(Crosspoints(2) == (VolPair{ 0x100, 0x100 }));
+		CHECK(Crosspoints(4) == (VolPair{ 0x100, 0x100 }));
+
+		WaitFor(worker, worker.Submit({ 3, 0, Gain0dB, 1, Center }));	// on again, at the level before
+		CHECK(Crosspoints(3) == (VolPair{ 0, 0 }));
+
+		device.follow = true;
+		WaitFor(worker, worker.Submit({ 5, 0, Gain0dB / 2, 1, 0 }));	// half gain, hard left
+		CHECK(Crosspoints(5) == GainLaw::ToDevice(Gain0dB / 2, 0));
+		CHECK(Crosspoints(5).L > Crosspoints(5).R);
+		CHECK(device.shadow.Current(5) == Crosspoints(5));
+	});
+
+	Test("status counters", [] {
+		Device device(Profile, Inputs);
+		Worker worker([&](std::span<ASIOInputMonitor> batch) { return device.Execute(batch); }, ASE_SUCCESS);
+
+		WaitFor(worker, worker.Submit({ 0, 0, Gain0dB, 0, Center }));
+		auto status = worker.GetStatus();
+		CHECK(status.submitted == 1 && status.completed == 1 && status.failed == 0 && status.rejected == 0);
+		CHECK(status.lastResult == ASE_SUCCESS);
+
+		stub::device.failWith = 5;
+		WaitFor(worker, worker.Submit({ 1, 0, Gain0dB, 0, Center }));
+		status = worker.GetStatus();
+		CHECK(status.submitted == 2 && status.completed == 2 && status.failed == 1);
+		CHECK(status.lastResult == ASE_HWMalfunction);
+		CHECK(!device.shadow.IsValid(1));	// read back before the next command
+
+		stub::device.failWith = 0;
+		WaitFor(worker, worker.Submit({ ShadowMixer::MaxChannels, 0, Gain0dB, 0, Center }));	// no such input
+		status = worker.GetStatus();
+		CHECK(status.failed == 2 && status.lastResult == ASE_InvalidParameter);
+
+		WaitFor(worker, worker.Submit({ 1, 0, Gain0dB, 0, Center }));
+		CHECK(worker.GetStatus().lastResult == ASE_SUCCESS && device.shadow.IsValid(1));
+	});
+
+	Test("full queue", [] {
+		std::atomic<bool> entered{ false }, release{ false };
+		CommandWorker<ASIOInputMonitor, 4> worker([&](std::span<ASIOInputMonitor>) {
+			entered = true;
+			while (!release) std::this_thread::yield();
+			return ASE_SUCCESS;
+		}, ASE_SUCCESS);
+
+		CHECK(worker.Submit(Command(0)));
+		CHECK(Eventually([&] { return entered.load(); }));	// the worker holds the first one
+		for (int i = 1; i <= 4; i++) CHECK(worker.Submit(Command(i)) == (uint64_t)i + 1);
+		CHECK(!worker.Submit(Command(5)));
+		release = true;
+		CHECK(Eventually([&] { return worker.IsDone(5); }));
+		auto status = worker.GetStatus();
+		CHECK(status.submitted == 5 && status.completed == 5 && status.rejected == 1);
+		CHECK(worker.Submit(Command(6)));	// room again
+	});
+
+	Test("submission order", [] {
+		std::vector<long> executed;	// worker thread until the last command is done
+		Worker worker([&](std::span<ASIOInputMonitor> batch) {
+			for (auto& command : batch) executed.push_back(command.input * 1000 + command.gain);
+			return ASE_SUCCESS;
+		}, ASE_SUCCESS);
+
+		// From several threads: each thread's commands in its order
+		std::vector<std::thread> producers;
+		std::atomic<uint64_t> last{ 0 };
+		for (int t = 0; t < 4; t++)
+			producers.emplace_back([&, t] {
+				for (int i = 0; i < 200; i++) {
+					uint64_t ticket;
+					while (!(ticket = worker.Submit(Command(t, i)))) std::this_thread::yield();
+					uint64_t previous = last.load();
+					while (previous < ticket && !last.compare_exchange_weak(previous, ticket)) {}
+				}
+			});
+		for (auto& p : producers) p.join();
+		CHECK(Eventually([&] { return worker.IsDone(last); }));
+		CHECK(executed.size() == 800);
+		std::vector<long> next(4, 0);
+		bool ordered = true;
+		for (long x : executed) ordered &= x % 1000 == next[x / 1000]++;
+		CHECK(ordered);
+		CHECK(worker.GetStatus().submitted == 800);	// rejected ones were submitted again
+	});
+
+	Test("debounce", [] {
+		std::vector<size_t> batches;
+		Worker worker([&](std::span<ASIOInputMonitor> batch) {
+			batches.push_back(batch.size());
+			return ASE_SUCCESS;
+		}, ASE_SUCCESS, std::chrono::milliseconds(100), std::chrono::milliseconds(1000));
+
+		uint64_t ticket = 0;
+		for (int i = 0; i < 10; i++) ticket = worker.Submit(Command(i));
+		CHECK(!worker.IsDone(ticket));
+		CHECK(Eventually([&] { return worker.IsDone(ticket); }));
+		CHECK(batches == std::vector<size_t>{ 10 });
+	});
+
+	Test("debounce ends at the maximum delay", [] {
+		std::atomic<int> batches{ 0 };
+		Worker worker([&](std::span<ASIOInputMonitor>) {
+			batches++;
+			return ASE_SUCCESS;
+		}, ASE_SUCCESS, std::chrono::milliseconds(50), std::chrono::milliseconds(100));
+
+		// A command every 10 ms restarts the window each time, for half a second
+		uint64_t ticket = 0;
+		for (int i = 0; i < 50; i++) {
+			ticket = worker.Submit(Command(i % Inputs));
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		CHECK(Eventually([&] { return worker.IsDone(ticket); }));
+		CHECK(batches >= 3);
+	});
+
+	Test("deadline ends the debounce", [] {
+		CommandWorker<MonitorCommand> worker([&](std::span<MonitorCommand>) { return ASE_SUCCESS; },
+			ASE_SUCCESS, std::chrono::seconds(10), std::chrono::seconds(10));
+		MonitorCommand command{};
+		command.deadline = Clock::now() + std::chrono::milliseconds(20);
+		uint64_t ticket = worker.Submit(command);
+		CHECK(Eventually([&] { return worker.IsDone(ticket); }));
+	});
+
+	Test("idle handler", [] {
+		std::atomic<int> idle{ 0 };
+		Worker worker([&](std::span<ASIOInputMonitor>) { return ASE_SUCCESS; }, ASE_SUCCESS, {}, {},
+			[&] { idle++; }, std::chrono::milliseconds(10));
+		CHECK(Eventually([&] { return idle >= 1; }));	// right after the start
+		CHECK(Eventually([&] { return idle >= 3; }));
+		WaitFor(worker, worker.Submit(Command(0)));
+	});
+
+	Test("future", [] {
+		Device device(Profile, Inputs);
+		Worker worker([&](std::span<ASIOInputMonitor> batch) { return device.Execute(batch); }, ASE_SUCCESS);
+		uint64_t ticket = 0;
+		auto queue = [&](ASIOInputMonitor* params) -> long {
+			if (!params) return ASE_InvalidParameter;
+			ticket = worker.Submit(*params);
+			return ticket ? ASE_SUCCESS : ASE_HWMalfunction;
+		};
+
+		ASIOInputMonitor params{ 7, 0, Gain0dB, 0, Center };
+		CHECK(monitor::Future(kAsioCanInputMonitor, nullptr, queue) == ASE_SUCCESS);
+		CHECK(!monitor::Future(kAsioGetInternalBufferSamples, &params, queue));
+		CHECK(ticket == 0);
+		CHECK(monitor::Future(kAsioSetInputMonitor, &params, queue) == ASE_SUCCESS);
+		CHECK(ticket != 0);
+		WaitFor(worker, ticket);
+		CHECK(Crosspoints(7) == ShadowMixer::MinusInf);
+		CHECK(monitor::Future(kAsioSetInputMonitor, nullptr, queue) == ASE_InvalidParameter);
+	});
+
+	Test("coalesce", [] {
+		std::vector<ASIOInputMonitor> burst = {
+			{ 2, 0, 1, 1, 0 },
+			{ -1, 0, 2, 0, 0 },		// every input
+			{ 1, 0, 3, 1, 0 },
+			{ 9, 0, 4, 1, 0 },		// no such input
+			{ 1, 0, 5, 1, 0 },
+		};
+		auto merged = monitor::Coalesce<ASIOInputMonitor>(burst, 4);
+		CHECK(merged.size() == 4);
+		if (merged.size() != 4) return;
+		for (long i = 0; i < 4; i++) CHECK(merged[i].input == i);
+		CHECK(merged[0].gain == 2 && merged[0].state == 0);
+		CHECK(merged[1].gain == 5 && merged[1].state == 1);
+		CHECK(merged[2].gain == 2 && merged[3].gain == 2);
+
+		CHECK(monitor::Coalesce<ASIOInputMonitor>(burst, 0).empty());
+		CHECK(monitor::Coalesce<ASIOInputMonitor>(std::span<const ASIOInputMonitor>(burst).first(1), 4).size() == 1);
+	});
+
+	return Summary();
+}
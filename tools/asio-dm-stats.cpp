@@ -0,0 +1,75 @@
+// Live statistics of the plugin running inside a DAW.
+//
+// The plugin publishes its counters and latency histograms in shared memory named
+// after the host's process id (see stats.h). This reads them without disturbing the
+// host: no locks, no messages, the host doesn't even know.
+//
+// Build:
+//     Windows: cl /std:c++20 /EHsc /O2 tools\asio-dm-stats.cpp
+//     Linux:   g++ -std=c++20 -O2 tools/asio-dm-stats.cpp -o asio-dm-stats
+//
+// Usage:
+//     asio-dm-stats <host process id> [refresh interval in ms, 0 = print once]
+//
+// The process id is in the plugin's log ("Statistics: run asio-dm-stats ...") or in
+// Task Manager.
+
+#include "../asio-dm-activator/stats.h"
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+
+static void PrintDuration(uint64_t ns) {
+	if (ns < 10000) printf(" %8llu ns", (unsigned long long)ns);
+	else if (ns < 10000000) printf(" %8.1f us", ns / 1e3);
+	else printf(" %8.1f ms", ns / 1e6);
+}
+
+
+static void Print(const StatsBlock& stats) {
+	printf("asio-dm-activator in process %u\n\n", stats.pid);
+	for (int i = 0; i < StatsBlock::CounterCount; i++)
+		printf("%-20s %12llu\n", StatsBlock::CounterNames[i], (unsigned long long)stats.Get((StatsBlock::Counter)i));
+
+	// Misses the plugin caused would overlap its work more often than switches do
+	if (uint64_t callbacks = stats.Get(StatsBlock::Callbacks)) {
+		uint64_t misses = stats.Get(StatsBlock::DeadlineMisses);
+		printf("\nplugin busy during %.1f%% of buffer switches", 100.0 * stats.Get(StatsBlock::CallbacksWhileBusy) / callbacks);
+		if (misses) printf(" and %.1f%% of deadline misses", 100.0 * stats.Get(StatsBlock::MissesWhileBusy) / misses);
+		printf("\n");
+	}
+
+	printf("\n%-20s %10s %11s %11s %11s %11s %11s\n", "latency", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (int i = 0; i < StatsBlock::HistogramCount; i++) {
+		const auto& h = stats.histograms[i];
+		printf("%-20s %10llu", StatsBlock::HistogramNames[i], (unsigned long long)h.Count());
+		for (double p : { 0.5, 0.9, 0.99, 0.999 })
+			PrintDuration(h.Percentile(p));
+		PrintDuration(h.Max());
+		printf("\n");
+	}
+}
+
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: asio-dm-stats <host process id> [refresh interval in ms, 0 = print once]\n");
+		return 2;
+	}
+	uint32_t pid = (uint32_t)strtoul(argv[1], nullptr, 10);
+	int interval = argc > 2 ? atoi(argv[2]) : 1000;
+
+	auto stats = StatsBlock::Open(pid);
+	if (!stats) {
+		fprintf(stderr, "No statistics for process %u: not running, no plugin loaded, or another plugin version\n", pid);
+		return 1;
+	}
+	while (true) {
+		if (interval > 0) printf("\x1b[H\x1b[2J");	// clear the terminal
+		Print(*stats);
+		fflush(stdout);
+		if (interval <= 0) return 0;
+		std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+	}
+}